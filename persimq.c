@@ -5,13 +5,29 @@
 // Author: MrKirushko
 // ---------------------------------------------------------------------------
 
+#define _GNU_SOURCE       // fallocate()
 #include <stdio.h>
+#include <stdlib.h>
 #include <inttypes.h> // printf() definitions for stdint
 #include <string.h>   // memcpy() and others
+#include <strings.h>  // strcasecmp()
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#ifdef __linux__
+    #include <linux/fs.h> // FICLONE
+#endif
+#include <fcntl.h>
 #include <errno.h>
+#include <limits.h>   // IOV_MAX
+#include <ctype.h>
+#include <stddef.h>   // offsetof()
+#include <pthread.h>
+#include <time.h>
 
 #include "persimq.h"
 
@@ -33,18 +49,203 @@ typedef struct {
     uint32_t message_size;
 } TMessageHeader;
 
+// Padding records ("PMP" ID) keep the payloads aligned (see the "payload_alignment" option).
+// They take queue space but are not messages and are skipped by the readers.
+static const uint8_t padding_data[PERSIMQ_MAX_PAYLOAD_ALIGNMENT + sizeof(TMessageHeader)];
+
+// Blob reference records ("PMB" ID) are messages with the payload kept in the blob file
+// (see the "blob_threshold" option). The record payload is the reference.
+typedef struct __attribute__((packed)) {
+    uint64_t offset;  // Payload offset in the blob file
+    uint32_t size;
+    uint8_t crc;      // CRC of the payload
+} TBlobRef;
+
+// Compressed frame records ("PMZ" ID) hold a compressed run of message records (see the
+// "compress_watermark" option). The payload is the frame header and the compressed data. The
+// record CRC only covers the compressed data so that the pop state can be updated in place.
+// The pop state is written before the file header, "consumed" is valid if the file header has
+// the same "append_ptr" and "count_messages" as stored here and "prev_consumed" otherwise.
+typedef struct __attribute__((packed)) {
+    uint32_t messages;
+    uint32_t raw_size;      // Size of the message records after decompression
+    uint32_t consumed;      // Messages popped from the frame
+    uint32_t prev_consumed;
+    uint64_t state_append;
+    uint64_t state_count;
+} TFrame;
+
+// Jump records ("PMJ" ID) are padding of any size: the header is followed by dead data.
+
+// Location of a message payload: in the queue file, in the blob file or in memory (frames).
+typedef struct {
+    const uint8_t* data; // NULL - the payload is in a file
+    bool in_blob;
+    uint64_t offset;
+    uint32_t size;
+    uint8_t crc;
+} TPayload;
+
+// Returns "true" for the records which are messages ("PMQ" and "PMB").
+static bool is_message(const TMessageHeader* header)
+{
+    return !memcmp(header->ID, "PMQ", 3) || !memcmp(header->ID, "PMB", 3);
+}
+
+// Returns "true" for the records which are skipped by the readers ("PMP" and "PMJ").
+static bool is_padding(const TMessageHeader* header)
+{
+    return (!memcmp(header->ID, "PMP", 3) && (header->message_size < PERSIMQ_MAX_PAYLOAD_ALIGNMENT)) ||
+        !memcmp(header->ID, "PMJ", 3);
+}
+
+// Queue state stored in a shared state file slot.
+typedef struct {
+    uint64_t append_ptr;
+    uint64_t extract_ptr;
+    uint64_t count_bytes;
+    uint64_t count_messages;
+    TFileHeader header;                  // Queue file header the state is newer than
+    uint8_t crc;
+} TStateSlot;
+
+// Shared state file (see the "shared_state" option).
+typedef struct {
+    char ID[4];
+    char boot_id[36];                    // The state is only valid until the system is restarted
+    uint64_t file_size;
+    uint32_t active;                     // Slot holding the current state
+    TStateSlot slots[2];
+} TStateFile;
+
+// Private state of the optional features.
+struct persimq_ext {
+    pthread_mutex_t lock;                // Guards the caches against shrinking by other threads
+    struct persimq_ext* prev;            // Memory registry links
+    struct persimq_ext* next;
+    uint64_t last_used;                  // LRU tick
+    size_t memory_used;
+    size_t memory_pinned;                // Part of memory_used which can not be released (see mem_pin())
+    // Consumer read cache (a linear copy of the file data at cache_offset)
+    uint8_t* cache;
+    size_t cache_size;
+    off_t cache_offset;
+    size_t cache_length;
+    // Burst mode staging buffer (the newest records which have not been written yet)
+    uint8_t* staging;
+    size_t staging_size;
+    off_t staged_offset;
+    size_t staged_length;
+    uint64_t staged_count;
+    uint64_t staged_messages;            // Messages among the staged records (no padding)
+    struct timespec staged_since;
+    T_PERSIMQ_BurstStats burst_stats;
+    // Page cache management positions
+    off_t advised_extract;               // Everything before it has been dropped already
+    off_t readahead_ptr;                 // Readahead has been requested up to this offset
+    off_t synced_append;                 // append_ptr at the last sync
+    // Shared state file mapping
+    int state_fd;
+    TStateFile* state;
+    TFileHeader file_header;             // The header in the queue file (the state is only valid with it)
+    // Concurrent readers (the offsets are accessed atomically)
+    uint32_t live_sequence;              // Odd while the live range is being changed
+    off_t live_start;                    // Published queue range the readers may walk
+    off_t live_end;
+    uint32_t reader_count;
+    off_t reader_pins[PERSIMQ_MAX_READERS]; // Oldest offset each reader may read (0 - free slot)
+    // Stall detector
+    pthread_mutex_t stall_lock;          // Guards the stall statistics (taken with or without the lock)
+    T_PERSIMQ_StallStats stall_stats;
+    int64_t stall_base[4];               // System counters at the last sync (see stall_read_counters())
+    int stall_fds[2];                    // /proc/self/io and /proc/pressure/io (-1 - not available)
+    bool stall_fds_open;
+    // Block hash tree file mapping
+    int hash_fd;
+    struct THashFile* hashes;
+    size_t hash_map_size;
+    uint64_t hash_blocks;                // Data section blocks
+    uint64_t* hash_dirty;                // Blocks written since the last tree update (bitmap)
+    bool hash_any_dirty;
+    // Newest-first index (a ring of the offsets of the newest message records)
+    off_t* tail_offsets;
+    uint32_t tail_head;                  // Slot for the next record
+    uint32_t tail_count;
+    off_t tail_append;                   // append_ptr the index is up to date with
+    bool tail_valid;
+    // Cancelled message records (tombstones) and their file
+    char* cancel_path;
+    int cancel_fd;                       // New cancel file waiting for the sync (0 - none)
+    off_t* cancel_offsets;
+    uint32_t cancel_count;
+    uint32_t cancel_epoch;               // Times append_ptr went back to the file start
+    bool cancel_dirty;                   // Changed since the file was written
+    bool cancel_unsynced;                // Written since the last sync
+    // Blob file (payloads of the big messages, stored one after another)
+    int blob_fd;
+    off_t blob_end;                      // The next payload goes here
+    off_t blob_released;                 // Everything before it belongs to popped messages
+    off_t blob_punched;                  // Everything before it (but the kept "dedup" blobs) has been given
+                                         // back to the file system
+    bool blob_unsynced;                  // Written since the last sync
+    bool blob_no_punch;                  // The file system can not punch holes (the file is only truncated)
+    struct blob_dedup* dedup;            // Stored blobs by payload hash (see the "blob_dedup" option)
+    off_t dedup_floor;                   // Blobs from here on may have references missing in "dedup" (-1 - none)
+    // Backlog compression
+    uint8_t* frame_data;                 // The last decompressed frame
+    size_t frame_size;
+    off_t frame_offset;                  // Record offset of the frame (0 - none)
+    size_t frame_length;
+    uint32_t frame_index;                // Message at frame_pos
+    size_t frame_pos;
+    off_t head_frame;                    // Frame being popped (0 - none)
+    uint32_t head_consumed;
+    uint32_t head_saved;                 // Pop state matching the file header
+    uint32_t head_disk;                  // "consumed" in the file
+    uint32_t head_prev;                  // "prev_consumed" in the file
+    off_t compress_append;               // append_ptr at the last compression run
+    bool compressing;
+    uint64_t device_unsynced;            // Bytes written since the last sync (device model)
+    bool tx_pending;                     // Part of a transaction which has not been committed yet
+    int tx_mark_fd;                      // "<queue file>.tx" (0 - none, see tx_mark())
+    uint64_t tx_mark_sequence;           // Commit whose header has to be durable before the next one
+    uint64_t tx_mark_dev;                // Log of that commit
+    uint64_t tx_mark_ino;
+};
+
 // CRC8 is used for header integrity checks.
-static uint8_t eval_crc8(uint8_t* data, size_t length)
+// CRC of every byte value (polynomial 0x8C, MSB first), one lookup replaces the 8 bit steps.
+static const uint8_t crc8_table[256] = {
+    0x00, 0x8C, 0x94, 0x18, 0xA4, 0x28, 0x30, 0xBC, 0xC4, 0x48, 0x50, 0xDC, 0x60, 0xEC, 0xF4, 0x78,
+    0x04, 0x88, 0x90, 0x1C, 0xA0, 0x2C, 0x34, 0xB8, 0xC0, 0x4C, 0x54, 0xD8, 0x64, 0xE8, 0xF0, 0x7C,
+    0x08, 0x84, 0x9C, 0x10, 0xAC, 0x20, 0x38, 0xB4, 0xCC, 0x40, 0x58, 0xD4, 0x68, 0xE4, 0xFC, 0x70,
+    0x0C, 0x80, 0x98, 0x14, 0xA8, 0x24, 0x3C, 0xB0, 0xC8, 0x44, 0x5C, 0xD0, 0x6C, 0xE0, 0xF8, 0x74,
+    0x10, 0x9C, 0x84, 0x08, 0xB4, 0x38, 0x20, 0xAC, 0xD4, 0x58, 0x40, 0xCC, 0x70, 0xFC, 0xE4, 0x68,
+    0x14, 0x98, 0x80, 0x0C, 0xB0, 0x3C, 0x24, 0xA8, 0xD0, 0x5C, 0x44, 0xC8, 0x74, 0xF8, 0xE0, 0x6C,
+    0x18, 0x94, 0x8C, 0x00, 0xBC, 0x30, 0x28, 0xA4, 0xDC, 0x50, 0x48, 0xC4, 0x78, 0xF4, 0xEC, 0x60,
+    0x1C, 0x90, 0x88, 0x04, 0xB8, 0x34, 0x2C, 0xA0, 0xD8, 0x54, 0x4C, 0xC0, 0x7C, 0xF0, 0xE8, 0x64,
+    0x20, 0xAC, 0xB4, 0x38, 0x84, 0x08, 0x10, 0x9C, 0xE4, 0x68, 0x70, 0xFC, 0x40, 0xCC, 0xD4, 0x58,
+    0x24, 0xA8, 0xB0, 0x3C, 0x80, 0x0C, 0x14, 0x98, 0xE0, 0x6C, 0x74, 0xF8, 0x44, 0xC8, 0xD0, 0x5C,
+    0x28, 0xA4, 0xBC, 0x30, 0x8C, 0x00, 0x18, 0x94, 0xEC, 0x60, 0x78, 0xF4, 0x48, 0xC4, 0xDC, 0x50,
+    0x2C, 0xA0, 0xB8, 0x34, 0x88, 0x04, 0x1C, 0x90, 0xE8, 0x64, 0x7C, 0xF0, 0x4C, 0xC0, 0xD8, 0x54,
+    0x30, 0xBC, 0xA4, 0x28, 0x94, 0x18, 0x00, 0x8C, 0xF4, 0x78, 0x60, 0xEC, 0x50, 0xDC, 0xC4, 0x48,
+    0x34, 0xB8, 0xA0, 0x2C, 0x90, 0x1C, 0x04, 0x88, 0xF0, 0x7C, 0x64, 0xE8, 0x54, 0xD8, 0xC0, 0x4C,
+    0x38, 0xB4, 0xAC, 0x20, 0x9C, 0x10, 0x08, 0x84, 0xFC, 0x70, 0x68, 0xE4, 0x58, 0xD4, 0xCC, 0x40,
+    0x3C, 0xB0, 0xA8, 0x24, 0x98, 0x14, 0x0C, 0x80, 0xF8, 0x74, 0x6C, 0xE0, 0x5C, 0xD0, 0xC8, 0x44,
+};
+
+// eval_crc8_continue() allows to evaluate the CRC of data split into several parts.
+static uint8_t eval_crc8_continue(register uint8_t crc, uint8_t* data, size_t length)
 {
-    register uint8_t crc = 0;
     for (register size_t byte_idx = 0; byte_idx < length; byte_idx++) {
-        crc ^= data[byte_idx];
-        for (register uint8_t bit = 0; bit < 8; bit++) {
-            crc = (crc & 0x80) ? (crc << 1) ^ 0x8C : (crc << 1);
-        }
+        crc = crc8_table[crc ^ data[byte_idx]];
     }
     return crc;
 }
+static uint8_t eval_crc8(uint8_t* data, size_t length)
+{
+    return eval_crc8_continue(0, data, length);
+}
 
 static T_PERSIMQ_DebugVerbosityLevel PERSIMQ_Verbosity = PERSIMQ_VERBOSITY_ERRORS_ONLY;
 
@@ -61,29 +262,31 @@ static off_t offset_roll(off_t current_offset, off_t wrap_hi_margin, size_t incr
 
 // POSIX read and write operations can get interrupted by signals so
 // we may need to repeat the syscalls to get to all the requred data.
-static bool multiread(int fd, void* data, size_t length)
+static bool multiread(int fd, void* data, size_t length, off_t offset)
 {
     if (PERSIMQ_Verbosity == PERSIMQ_VERBOSITY_DEBUG_2) {
         printf("multiread() for %" PRIu64 " bytes...\n", (uint64_t)length); fflush(stdout);
     }
     do {
-        ssize_t result = read(fd, data, length);
+        ssize_t result = pread(fd, data, length, offset);
         if (result <= 0) return false;
         length -= result;
         data += result;
+        offset += result;
     } while (length);
     return true;
 }
-static bool multiwrite(int fd, void* data, size_t length)
+static bool multiwrite(int fd, void* data, size_t length, off_t offset)
 {
     if (PERSIMQ_Verbosity == PERSIMQ_VERBOSITY_DEBUG_2) {
         printf("multiwrite() for %" PRIu64 " bytes...\n", (uint64_t)length); fflush(stdout);
     }
     do {
-        ssize_t result = write(fd, data, length);
+        ssize_t result = pwrite(fd, data, length, offset);
         if (result <= 0) return false;
         length -= result;
         data += result;
+        offset += result;
     } while (length);
     return true;
 }
@@ -93,7 +296,7 @@ static bool wrapped_io(int fd, void* data, const size_t length, off_t offset,
     const off_t wrap_hi_margin, off_t* next_offset, const bool do_write)
 {
     bool result = true;
-    bool (*io_function)(int, void*, size_t) = do_write ? &multiwrite : &multiread;
+    bool (*io_function)(int, void*, size_t, off_t) = do_write ? &multiwrite : &multiread;
     // Do a zero increment to make sure that the offset is within bounds.
     offset = offset_roll(offset, wrap_hi_margin, 0);
     size_t first_chunk_size = (wrap_hi_margin - offset);
@@ -119,437 +322,5349 @@ static bool wrapped_io(int fd, void* data, const size_t length, off_t offset,
         if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_DEBUG) {
             printf("Single I/O...\n"); fflush(stdout);
         }
-        result &= (lseek(fd, offset, SEEK_SET) >= 0);
-        result &= io_function(fd, data, length);
+        result &= io_function(fd, data, length, offset);
     } else {
         // Partial wrap, 2 I/O oreations are needed
         if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_DEBUG) {
             printf("Double I/O...\n"); fflush(stdout);
         }
-        result &= (lseek(fd, offset, SEEK_SET) >= 0);
-        result &= io_function(fd, data, first_chunk_size);
-        result &= (lseek(fd, wrap_lo_margin, SEEK_SET) >= 0);
-        result &= io_function(fd, data + first_chunk_size, length-first_chunk_size);
+        result &= io_function(fd, data, first_chunk_size, offset);
+        result &= io_function(fd, data + first_chunk_size, length-first_chunk_size, wrap_lo_margin);
     }
     if (next_offset) *next_offset = offset_roll(offset, wrap_hi_margin, length);
     return result;
 }
 
-// Opens a queue file and initializes a T_PERSIMQ struct.
-bool PERSIMQ_open(T_PERSIMQ* mq, char* mqfile_path, off_t mqfile_size)
+static bool PERSIMQ_tx_recover(T_PERSIMQ* mq);
+static bool tx_mark_open(T_PERSIMQ* mq, const char* mqfile_path);
+static bool tx_mark(T_PERSIMQ* mq);
+static uint64_t hash_data(const uint8_t* data, size_t length);
+static uint64_t hash_parts(const struct iovec* parts, int part_count, size_t length);
+typedef enum { DEVICE_READ = 0, DEVICE_WRITE, DEVICE_SYNC } T_DeviceOp;
+static void device_delay(T_PERSIMQ* mq, T_DeviceOp op, off_t offset, size_t length);
+static bool PERSIMQ_write_header(T_PERSIMQ* mq);
+static void readers_publish(T_PERSIMQ* mq);
+static void readers_live_range(struct persimq_ext* ext, off_t* live_start, off_t* live_end);
+static void hash_mark(T_PERSIMQ* mq, off_t offset, size_t length);
+static void tail_add(T_PERSIMQ* mq, off_t offset);
+static void tail_reset(T_PERSIMQ* mq);
+static int cancel_find(struct persimq_ext* ext, off_t offset);
+static void cancel_forget(T_PERSIMQ* mq, off_t offset, size_t length);
+static bool cancel_skip(T_PERSIMQ* mq, off_t* record_size);
+static bool cancel_save(T_PERSIMQ* mq);
+static bool cancel_sync(T_PERSIMQ* mq);
+static void cancel_wrapped(T_PERSIMQ* mq, off_t old_append);
+static void cancel_reset(T_PERSIMQ* mq);
+static off_t cancel_key(T_PERSIMQ* mq, off_t offset, uint8_t crc);
+static bool cancel_open(T_PERSIMQ* mq, const char* mqfile_path);
+static bool frame_load(T_PERSIMQ* mq, const TMessageHeader* header, off_t record_ptr, TFrame* frame);
+static bool frame_payload(T_PERSIMQ* mq, uint32_t index, TPayload* payload);
+static bool frame_pop(T_PERSIMQ* mq, const TMessageHeader* header, off_t record_ptr, bool* frame_done);
+static void frame_reset(T_PERSIMQ* mq);
+static bool frame_save(T_PERSIMQ* mq);
+static uint32_t frame_consumed(T_PERSIMQ* mq, off_t record_ptr, const TFrame* frame);
+static bool frame_size_valid(T_PERSIMQ* mq, const TFrame* frame);
+static size_t lz_decompress(const uint8_t* in, size_t length, uint8_t* out, size_t out_size);
+static void compress_check(T_PERSIMQ* mq);
+static void frame_open(T_PERSIMQ* mq);
+static bool PERSIMQ_locate_payload(T_PERSIMQ* mq, const TMessageHeader* header, off_t message_ptr,
+    TPayload* payload);
+static bool PERSIMQ_read_message_header(T_PERSIMQ* mq, TMessageHeader* header, off_t* offset);
+static bool PERSIMQ_read_message_data(T_PERSIMQ* mq, void* buffer, size_t buffer_size,
+    const size_t message_size, const uint8_t message_crc,
+    const off_t extract_ptr);
+
+// --- Memory budget ---
+// All the cache and buffer memory is taken from a process-wide pool of power of two sized
+// blocks. Released blocks are kept in the pool for reuse by other queues. When the budget is
+// exceeded the pool is trimmed first and then the caches of the least recently used queues are
+// released. A queue that is in use by another thread at that moment is skipped.
+// The tables a queue can not work without (the dedup table, the newest-first index, the
+// tombstones, the hash tree bitmap and the decompressed frame) are allocated directly but counted
+// as well: they are never refused, the caches of the other queues make room for them.
+
+#define MEM_MIN_BLOCK_SHIFT   (12)
+#define MEM_CLASSES           (40)
+#define MEM_POOL_LIMIT        (4*1024*1024) // Pool size limit when no budget is set
+
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct persimq_ext* mem_registry = NULL;
+static void* mem_free_lists[MEM_CLASSES];
+static T_PERSIMQ_MemoryStats mem_stats;
+static uint64_t mem_tick = 0;
+
+static void persimq_ext_shrink(struct persimq_ext* ext);
+static void state_close(struct persimq_ext* ext);
+static void hash_close(struct persimq_ext* ext);
+static bool hash_check(T_PERSIMQ* mq, uint64_t leaf_count);
+static void cancel_close(struct persimq_ext* ext);
+static void blob_close(struct persimq_ext* ext);
+
+static unsigned mem_class(size_t size)
 {
-    // some sanity checks
-    if (mqfile_size <= (sizeof(TFileHeader) + sizeof(TMessageHeader) + 1)) {
-        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            fprintf(stderr, "PERSIMQ_open: file size error!\n"); fflush(stderr);
-        }
-        return false; // Requestd file size is not big enough to fit anytnig useful
+    unsigned size_class = 0;
+    while (((size_t)1 << (size_class + MEM_MIN_BLOCK_SHIFT)) < size) size_class++;
+    return size_class;
+}
+
+// Returns a block to the pool (mem_lock must be held).
+static void mem_put_locked(struct persimq_ext* ext, void* block, size_t size)
+{
+    unsigned size_class = mem_class(size);
+    size = (size_t)1 << (size_class + MEM_MIN_BLOCK_SHIFT);
+    ext->memory_used -= size;
+    mem_stats.used -= size;
+    size_t pool_limit = !mem_stats.budget ? MEM_POOL_LIMIT :
+        (mem_stats.budget > mem_stats.used) ? mem_stats.budget - mem_stats.used : 0;
+    if (mem_stats.pooled + size > pool_limit) {
+        free(block);
+    } else {
+        *(void**)block = mem_free_lists[size_class];
+        mem_free_lists[size_class] = block;
+        mem_stats.pooled += size;
     }
+}
 
-    // Open the file (create if does not exist)
-    mode_t oldpermmask = umask(0); // Allow S_IRGRP disabled by the mask by default
-    if ((mq->fd = open(mqfile_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) == -1) {
-        mq->fd = 0;
-        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            perror("PERSIMQ_open: file open");
+// Frees pooled blocks until "needed" more bytes fit into the budget (mem_lock must be held).
+static void mem_trim_locked(size_t needed)
+{
+    for (unsigned size_class = 0; size_class < MEM_CLASSES; size_class++) {
+        while (mem_free_lists[size_class] && (mem_stats.used + mem_stats.pooled + needed > mem_stats.budget)) {
+            void* block = mem_free_lists[size_class];
+            mem_free_lists[size_class] = *(void**)block;
+            mem_stats.pooled -= (size_t)1 << (size_class + MEM_MIN_BLOCK_SHIFT);
+            free(block);
         }
-        return false;
     }
-    umask(oldpermmask); // Restore the mask
+}
 
-    #ifdef __unix__
-        if (flock(mq->fd, LOCK_EX)) {
-            mq->fd = 0;
-            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-                perror("PERSIMQ_open: file lock");
+// Returns the memory persimq_ext_shrink() would release (ext->lock must be held).
+static size_t mem_releasable(struct persimq_ext* ext)
+{
+    size_t kept = ext->memory_pinned;
+    if (ext->staging && ext->staged_length) { // Staged data can only be released by writing it
+        kept += (size_t)1 << (mem_class(ext->staging_size) + MEM_MIN_BLOCK_SHIFT);
+    }
+    return (ext->memory_used > kept) ? ext->memory_used - kept : 0;
+}
+
+// Releases the pool and the caches of the least recently used queues until "size" more bytes fit
+// into the budget or nothing else can be released (mem_lock must be held).
+static void mem_make_room_locked(struct persimq_ext* ext, size_t size)
+{
+    if (mem_stats.used + mem_stats.pooled + size > mem_stats.budget) mem_trim_locked(size);
+    while (mem_stats.used + size > mem_stats.budget) {
+        struct persimq_ext* victim = NULL;
+        for (struct persimq_ext* other = mem_registry; other; other = other->next) {
+            if ((other != ext) && (other->memory_used > other->memory_pinned) &&
+                    (!victim || (other->last_used < victim->last_used))) {
+                if (!pthread_mutex_trylock(&other->lock)) { // Skip the queues being used right now
+                    if (!mem_releasable(other)) { // Only staged data left
+                        pthread_mutex_unlock(&other->lock);
+                        continue;
+                    }
+                    if (victim) pthread_mutex_unlock(&victim->lock);
+                    victim = other;
+                }
             }
-            return false;
         }
-    #endif
+        if (!victim) break;
+        size_t used = mem_stats.used;
+        persimq_ext_shrink(victim);
+        pthread_mutex_unlock(&victim->lock);
+        mem_stats.shrinks++;
+        mem_trim_locked(size);
+        if (mem_stats.used == used) break; // Never pick the same victim again and again
+    }
+}
 
-    // Fill the file with zeroes up to the required size in case it has just been created
-    if (ftruncate(mq->fd, mqfile_size)) return false;
+// Counts the memory of a table a queue can not work without (a negative "size" when it is freed).
+static void mem_pin(struct persimq_ext* ext, ssize_t size)
+{
+    pthread_mutex_lock(&mem_lock);
+    if ((size > 0) && mem_stats.budget) mem_make_room_locked(ext, size);
+    ext->memory_used += size;
+    ext->memory_pinned += size;
+    mem_stats.used += size;
+    pthread_mutex_unlock(&mem_lock);
+}
 
-    // Initialize the queue structure
-    if (lseek(mq->fd, 0, SEEK_SET) < 0) { // Error
-        #ifdef __unix__
-            flock(mq->fd, LOCK_UN);
-        #endif
-        close(mq->fd);
-        mq->fd = 0;
-        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            perror("PERSIMQ_open(): file lseek");
-        }
-        return false;
+// Allocates a cache/buffer block for a queue. NULL is returned if the budget does not allow it.
+static void* persimq_mem_alloc(struct persimq_ext* ext, size_t size)
+{
+    unsigned size_class = mem_class(size);
+    if (size_class >= MEM_CLASSES) return NULL;
+    size = (size_t)1 << (size_class + MEM_MIN_BLOCK_SHIFT);
+    pthread_mutex_lock(&mem_lock);
+    void* block = mem_free_lists[size_class];
+    if (block) {
+        mem_free_lists[size_class] = *(void**)block;
+        mem_stats.pooled -= size;
+    } else if (mem_stats.budget) {
+        mem_make_room_locked(ext, size);
     }
-    TFileHeader header;
-    if (!multiread(mq->fd, (void*)&header, sizeof(header))) { // Error
-        #ifdef __unix__
-            flock(mq->fd, LOCK_UN);
-        #endif
-        close(mq->fd);
-        mq->fd = 0;
-        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            perror("PERSIMQ_open(): file read");
-        }
-        return false;
+    if (!block && (!mem_stats.budget || (mem_stats.used + mem_stats.pooled + size <= mem_stats.budget))) {
+        block = malloc(size);
     }
-    uint8_t crc = eval_crc8((void*)&header, sizeof(header)-1);
-    if (!strncmp((void*)&header.ID, "lPmQ", 4) &&
-            (crc == header.crc) &&
-            (mqfile_size == header.file_size)) {
-        // Header found
-        mq->append_ptr = header.append_ptr;
-        mq->extract_ptr = header.extract_ptr;
-        mq->count_bytes = header.count_bytes;
-        mq->count_messages = header.count_messages;
+    if (block) {
+        ext->memory_used += size;
+        mem_stats.used += size;
     } else {
-        // New queue file or file size changed or damaged header
-        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_AND_WARNINGS) {
-            printf("PERSIMQ_open(): incorrect file header - new or damaged queue file detected!\n");
-        }
-        mq->append_ptr = sizeof(TFileHeader);
-        mq->extract_ptr = sizeof(TFileHeader);
-        mq->count_bytes = 0;
-        mq->count_messages = 0;
+        mem_stats.denied++;
     }
-    mq->file_size = mqfile_size;
-    if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_INFO) {
-        printf("PERSIMQ_open(): append_ptr=0x%" PRIX64 ", extract_ptr=0x%" PRIX64
-            ", count_bytes=%" PRId64 ", count_messages=%" PRId64 ", file_size=%" PRId64 ".\n",
-            (uint64_t)mq->append_ptr, (uint64_t)mq->extract_ptr,
-            (uint64_t)mq->count_bytes, (uint64_t)mq->count_messages, (uint64_t)mq->file_size); fflush(stdout);
+    pthread_mutex_unlock(&mem_lock);
+    return block;
+}
+
+// Releases all the memory a queue can live without (ext->lock and mem_lock must be held).
+static void persimq_ext_shrink(struct persimq_ext* ext)
+{
+    if (ext->cache) {
+        mem_put_locked(ext, ext->cache, ext->cache_size);
+        ext->cache = NULL;
+        ext->cache_length = 0;
+    }
+    if (ext->staging && !ext->staged_length) { // Staged data can only be released by writing it
+        mem_put_locked(ext, ext->staging, ext->staging_size);
+        ext->staging = NULL;
     }
-    // Done
-    return true;
 }
 
-bool PERSIMQ_is_open(T_PERSIMQ* mq)
+static struct persimq_ext* persimq_ext_create(void)
 {
-    return (mq->fd);
+    struct persimq_ext* ext = calloc(1, sizeof(struct persimq_ext));
+    if (!ext) return NULL;
+    pthread_mutex_init(&ext->lock, NULL);
+    pthread_mutex_init(&ext->stall_lock, NULL);
+    pthread_mutex_lock(&mem_lock);
+    ext->next = mem_registry;
+    if (mem_registry) mem_registry->prev = ext;
+    mem_registry = ext;
+    pthread_mutex_unlock(&mem_lock);
+    return ext;
 }
 
-// Writes all the changes and closes a queue file.
-bool PERSIMQ_close(T_PERSIMQ* mq)
+static void persimq_ext_destroy(struct persimq_ext* ext)
 {
-    if (!mq->fd) return true; // File already closed, do not attempt to close stdout.
-    bool result = true;
-    result &= PERSIMQ_sync(mq);
-    #ifdef __unix__
-        flock(mq->fd, LOCK_UN); // May not be necesary but just in case...
-    #endif
-    result &= (close(mq->fd) >= 0);
-    return result;
+    if (!ext) return;
+    pthread_mutex_lock(&mem_lock);
+    pthread_mutex_lock(&ext->lock);
+    ext->staged_length = 0; // Unwritten data is dropped together with the queue
+    persimq_ext_shrink(ext);
+    pthread_mutex_unlock(&ext->lock);
+    mem_stats.used -= ext->memory_pinned; // The tables are freed below
+    if (ext->prev) ext->prev->next = ext->next; else mem_registry = ext->next;
+    if (ext->next) ext->next->prev = ext->prev;
+    pthread_mutex_unlock(&mem_lock);
+    pthread_mutex_destroy(&ext->lock);
+    pthread_mutex_destroy(&ext->stall_lock);
+    if (ext->stall_fds_open) {
+        for (int idx = 0; idx < 2; idx++) if (ext->stall_fds[idx] >= 0) close(ext->stall_fds[idx]);
+    }
+    state_close(ext);
+    hash_close(ext);
+    free(ext->tail_offsets);
+    cancel_close(ext);
+    blob_close(ext);
+    if (ext->tx_mark_fd) close(ext->tx_mark_fd);
+    free(ext->dedup);
+    free(ext->frame_data);
+    free(ext);
 }
 
-// Closes a queue file without updating the metadata.
-bool PERSIMQ_drop(T_PERSIMQ* mq)
+// Sets the process-wide memory budget for the caches and buffers of all queues.
+void PERSIMQ_set_memory_budget(size_t budget_bytes)
 {
-    if (!mq->fd) return true; // File already closed, do not attempt to close stdout.
-    #ifdef __unix__
-        flock(mq->fd, LOCK_UN); // May not be necesary but just in case...
-    #endif
-    return (close(mq->fd) >= 0);
+    pthread_mutex_lock(&mem_lock);
+    mem_stats.budget = budget_bytes;
+    if (budget_bytes) mem_trim_locked(0);
+    pthread_mutex_unlock(&mem_lock);
 }
 
-// Clears the queue and writes the changes to the queue file.
-bool PERSIMQ_clear(T_PERSIMQ* mq)
+// Returns the library memory usage statistics.
+void PERSIMQ_memory_stats(T_PERSIMQ_MemoryStats* stats)
 {
-    if (!mq->fd) return false; // MQ uninitialized, file not opened.
-    mq->append_ptr = sizeof(TFileHeader);
-    mq->extract_ptr = sizeof(TFileHeader);
-    mq->count_bytes = 0;
-    mq->count_messages = 0;
-    return PERSIMQ_sync(mq);
+    pthread_mutex_lock(&mem_lock);
+    *stats = mem_stats;
+    pthread_mutex_unlock(&mem_lock);
 }
 
-// Writes current queue changes to the queue file.
-bool PERSIMQ_sync(T_PERSIMQ* mq)
+// Ruturns the amount of memory used by a queue.
+size_t PERSIMQ_memory_used(T_PERSIMQ* mq)
 {
-    if (!mq->fd) return false; // MQ uninitialized, file not opened.
-    bool result = true;
-    result &= (lseek(mq->fd, 0, SEEK_SET) >= 0);
-    TFileHeader header = {
-        "lPmQ",
-        mq->append_ptr,
-        mq->extract_ptr,
-        mq->count_bytes,
-        mq->count_messages,
-        mq->file_size,
-        0 // crc is filled in below
-    };
-    header.crc = eval_crc8((void*)&header, sizeof(header)-1);
-    result &= multiwrite(mq->fd, (void*)&header, sizeof(header));
-    #ifdef __unix__
-        result &= (fsync(mq->fd) >= 0);
-    #endif
-    return result;
+    if (!mq->ext) return 0;
+    pthread_mutex_lock(&mem_lock);
+    size_t used = mq->ext->memory_used;
+    pthread_mutex_unlock(&mem_lock);
+    return used;
 }
 
-// Adds a message to the queue.
-bool PERSIMQ_push(T_PERSIMQ* mq, void* message, size_t message_size)
+// --- Stall detector ---
+// Every queue I/O is timed when a threshold is set (a vDSO clock read, no syscalls). The system
+// counters are only read at syncs and when a stall has happened, so the snapshot deltas cover
+// the time since the last sync. The statistics have their own lock as the reader threads stall
+// too and the writer can stall while holding the queue lock.
+
+static T_PERSIMQ_StallHandler stall_handler = NULL;
+static void* stall_handler_data = NULL;
+static __thread bool stall_in_reader = false; // Set while a concurrent reader does I/O
+
+enum { STALL_IO_READ = 0, STALL_IO_WRITE, STALL_PRESSURE_SOME, STALL_PRESSURE_FULL, STALL_COUNTERS };
+
+// Reads a small /proc file from the start into a NUL terminated buffer (false if not available).
+static bool stall_read_proc(int fd, char* buffer, size_t size)
 {
-    if (!mq->fd) { // MQ uninitialized, file not opened.
-        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            fprintf(stderr, "PERSIMQ_push(): Uninitialized MQ struct provided!\n"); fflush(stderr);
-        }
-        return false;
+    if (fd < 0) return false;
+    ssize_t length = pread(fd, buffer, size - 1, 0);
+    if (length <= 0) return false;
+    buffer[length] = 0;
+    return true;
+}
+
+// Reads the process I/O and the system I/O pressure counters (-1 if not available). The /proc
+// files are opened once per queue and reread from the start, so a sync only costs two preads.
+static void stall_read_counters(struct persimq_ext* ext, int64_t counters[STALL_COUNTERS])
+{
+    char text[1024];
+    for (int idx = 0; idx < STALL_COUNTERS; idx++) counters[idx] = -1;
+    pthread_mutex_lock(&ext->stall_lock);
+    if (!ext->stall_fds_open) {
+        ext->stall_fds[0] = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+        ext->stall_fds[1] = open("/proc/pressure/io", O_RDONLY | O_CLOEXEC);
+        ext->stall_fds_open = true;
     }
-    if (PERSIMQ_bytes_free(mq) < (sizeof(TMessageHeader) + message_size)) {
-        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            fprintf(stderr, "PERSIMQ_push(): MQ does not have enough free space to accept the message!\n"); fflush(stderr);
+    int io_fd = ext->stall_fds[0];
+    int pressure_fd = ext->stall_fds[1];
+    pthread_mutex_unlock(&ext->stall_lock);
+    if (stall_read_proc(io_fd, text, sizeof(text))) {
+        for (char* line = text; line; line = strchr(line, '\n')) {
+            if (*line == '\n') line++;
+            sscanf(line, "read_bytes: %" SCNd64, &counters[STALL_IO_READ]);
+            sscanf(line, "write_bytes: %" SCNd64, &counters[STALL_IO_WRITE]);
         }
-        return false;
-    }
-    TMessageHeader header = {
-        "PMQ",
-        eval_crc8((void*)message, message_size),
-        message_size
-    };
-    if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_DEBUG) {
-        printf("Writing header...\n"); fflush(stdout);
     }
-    if (!wrapped_io(mq->fd, (void*)&header, sizeof(header), mq->append_ptr, mq->file_size, NULL, true)) {
-        #ifdef __unix__
-            flock(mq->fd, LOCK_UN);
-        #endif
-        close(mq->fd);
-        mq->fd = 0;
-        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            perror("PERSIMQ_push(): file write (header)"); fflush(stderr);
+    if (stall_read_proc(pressure_fd, text, sizeof(text))) {
+        for (char* line = text; line; line = strchr(line, '\n')) {
+            if (*line == '\n') line++;
+            char* total = strstr(line, "total=");
+            if (!total) continue;
+            if (!strncmp(line, "some", 4)) sscanf(total, "total=%" SCNd64, &counters[STALL_PRESSURE_SOME]);
+            if (!strncmp(line, "full", 4)) sscanf(total, "total=%" SCNd64, &counters[STALL_PRESSURE_FULL]);
         }
-        return false;
     }
-    if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_DEBUG) {
-        printf("Writing data...\n"); fflush(stdout);
+}
+
+// Returns the system-wide amount of dirty page cache (-1 if not available).
+static int64_t stall_dirty_bytes(void)
+{
+    char line[256];
+    int64_t dirty_kb = -1;
+    FILE* file = fopen("/proc/meminfo", "r");
+    if (!file) return -1;
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "Dirty: %" SCNd64, &dirty_kb) == 1) break;
     }
-    if (!wrapped_io(mq->fd, message, message_size, offset_roll(mq->append_ptr, mq->file_size, sizeof(TMessageHeader)),
-            mq->file_size, &mq->append_ptr, true)) {
-        #ifdef __unix__
-            flock(mq->fd, LOCK_UN);
-        #endif
-        close(mq->fd);
-        mq->fd = 0;
-        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            perror("PERSIMQ_push(): file write (data)");
-        }
-        return false;
+    fclose(file);
+    return (dirty_kb < 0) ? -1 : dirty_kb * 1024;
+}
+
+// Takes the start time of an operation if the stall detector is enabled.
+static void stall_begin(T_PERSIMQ* mq, struct timespec* start)
+{
+    if (mq->ext && (mq->options.stall_io_ms || mq->options.stall_sync_ms)) {
+        clock_gettime(CLOCK_MONOTONIC, start);
+    } else {
+        start->tv_sec = 0;
+        start->tv_nsec = 0;
     }
-    mq->count_messages++;
-    mq->count_bytes += sizeof(TMessageHeader) + message_size;
-    return true;
 }
 
-static bool PERSIMQ_read_message_header(T_PERSIMQ* mq, TMessageHeader* header, off_t offset)
+// Checks the duration of an operation and reports it if it is over the threshold.
+static void stall_end(T_PERSIMQ* mq, const char* operation, off_t offset, size_t length,
+    const struct timespec* start, bool is_sync)
 {
-    if (!mq->fd) {
-        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            fprintf(stderr, "PERSIMQ_read_message_header(): Uninitialized MQ struct provided!\n"); fflush(stderr);
-        }
-        return false;
+    uint32_t threshold_ms = is_sync ? mq->options.stall_sync_ms : mq->options.stall_io_ms;
+    if (!threshold_ms || (!start->tv_sec && !start->tv_nsec)) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t duration_us = (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+    if (duration_us < (uint64_t)threshold_ms * 1000) return;
+
+    struct persimq_ext* ext = mq->ext;
+    T_PERSIMQ_StallSnapshot snapshot_copy;
+    T_PERSIMQ_StallSnapshot* snapshot = &snapshot_copy;
+    int64_t counters[STALL_COUNTERS];
+    stall_read_counters(ext, counters);
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->operation = operation;
+    snapshot->offset = offset;
+    snapshot->length = length;
+    snapshot->duration_us = duration_us;
+    clock_gettime(CLOCK_REALTIME, &snapshot->time);
+    off_t synced_append = __atomic_load_n(&ext->synced_append, __ATOMIC_RELAXED);
+    if (stall_in_reader) { // The queue fields belong to the owner thread, use the published range
+        off_t live_start, live_end;
+        readers_live_range(ext, &live_start, &live_end);
+        snapshot->unsynced_bytes = PERSIMQ_distance(mq, synced_append, live_end);
+        snapshot->count_bytes = PERSIMQ_distance(mq, live_start, live_end);
+    } else {
+        snapshot->unsynced_bytes = PERSIMQ_distance(mq, synced_append, mq->append_ptr);
+        snapshot->count_bytes = mq->count_bytes;
     }
-    if (!header) {
-        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            fprintf(stderr, "PERSIMQ_read_message_header(): incorrect TMessageHeader pointer!\n"); fflush(stderr);
-        }
-        return false;
+    snapshot->dirty_bytes = stall_dirty_bytes();
+    snapshot->file_size = mq->file_size;
+    // The readers and the writer can stall at the same time
+    pthread_mutex_lock(&ext->stall_lock);
+    int64_t deltas[STALL_COUNTERS];
+    for (int idx = 0; idx < STALL_COUNTERS; idx++) {
+        deltas[idx] = ((counters[idx] < 0) || (ext->stall_base[idx] < 0)) ? -1 : (counters[idx] - ext->stall_base[idx]);
     }
-    offset = offset_roll(offset, mq->file_size, 0); // Sanitize the offset (should not be needed but just in case...)
+    snapshot->io_read_bytes = deltas[STALL_IO_READ];
+    snapshot->io_write_bytes = deltas[STALL_IO_WRITE];
+    snapshot->pressure_some_us = deltas[STALL_PRESSURE_SOME];
+    snapshot->pressure_full_us = deltas[STALL_PRESSURE_FULL];
+    ext->stall_stats.last = *snapshot;
+    ext->stall_stats.stalls++;
+    if (duration_us > ext->stall_stats.worst_us) ext->stall_stats.worst_us = duration_us;
+    pthread_mutex_unlock(&ext->stall_lock);
 
-    if (!wrapped_io(mq->fd, (void*)header, sizeof(TMessageHeader), offset, mq->file_size, NULL, false)) {
-        #ifdef __unix__
-            flock(mq->fd, LOCK_UN);
-        #endif
-        close(mq->fd);
-        mq->fd = 0;
-        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            perror("PERSIMQ_read_message_header(): file read error");
-        }
-        return false;
-    }
-    // Check the header
-    if (memcmp(header->ID, "PMQ", 3)) { // Broken header
-        #ifdef __unix__
-            flock(mq->fd, LOCK_UN);
-        #endif
-        close(mq->fd);
-        mq->fd = 0;
-        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            printf("PERSIMQ_read_message_header(): bad ID (damaged message header at offset 0x%" PRIX64 ")! File closed!\n",
-                (int64_t)mq->extract_ptr);
-        }
-        return false;
+    if (stall_handler) {
+        stall_handler(mq, snapshot, stall_handler_data);
+    } else if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_AND_WARNINGS) {
+        fprintf(stderr, "PERSIMQ: %s stall of %" PRIu64 " us (offset 0x%" PRIX64 ", %zu bytes, "
+            "unsynced %" PRId64 ", dirty %" PRId64 ", io pressure %" PRId64 "/%" PRId64 " us)\n",
+            operation, duration_us, (uint64_t)offset, length, (int64_t)snapshot->unsynced_bytes,
+            snapshot->dirty_bytes, snapshot->pressure_some_us, snapshot->pressure_full_us);
+        fflush(stderr);
     }
-    return true;
 }
 
-
-// Removes the first message from a queue (if available).
-bool PERSIMQ_pop(T_PERSIMQ* mq)
+// Takes new base values of the system counters (called at syncs).
+static void stall_rebase(T_PERSIMQ* mq)
 {
+    if (!mq->ext || (!mq->options.stall_io_ms && !mq->options.stall_sync_ms)) return;
+    int64_t counters[STALL_COUNTERS];
+    stall_read_counters(mq->ext, counters);
+    pthread_mutex_lock(&mq->ext->stall_lock);
+    memcpy(mq->ext->stall_base, counters, sizeof(counters));
+    pthread_mutex_unlock(&mq->ext->stall_lock);
+}
+
+// Timed wrapped_io() for the queue file.
+static bool queue_io(T_PERSIMQ* mq, const char* operation, void* data, size_t length, off_t offset,
+    off_t* next_offset, bool do_write)
+{
+    struct timespec start;
+    stall_begin(mq, &start);
+    bool result = wrapped_io(mq->fd, data, length, offset, mq->file_size, next_offset, do_write);
+    device_delay(mq, do_write ? DEVICE_WRITE : DEVICE_READ, offset, length);
+    stall_end(mq, operation, offset, length, &start, false);
+    if (do_write) hash_mark(mq, offset, length);
+    return result;
+}
+
+// Sets the process-wide stall handler.
+void PERSIMQ_set_stall_handler(T_PERSIMQ_StallHandler handler, void* user_data)
+{
+    stall_handler_data = user_data;
+    stall_handler = handler;
+}
+
+// Returns the stall detector statistics of a queue.
+bool PERSIMQ_stall_stats(T_PERSIMQ* mq, T_PERSIMQ_StallStats* stats)
+{
+    if (!mq->ext) return false;
+    pthread_mutex_lock(&mq->ext->stall_lock);
+    *stats = mq->ext->stall_stats;
+    pthread_mutex_unlock(&mq->ext->stall_lock);
+    return true;
+}
+
+// --- Read cache ---
+
+// Drops the cached data overlapping a ring range that is about to be overwritten.
+static void cache_invalidate(T_PERSIMQ* mq, off_t offset, size_t length)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext || !ext->cache_length) return;
+    pthread_mutex_lock(&ext->lock);
+    off_t distance = (ext->cache_offset - offset + (mq->file_size - wrap_lo_margin)) % (mq->file_size - wrap_lo_margin);
+    off_t back_distance = (offset - ext->cache_offset + (mq->file_size - wrap_lo_margin)) % (mq->file_size - wrap_lo_margin);
+    if ((distance < length) || (back_distance < ext->cache_length)) ext->cache_length = 0;
+    pthread_mutex_unlock(&ext->lock);
+}
+
+// Reads the queue data at a ring offset. The data is taken from the burst mode buffer
+// or the read cache when possible.
+static bool PERSIMQ_read_data(T_PERSIMQ* mq, void* data, size_t length, off_t offset)
+{
+    struct persimq_ext* ext = mq->ext;
+    offset = offset_roll(offset, mq->file_size, 0);
+    if (!ext) return queue_io(mq, "read", data, length, offset, NULL, false);
+    bool hit = false;
+    struct timespec fill_start = { 0, 0 };
+    off_t fill_length = 0;
+    pthread_mutex_lock(&ext->lock);
+    // Records are staged as a whole so the data is either completely staged or not at all
+    off_t staged_distance = PERSIMQ_distance(mq, ext->staged_offset, offset);
+    if (ext->staged_length && (staged_distance < ext->staged_length)) {
+        memcpy(data, ext->staging + staged_distance, length);
+        pthread_mutex_unlock(&ext->lock);
+        return true;
+    }
+    if (!mq->options.read_cache_size) {
+        pthread_mutex_unlock(&ext->lock);
+        return queue_io(mq, "read", data, length, offset, NULL, false);
+    }
+    ext->last_used = __atomic_add_fetch(&mem_tick, 1, __ATOMIC_RELAXED);
+    if (ext->cache_length && (offset >= ext->cache_offset) &&
+            (offset + length <= ext->cache_offset + ext->cache_length)) {
+        hit = true;
+    } else {
+        // Refill the cache starting at the requested data. Only the live queue data which is
+        // already in the file is cached (it never gets overwritten while in the cache) and the
+        // cache never wraps.
+        fill_length = mq->count_bytes - PERSIMQ_distance(mq, mq->extract_ptr, offset);
+        if (ext->staged_length) fill_length = PERSIMQ_distance(mq, offset, ext->staged_offset);
+        if (fill_length > mq->options.read_cache_size) fill_length = mq->options.read_cache_size;
+        if (fill_length > mq->file_size - offset) fill_length = mq->file_size - offset;
+        if ((length <= fill_length) && !ext->cache) {
+            ext->cache = persimq_mem_alloc(ext, mq->options.read_cache_size);
+            ext->cache_size = mq->options.read_cache_size;
+        }
+        if ((length <= fill_length) && ext->cache) {
+            ext->cache_length = 0;
+            stall_begin(mq, &fill_start); // Reported when the lock is released
+            if (pread(mq->fd, ext->cache, fill_length, offset) == fill_length) {
+                ext->cache_offset = offset;
+                ext->cache_length = fill_length;
+                hit = true;
+            }
+        }
+    }
+    if (hit) memcpy(data, ext->cache + (offset - ext->cache_offset), length);
+    pthread_mutex_unlock(&ext->lock);
+    if (fill_start.tv_sec || fill_start.tv_nsec) {
+        device_delay(mq, DEVICE_READ, offset, fill_length);
+        stall_end(mq, "read", offset, fill_length, &fill_start, false);
+    }
+    return hit || queue_io(mq, "read", data, length, offset, NULL, false);
+}
+
+// --- Burst mode ---
+// Pushed records are collected in RAM (up to the burst size or the maximum delay) and written
+// with a single large write instead of two small writes per message. This keeps the storage
+// device idle most of the time. Records consumed before they are written never hit the device.
+
+// Writes the staged data to the file (ext->lock must be held).
+static bool staging_flush_locked(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext->staged_length) return true;
+    if (!queue_io(mq, "burst write", ext->staging, ext->staged_length, ext->staged_offset, NULL, true)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_flush(): file write");
+        }
+        return false;
+    }
+    uint64_t writes = (ext->staged_offset + ext->staged_length > mq->file_size) ? 2 : 1;
+    ext->burst_stats.bursts++;
+    // Each message would have taken a header and a data write
+    if (2 * ext->staged_count > writes) ext->burst_stats.writes_avoided += 2 * ext->staged_count - writes;
+    ext->staged_length = 0;
+    ext->staged_count = 0;
+    ext->staged_messages = 0;
+    return true;
+}
+
+// Tells whether the oldest staged record has been kept longer than "burst_max_delay_ms" (ext->lock
+// must be held).
+static bool staging_expired_locked(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!mq->options.burst_max_delay_ms || !ext->staged_length) return false;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t age_ms = (now.tv_sec - ext->staged_since.tv_sec) * 1000 +
+        (now.tv_nsec - ext->staged_since.tv_nsec) / 1000000;
+    return (age_ms >= mq->options.burst_max_delay_ms);
+}
+
+// Writes the staged data if it has been kept for too long. Checked by the push, pop and get calls.
+static bool staging_expire(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext || !mq->options.burst_max_delay_ms || !ext->staged_length) return true;
+    pthread_mutex_lock(&ext->lock);
+    bool result = !staging_expired_locked(mq) || staging_flush_locked(mq);
+    pthread_mutex_unlock(&ext->lock);
+    return result;
+}
+
+static bool staging_flush(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext || !ext->staged_length) return true;
+    pthread_mutex_lock(&ext->lock);
+    bool result = staging_flush_locked(mq);
+    pthread_mutex_unlock(&ext->lock);
+    return result;
+}
+
+// Puts a record to the staging buffer. "staged" is cleared if the record has to be written directly.
+static bool staging_push(T_PERSIMQ* mq, TMessageHeader* header, const struct iovec* parts, int part_count, bool* staged)
+{
+    struct persimq_ext* ext = mq->ext;
+    *staged = false;
+    if (!ext || !mq->options.burst_size) return true;
+    size_t record_size = sizeof(TMessageHeader) + header->message_size;
+    pthread_mutex_lock(&ext->lock);
+    bool result = true;
+    if (ext->staged_length + record_size > mq->options.burst_size) result = staging_flush_locked(mq);
+    if (result && (record_size <= mq->options.burst_size) && !ext->staging) {
+        ext->staging = persimq_mem_alloc(ext, mq->options.burst_size);
+        ext->staging_size = mq->options.burst_size;
+    }
+    if (result && (record_size <= mq->options.burst_size) && ext->staging) {
+        if (!ext->staged_length) {
+            ext->staged_offset = mq->append_ptr;
+            clock_gettime(CLOCK_MONOTONIC, &ext->staged_since);
+        }
+        memcpy(ext->staging + ext->staged_length, header, sizeof(TMessageHeader));
+        ext->staged_length += sizeof(TMessageHeader);
+        for (int idx = 0; idx < part_count; idx++) {
+            memcpy(ext->staging + ext->staged_length, parts[idx].iov_base, parts[idx].iov_len);
+            ext->staged_length += parts[idx].iov_len;
+        }
+        ext->staged_count++;
+        if (is_message(header)) {
+            ext->staged_messages++;
+            ext->burst_stats.staged_messages++;
+        }
+        *staged = true;
+        if (staging_expired_locked(mq)) result = staging_flush_locked(mq);
+    }
+    pthread_mutex_unlock(&ext->lock);
+    return result;
+}
+
+// Forgets the staged records which have been consumed already.
+static void staging_trim(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext || !ext->staged_length) return;
+    pthread_mutex_lock(&ext->lock);
+    size_t consumed = mq->count_bytes ? PERSIMQ_distance(mq, ext->staged_offset, mq->extract_ptr) : ext->staged_length;
+    if (consumed && (consumed <= ext->staged_length)) {
+        memmove(ext->staging, ext->staging + consumed, ext->staged_length - consumed);
+        ext->staged_length -= consumed;
+        ext->staged_offset = offset_roll(ext->staged_offset, mq->file_size, consumed);
+        ext->burst_stats.bytes_skipped += consumed;
+        if (!ext->staged_length) {
+            ext->burst_stats.writes_avoided += 2 * ext->staged_count;
+            ext->staged_count = 0;
+            ext->staged_messages = 0;
+        } else if (ext->staged_count > 1) {
+            ext->burst_stats.writes_avoided += 2; // Trimmed one record at a time by the pops
+            ext->staged_count--;
+            if (ext->staged_messages) ext->staged_messages--;
+        }
+    }
+    pthread_mutex_unlock(&ext->lock);
+}
+
+// Drops all the staged records (they are not a part of the queue any more).
+static void staging_discard(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext) return;
+    pthread_mutex_lock(&ext->lock);
+    ext->staged_length = 0;
+    ext->staged_count = 0;
+    ext->staged_messages = 0;
+    pthread_mutex_unlock(&ext->lock);
+}
+
+// Burst mode hint: writes the messages kept in RAM now.
+bool PERSIMQ_flush(T_PERSIMQ* mq)
+{
+    if (!mq->fd || mq->read_only) return false;
+    return staging_flush(mq);
+}
+
+// Returns the burst mode statistics of a queue.
+bool PERSIMQ_burst_stats(T_PERSIMQ* mq, T_PERSIMQ_BurstStats* stats)
+{
+    if (!mq->ext) return false;
+    pthread_mutex_lock(&mq->ext->lock);
+    *stats = mq->ext->burst_stats;
+    pthread_mutex_unlock(&mq->ext->lock);
+    return true;
+}
+
+// --- Page cache management ---
+// The queue data is normally written once and read once so there is no point in keeping it in
+// the page cache. The consumed data gets dropped, a readahead window is kept in front of the
+// consumer and (optionally) freshly synced data is dropped when the consumer is far behind.
+
+// Gives an advice for a ring range (split around the file margins).
+static void advise_range(T_PERSIMQ* mq, off_t offset, off_t length, int advice)
+{
+    offset = offset_roll(offset, mq->file_size, 0);
+    off_t first_chunk = mq->file_size - offset;
+    if (length <= first_chunk) {
+        posix_fadvise(mq->fd, offset, length, advice);
+    } else {
+        posix_fadvise(mq->fd, offset, first_chunk, advice);
+        posix_fadvise(mq->fd, wrap_lo_margin, length - first_chunk, advice);
+    }
+}
+
+static void fadvise_reset(T_PERSIMQ* mq)
+{
+    if (!mq->ext) return;
+    mq->ext->advised_extract = mq->extract_ptr;
+    mq->ext->readahead_ptr = mq->extract_ptr;
+    __atomic_store_n(&mq->ext->synced_append, mq->append_ptr, __ATOMIC_RELAXED); // Read by stall_end()
+}
+
+// Called when the consumer moves forward.
+static void fadvise_consumed(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    off_t window = mq->options.fadvise_window;
+    if (!ext || !window) return;
+    // Drop the consumed data in batches of half a window
+    off_t consumed = PERSIMQ_distance(mq, ext->advised_extract, mq->extract_ptr);
+    if (!mq->count_bytes || (consumed >= window / 2)) {
+        if (consumed) advise_range(mq, ext->advised_extract, consumed, POSIX_FADV_DONTNEED);
+        ext->advised_extract = mq->extract_ptr;
+    }
+    // Keep at least half a window of the data in front of the consumer requested
+    off_t on_disk = mq->count_bytes - (off_t)ext->staged_length;
+    off_t ahead = PERSIMQ_distance(mq, mq->extract_ptr, ext->readahead_ptr);
+    if (ahead > on_disk) { // Stale position (the consumer has passed it)
+        ext->readahead_ptr = mq->extract_ptr;
+        ahead = 0;
+    }
+    if ((ahead < window / 2) && (ahead < on_disk)) {
+        off_t length = ((window < on_disk) ? window : on_disk) - ahead;
+        if (length > 0) {
+            advise_range(mq, ext->readahead_ptr, length, POSIX_FADV_WILLNEED);
+            ext->readahead_ptr = offset_roll(ext->readahead_ptr, mq->file_size, length);
+        }
+    }
+}
+
+// Called after a successful sync.
+static void fadvise_synced(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext) return;
+    off_t written = PERSIMQ_distance(mq, ext->synced_append, mq->append_ptr);
+    // The data will not be needed before the consumer gets through the rest of the backlog
+    if (mq->options.fadvise_window && mq->options.fadvise_drop_written && written &&
+            (mq->count_bytes - written > (off_t)mq->options.fadvise_window)) {
+        advise_range(mq, ext->synced_append, written, POSIX_FADV_DONTNEED);
+    }
+    __atomic_store_n(&ext->synced_append, mq->append_ptr, __ATOMIC_RELAXED); // Read by stall_end()
+}
+
+// --- Shared state ---
+// The live queue state is kept in a small MAP_SHARED file next to the queue file and updated
+// in place after every operation without any syscalls. The mapped pages belong to the page cache
+// so they survive a crash of the process. Two slots are used in turn so that a crash in the middle
+// of an update never destroys the previous state. After a system restart the state file is ignored
+// (the page cache did not survive) and the synced queue file header is used as usual. Every state
+// carries a copy of the queue file header it was built on, a state file left behind by another
+// queue file (a restored copy, a queue written without the option) does not match and is ignored.
+
+#define STATE_FILE_SUFFIX  ".state"
+
+// Returns the current boot ID (NULL if not available).
+static const char* state_boot_id(void)
+{
+    static char boot_id[36];
+    static int loaded = 0; // 0 - not yet, 1 - loaded, -1 - not available
+    if (!loaded) {
+        int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+        loaded = ((fd >= 0) && (read(fd, boot_id, sizeof(boot_id)) == sizeof(boot_id))) ? 1 : -1;
+        if (fd >= 0) close(fd);
+    }
+    return (loaded > 0) ? boot_id : NULL;
+}
+
+// Checks a shared state file and takes the current state from it. A state which was not built on
+// "header" is stale (the queue file has been replaced or written without the state file).
+static bool state_get(const TStateFile* state, off_t file_size, const TFileHeader* header, TStateSlot* slot)
+{
+    const char* boot_id = state_boot_id();
+    if (!boot_id || memcmp(state->ID, "lPmS", 4) || memcmp(state->boot_id, boot_id, sizeof(state->boot_id)) ||
+            (state->file_size != file_size)) {
+        return false;
+    }
+    *slot = state->slots[__atomic_load_n(&state->active, __ATOMIC_ACQUIRE) & 1];
+    return (eval_crc8((void*)slot, offsetof(TStateSlot, crc)) == slot->crc) &&
+        !memcmp(&slot->header, header, sizeof(*header));
+}
+
+// Stores the current queue state to the shared state file.
+// The records still kept in the burst mode buffer are not a part of the stored state.
+static void state_publish(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext || !ext->state) return;
+    TStateFile* state = ext->state;
+    uint32_t slot_idx = (state->active + 1) & 1;
+    TStateSlot* slot = &state->slots[slot_idx];
+    slot->append_ptr = mq->append_ptr;
+    slot->extract_ptr = mq->extract_ptr;
+    slot->count_bytes = mq->count_bytes;
+    slot->count_messages = mq->count_messages;
+    slot->header = ext->file_header;
+    if (ext->staged_length && mq->count_bytes) {
+        slot->append_ptr = ext->staged_offset;
+        slot->count_bytes = PERSIMQ_distance(mq, mq->extract_ptr, ext->staged_offset);
+        slot->count_messages -= ext->staged_messages;
+    }
+    slot->crc = eval_crc8((void*)slot, offsetof(TStateSlot, crc));
+    __atomic_store_n(&state->active, slot_idx, __ATOMIC_RELEASE);
+}
+
+// Maps the shared state file of a queue. If "adopt" is set the queue state is taken from the
+// file when it is valid (the process has crashed since the last sync).
+static bool state_open(T_PERSIMQ* mq, const char* mqfile_path, bool adopt)
+{
+    struct persimq_ext* ext = mq->ext;
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s%s", mqfile_path, STATE_FILE_SUFFIX) >= sizeof(path)) return false;
+    int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (fd < 0) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_open(): state file open");
+        }
+        return false;
+    }
+    TStateFile* state = MAP_FAILED;
+    if (!ftruncate(fd, sizeof(TStateFile))) {
+        state = mmap(NULL, sizeof(TStateFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (state == MAP_FAILED) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_open(): state file mapping");
+        }
+        close(fd);
+        return false;
+    }
+    TStateSlot slot;
+    if (adopt && state_get(state, mq->file_size, &ext->file_header, &slot) && (slot.count_bytes < mq->file_size)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_INFO) {
+            printf("PERSIMQ_open(): queue state restored from the state file.\n");
+        }
+        mq->append_ptr = slot.append_ptr;
+        mq->extract_ptr = slot.extract_ptr;
+        mq->count_bytes = slot.count_bytes;
+        mq->count_messages = slot.count_messages;
+    }
+    const char* boot_id = state_boot_id();
+    memset(state->boot_id, 0, sizeof(state->boot_id));
+    if (boot_id) memcpy(state->boot_id, boot_id, sizeof(state->boot_id));
+    state->file_size = mq->file_size;
+    memcpy(state->ID, "lPmS", 4);
+    ext->state_fd = fd;
+    ext->state = state;
+    state_publish(mq);
+    return true;
+}
+
+static void state_close(struct persimq_ext* ext)
+{
+    if (!ext->state) return;
+    munmap(ext->state, sizeof(TStateFile));
+    close(ext->state_fd);
+    ext->state = NULL;
+}
+
+// Maps the shared state file of a read-only queue (if there is one).
+static void state_attach(T_PERSIMQ* mq, const char* mqfile_path)
+{
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s%s", mqfile_path, STATE_FILE_SUFFIX) >= sizeof(path)) return;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    TStateFile* state = MAP_FAILED;
+    if (!fstat(fd, &st) && (st.st_size >= sizeof(TStateFile))) {
+        state = mmap(NULL, sizeof(TStateFile), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (state == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+    mq->ext->state_fd = fd;
+    mq->ext->state = state;
+}
+
+// Takes the state of a read-only queue from the shared state file if it is valid for the header.
+static bool state_load(T_PERSIMQ* mq, const TFileHeader* header)
+{
+    TStateSlot slot;
+    if (!mq->ext || !mq->ext->state || !state_get(mq->ext->state, mq->file_size, header, &slot) ||
+            (slot.count_bytes >= mq->file_size)) {
+        return false;
+    }
+    mq->append_ptr = slot.append_ptr;
+    mq->extract_ptr = slot.extract_ptr;
+    mq->count_bytes = slot.count_bytes;
+    mq->count_messages = slot.count_messages;
+    return true;
+}
+
+// --- Blob storage ---
+// Payloads bigger than "blob_threshold" bytes go to a "<queue file>.blobs" file and the queue only
+// gets a small reference record, so a few huge messages do not fragment the ring or flush the read
+// cache. The payloads are appended in the push order and consumed in the same order: the space of
+// the popped ones is punched out of the file at syncs and the file is truncated when the queue is
+// empty. The blob data is synced before the queue header which refers to it. File systems which
+// can not punch holes (FAT on SD cards) only get the space back when the file is truncated: when
+// no queued message refers to a blob anymore. The blob file counts against "file_size" there, a big
+// message which would grow it over that does not fit in the queue.
+// With "blob_dedup" a payload identical to a stored one which is still needed gets a reference to
+// the old copy. Such references point back behind the stored ones, the blobs they refer to are
+// counted and kept in the file until the references are popped. The counts are not stored: they
+// are found again by walking the queue whenever a queue with a blob file is opened for writing, with
+// or without the option, so that the space of a shared blob is never given back too early.
+
+#define BLOB_FILE_SUFFIX ".blobs"
+#define DEDUP_SLOTS      (256)
+
+// Stored blob which new messages may refer to. The slot is picked by the payload hash.
+struct blob_dedup {
+    uint64_t hash;
+    uint64_t offset;
+    uint32_t size;   // 0 - empty slot
+    uint32_t refs;   // Queued references besides the message which stored the blob
+    bool kept;       // Left in the file when the popped blobs around it were punched out
+};
+
+// Opens the blob file of a queue. Queues without big messages may have none.
+static bool blob_open(T_PERSIMQ* mq, const char* mqfile_path)
+{
+    struct persimq_ext* ext = mq->ext;
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s%s", mqfile_path, BLOB_FILE_SUFFIX) >= sizeof(path)) return false;
+    int flags = mq->read_only ? O_RDONLY : (O_RDWR | (mq->options.blob_threshold ? O_CREAT : 0));
+    int fd = open(path, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    struct stat st;
+    if ((fd < 0) || fstat(fd, &st)) {
+        if (fd >= 0) close(fd);
+        if (errno == ENOENT) return true;
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_open(): blob file open");
+        }
+        return false;
+    }
+    ext->blob_fd = fd;
+    ext->blob_end = st.st_size;
+    return true;
+}
+
+static void blob_close(struct persimq_ext* ext)
+{
+    if (!ext->blob_fd) return;
+    close(ext->blob_fd);
+    ext->blob_fd = 0;
+}
+
+// Appends a payload to the blob file and fills in the reference to it.
+static bool blob_store(T_PERSIMQ* mq, const struct iovec* parts, int part_count, size_t size, uint8_t crc,
+    TBlobRef* ref)
+{
+    struct persimq_ext* ext = mq->ext;
+    off_t offset = ext->blob_end;
+    if (ext->blob_no_punch && ((offset + size) > mq->file_size)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_push(): the blob file does not have enough free space to accept the message!\n");
+            fflush(stderr);
+        }
+        return false;
+    }
+    struct timespec start;
+    stall_begin(mq, &start);
+    for (int idx = 0; idx < part_count; idx++) {
+        if (!multiwrite(ext->blob_fd, parts[idx].iov_base, parts[idx].iov_len, offset)) {
+            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                perror("PERSIMQ_push(): blob file write");
+            }
+            return false;
+        }
+        offset += parts[idx].iov_len;
+    }
+    device_delay(mq, DEVICE_WRITE, ext->blob_end, size);
+    stall_end(mq, "blob write", ext->blob_end, size, &start, false);
+    ref->offset = ext->blob_end;
+    ref->size = size;
+    ref->crc = crc;
+    ext->blob_end = offset;
+    ext->blob_unsynced = true;
+    return true;
+}
+
+// Reads the reference of a blob reference record.
+static bool blob_read_ref(T_PERSIMQ* mq, const TMessageHeader* header, off_t message_ptr, TBlobRef* ref)
+{
+    if ((header->message_size != sizeof(TBlobRef)) || !mq->ext || !mq->ext->blob_fd) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_get(): bad blob reference at offset 0x%" PRIX64 " or no blob file!\n",
+                (uint64_t)message_ptr); fflush(stderr);
+        }
+        return false;
+    }
+    return PERSIMQ_read_message_data(mq, ref, sizeof(TBlobRef), sizeof(TBlobRef), header->message_crc,
+        offset_roll(message_ptr, mq->file_size, sizeof(TMessageHeader)));
+}
+
+// Reads and checks a payload from the blob file. Damaged blobs do not close the queue.
+static bool blob_read(T_PERSIMQ* mq, const TBlobRef* ref, void* buffer)
+{
+    if (!multiread(mq->ext->blob_fd, buffer, ref->size, ref->offset)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_get(): blob file read");
+        }
+        return false;
+    }
+    if (eval_crc8(buffer, ref->size) != ref->crc) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_get(): bad CRC (damaged blob at offset 0x%" PRIX64 ")!\n",
+                (uint64_t)ref->offset); fflush(stderr);
+        }
+        return false;
+    }
+    return true;
+}
+
+// Finds a stored blob with the same payload which is still needed. The hash only picks the
+// candidate, the payload is compared with the blob file (the recent blobs are in the page cache).
+static struct blob_dedup* dedup_find(T_PERSIMQ* mq, const struct iovec* parts, int part_count, size_t size,
+    uint64_t hash)
+{
+    struct persimq_ext* ext = mq->ext;
+    struct blob_dedup* entry = &ext->dedup[hash % DEDUP_SLOTS];
+    if ((entry->size != size) || (entry->hash != hash)) return NULL;
+    if (!entry->refs && ((off_t)(entry->offset + entry->size) <= ext->blob_released)) return NULL; // Popped
+    uint8_t chunk[4096];
+    off_t offset = entry->offset;
+    for (int idx = 0; idx < part_count; idx++) {
+        const uint8_t* data = parts[idx].iov_base;
+        size_t left = parts[idx].iov_len;
+        while (left) {
+            size_t length = (left < sizeof(chunk)) ? left : sizeof(chunk);
+            if (!multiread(ext->blob_fd, chunk, length, offset) || memcmp(chunk, data, length)) return NULL;
+            data += length;
+            left -= length;
+            offset += length;
+        }
+    }
+    return entry;
+}
+
+// Remembers a stored blob for the next pushes (blobs with references are not replaced).
+static void dedup_add(struct persimq_ext* ext, uint64_t hash, const TBlobRef* ref)
+{
+    struct blob_dedup* entry = &ext->dedup[hash % DEDUP_SLOTS];
+    if (entry->refs || entry->kept) return;
+    entry->hash = hash;
+    entry->offset = ref->offset;
+    entry->size = ref->size;
+}
+
+// Counts a queued reference to an older blob found when the queue is opened.
+static void dedup_pin(T_PERSIMQ* mq, off_t offset, size_t size)
+{
+    struct persimq_ext* ext = mq->ext;
+    for (int idx = 0; idx < DEDUP_SLOTS; idx++) {
+        if (ext->dedup[idx].size && (ext->dedup[idx].offset == offset)) {
+            ext->dedup[idx].refs++;
+            return;
+        }
+    }
+    uint8_t* data = malloc(size);
+    if (data && multiread(ext->blob_fd, data, size, offset)) {
+        uint64_t hash = hash_data(data, size);
+        struct blob_dedup* entry = &ext->dedup[hash % DEDUP_SLOTS];
+        if (!entry->refs) {
+            *entry = (struct blob_dedup){ hash, offset, size, 1, false };
+            offset = -1;
+        }
+    }
+    free(data);
+    // Not counted, the blobs from here on are kept until the queue gets empty
+    if ((offset >= 0) && ((ext->dedup_floor < 0) || (offset < ext->dedup_floor))) ext->dedup_floor = offset;
+}
+
+// Forgets the blobs (the queue is empty).
+static void dedup_reset(struct persimq_ext* ext)
+{
+    if (!ext || !ext->dedup) return;
+    memset(ext->dedup, 0, DEDUP_SLOTS * sizeof(struct blob_dedup));
+    ext->dedup_floor = -1;
+}
+
+// Finds the blobs referred to by the queued messages again. The stored blobs follow the queue
+// order, so a message referring back behind the blobs stored before it shares an older blob.
+static bool dedup_rebuild(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    dedup_reset(ext);
+    ext->blob_released = ext->blob_end;
+    ext->blob_punched = 0; // Punching the popped blobs again is harmless and frees the kept ones
+    if (!mq->count_messages) return true;
+    T_PERSIMQ_Cursor cursor;
+    if (!PERSIMQ_cursor_init(&cursor, mq, 65536, mq->extract_ptr, mq->count_bytes)) return false;
+    off_t stored_end = -1;
+    size_t size;
+    while (PERSIMQ_cursor_next(&cursor, NULL, &size)) {
+        if (cursor.blob_offset < 0) continue;
+        if (stored_end < 0) ext->blob_released = cursor.blob_offset; // The older blobs have been popped
+        if (cursor.blob_offset >= stored_end) {
+            stored_end = cursor.blob_offset + size;
+        } else {
+            dedup_pin(mq, cursor.blob_offset, size);
+        }
+    }
+    bool result = !cursor.error;
+    PERSIMQ_cursor_free(&cursor);
+    return result;
+}
+
+// Sets up the blob reference counts of a queue opened for writing.
+static bool dedup_open(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext->blob_fd) return true;
+    if (!(ext->dedup = calloc(DEDUP_SLOTS, sizeof(struct blob_dedup)))) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_open(): Out of memory!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    mem_pin(ext, DEDUP_SLOTS * sizeof(struct blob_dedup));
+    return dedup_rebuild(mq);
+}
+
+// Marks the blob of a popped message as not needed anymore.
+static void blob_release(T_PERSIMQ* mq, const TPayload* payload)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!payload->in_blob) return;
+    if ((payload->offset + payload->size) > ext->blob_released) {
+        ext->blob_released = payload->offset + payload->size;
+    } else if (ext->dedup) { // A reference to an older blob
+        for (int idx = 0; idx < DEDUP_SLOTS; idx++) {
+            if (ext->dedup[idx].refs && (ext->dedup[idx].offset == payload->offset)) {
+                ext->dedup[idx].refs--;
+                break;
+            }
+        }
+    }
+}
+
+// Returns the start of the blobs which are still needed.
+static off_t blob_live_start(struct persimq_ext* ext)
+{
+    off_t start = ext->blob_released;
+    if (!ext->dedup) return start;
+    for (int idx = 0; idx < DEDUP_SLOTS; idx++) {
+        if (ext->dedup[idx].refs && ((off_t)ext->dedup[idx].offset < start)) start = ext->dedup[idx].offset;
+    }
+    if ((ext->dedup_floor >= 0) && (ext->dedup_floor < start)) start = ext->dedup_floor;
+    return start;
+}
+
+// Syncs the blobs so that the queue header never refers to the data which is not on the disk.
+static bool blob_sync(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext || !ext->blob_unsynced) return true;
+    ext->blob_unsynced = false;
+    return (fdatasync(ext->blob_fd) >= 0);
+}
+
+// Gives a part of the blob file back to the file system.
+static void blob_punch(struct persimq_ext* ext, off_t from, off_t to)
+{
+    if ((to <= from) || ext->blob_no_punch) return;
+    #ifdef FALLOC_FL_PUNCH_HOLE
+        if (!fallocate(ext->blob_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, to - from)) return;
+    #else
+        errno = EOPNOTSUPP;
+    #endif
+    ext->blob_no_punch = true;
+    if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_INFO) {
+        printf("PERSIMQ_sync(): can not punch holes in the blob file (%s), it is truncated when no message refers "
+            "to it.\n", strerror(errno));
+    }
+}
+
+// Gives the space of the popped blobs back to the file system (after the queue header is synced).
+// Open readers may still need them, the space is reclaimed at a later sync then.
+static void blob_reclaim(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext || !ext->blob_fd || __atomic_load_n(&ext->reader_count, __ATOMIC_ACQUIRE)) return;
+    if (!mq->count_messages || (blob_live_start(ext) >= ext->blob_end)) { // No blob is needed
+        if (ext->blob_end && !ftruncate(ext->blob_fd, 0)) {
+            ext->blob_end = ext->blob_released = ext->blob_punched = 0;
+            dedup_reset(ext);
+        }
+    } else {
+        // The popped blobs are punched out around the ones which are still referenced
+        off_t end = ext->blob_released;
+        if (ext->dedup && (ext->dedup_floor >= 0) && (ext->dedup_floor < end)) end = ext->dedup_floor;
+        while (ext->blob_punched < end) {
+            struct blob_dedup* kept = NULL;
+            for (int idx = 0; ext->dedup && (idx < DEDUP_SLOTS); idx++) {
+                struct blob_dedup* entry = &ext->dedup[idx];
+                if (entry->refs && ((off_t)entry->offset >= ext->blob_punched) && ((off_t)entry->offset < end) &&
+                        (!kept || (entry->offset < kept->offset))) {
+                    kept = entry;
+                }
+            }
+            blob_punch(ext, ext->blob_punched, kept ? (off_t)kept->offset : end);
+            if (!kept) break;
+            kept->kept = true;
+            ext->blob_punched = kept->offset + kept->size;
+        }
+        if (ext->blob_punched < end) ext->blob_punched = end;
+        for (int idx = 0; ext->dedup && (idx < DEDUP_SLOTS); idx++) { // Kept blobs which are not needed anymore
+            struct blob_dedup* entry = &ext->dedup[idx];
+            if (entry->kept && !entry->refs) {
+                blob_punch(ext, entry->offset, entry->offset + entry->size);
+                entry->kept = false;
+            }
+        }
+    }
+}
+
+// --- Block hash tree ---
+// The data section is split into blocks of "hash_block_size" bytes. A hash of every block and a
+// binary tree of hashes above them are kept in a memory mapped "<queue file>.hashes" file. Writes
+// only mark the blocks as changed, the changed blocks are hashed again (from the page cache) and
+// their paths to the root updated at syncs, after the queue file has been synced. The changed
+// nodes are written to the disk before the tree is stamped with the queue header, a tree with a
+// stamp which does not match the header is rebuilt. Two replicas are compared from the root down
+// and only the subtrees with different hashes are visited, so the work depends on the divergence
+// rather than on the file size. The hashes detect divergence, they are not meant to resist
+// tampering.
+
+#define HASH_FILE_SUFFIX  ".hashes"
+#define HASH_NODES_OFFSET (64)
+
+// Block hash tree file: nodes[1] is the root, nodes[n] has children nodes[2n] and nodes[2n+1],
+// the hash of block "b" is nodes[leaf_count + b].
+struct THashFile {
+    char ID[4];
+    uint32_t block_size;
+    uint64_t file_size;
+    uint64_t leaf_count;
+    // Queue header the tree was last updated for (a different one means a lost update)
+    uint64_t append_ptr;
+    uint64_t extract_ptr;
+    uint64_t count_messages;
+    uint8_t crc;
+} __attribute__((packed));
+
+static uint64_t* hash_nodes(struct persimq_ext* ext)
+{
+    return (uint64_t*)((uint8_t*)ext->hashes + HASH_NODES_OFFSET);
+}
+
+static uint64_t hash_mix(uint64_t hash)
+{
+    hash ^= hash >> 29;
+    hash *= 0xBF58476D1CE4E5B9ULL;
+    return hash ^ (hash >> 32);
+}
+
+// 64-bit hash of a data block (8 bytes per step).
+static uint64_t hash_data(const uint8_t* data, size_t length)
+{
+    uint64_t hash = 0x9E3779B97F4A7C15ULL ^ length;
+    size_t idx = 0;
+    for (; (idx + sizeof(uint64_t)) <= length; idx += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + idx, sizeof(word));
+        hash = hash_mix(hash ^ word) * 0x9E3779B97F4A7C15ULL;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + idx, length - idx);
+    return hash_mix(hash ^ tail ^ 0xA5);
+}
+
+// hash_data() of the concatenated parts of a message.
+static uint64_t hash_parts(const struct iovec* parts, int part_count, size_t length)
+{
+    uint64_t hash = 0x9E3779B97F4A7C15ULL ^ length;
+    uint64_t word = 0;
+    size_t filled = 0; // Bytes collected in "word"
+    for (int part = 0; part < part_count; part++) {
+        const uint8_t* data = parts[part].iov_base;
+        size_t left = parts[part].iov_len;
+        while (left) {
+            size_t take = sizeof(word) - filled;
+            if (take > left) take = left;
+            memcpy((uint8_t*)&word + filled, data, take);
+            filled += take;
+            data += take;
+            left -= take;
+            if (filled == sizeof(word)) {
+                hash = hash_mix(hash ^ word) * 0x9E3779B97F4A7C15ULL;
+                word = 0;
+                filled = 0;
+            }
+        }
+    }
+    return hash_mix(hash ^ word ^ 0xA5);
+}
+
+// Returns the data block range [*offset, *offset + return value).
+static size_t hash_block_range(T_PERSIMQ* mq, uint64_t block, off_t* offset)
+{
+    *offset = wrap_lo_margin + (off_t)block * mq->options.hash_block_size;
+    off_t length = mq->file_size - *offset;
+    return (length > mq->options.hash_block_size) ? mq->options.hash_block_size : length;
+}
+
+// Marks the blocks of a queue file range as changed.
+static void hash_mark(T_PERSIMQ* mq, off_t offset, size_t length)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext || !ext->hashes || !length) return;
+    offset = offset_roll(offset, mq->file_size, 0);
+    while (length) {
+        size_t part = mq->file_size - offset;
+        if (part > length) part = length;
+        uint64_t first = (offset - wrap_lo_margin) / mq->options.hash_block_size;
+        uint64_t last = (offset + part - 1 - wrap_lo_margin) / mq->options.hash_block_size;
+        for (uint64_t block = first; block <= last; block++) ext->hash_dirty[block / 64] |= 1ULL << (block % 64);
+        ext->hash_any_dirty = true;
+        length -= part;
+        offset = wrap_lo_margin;
+    }
+}
+
+// Stamps and checksums the tree file header.
+static void hash_stamp(T_PERSIMQ* mq)
+{
+    struct THashFile* hashes = mq->ext->hashes;
+    hashes->append_ptr = mq->append_ptr;
+    hashes->extract_ptr = mq->extract_ptr;
+    hashes->count_messages = mq->count_messages;
+    hashes->crc = eval_crc8((void*)hashes, offsetof(struct THashFile, crc));
+}
+
+// Hashes the changed blocks again and updates their paths to the root.
+static bool hash_update(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext || !ext->hashes) return true;
+    if (ext->hash_any_dirty) {
+        uint8_t* buffer = malloc(mq->options.hash_block_size);
+        if (!buffer) {
+            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                fprintf(stderr, "hash_update(): Out of memory!\n"); fflush(stderr);
+            }
+            return false;
+        }
+        uint64_t* nodes = hash_nodes(ext);
+        uint64_t leaf_count = ext->hashes->leaf_count;
+        for (uint64_t word = 0; word < (ext->hash_blocks + 63) / 64; word++) {
+            while (ext->hash_dirty[word]) {
+                uint64_t block = word * 64 + __builtin_ctzll(ext->hash_dirty[word]);
+                off_t offset;
+                size_t length = hash_block_range(mq, block, &offset);
+                if (!multiread(mq->fd, buffer, length, offset)) {
+                    free(buffer);
+                    if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                        perror("hash_update(): file read");
+                    }
+                    return false;
+                }
+                ext->hash_dirty[word] &= ext->hash_dirty[word] - 1;
+                nodes[leaf_count + block] = hash_data(buffer, length);
+                for (uint64_t node = (leaf_count + block) / 2; node; node /= 2) {
+                    nodes[node] = hash_mix(nodes[node * 2] * 0x9E3779B97F4A7C15ULL + nodes[node * 2 + 1]);
+                }
+            }
+        }
+        free(buffer);
+        ext->hash_any_dirty = false;
+        // Only the changed pages are written (the trees of read-only queues are private)
+        if (!mq->read_only && msync(ext->hashes, ext->hash_map_size, MS_SYNC)) {
+            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                perror("hash_update(): hash file sync");
+            }
+            return false;
+        }
+    }
+    hash_stamp(mq);
+    return true;
+}
+
+// Maps the block hash tree file of a queue. The tree is rebuilt if it does not match the queue.
+static bool hash_open(T_PERSIMQ* mq, const char* mqfile_path)
+{
+    struct persimq_ext* ext = mq->ext;
+    uint32_t block_size = mq->options.hash_block_size;
+    if ((block_size < 64) || (block_size & (block_size - 1))) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_open(): hash block size must be a power of two of at least 64 bytes!\n");
+            fflush(stderr);
+        }
+        return false;
+    }
+    ext->hash_blocks = (mq->file_size - wrap_lo_margin + block_size - 1) / block_size;
+    uint64_t leaf_count = 1;
+    while (leaf_count < ext->hash_blocks) leaf_count *= 2;
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s%s", mqfile_path, HASH_FILE_SUFFIX) >= sizeof(path)) return false;
+    ext->hash_dirty = calloc((ext->hash_blocks + 63) / 64, sizeof(uint64_t));
+    int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    size_t map_size = HASH_NODES_OFFSET + 2 * leaf_count * sizeof(uint64_t);
+    struct THashFile* hashes = MAP_FAILED;
+    if ((fd >= 0) && ext->hash_dirty && !ftruncate(fd, map_size)) {
+        hashes = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (hashes == MAP_FAILED) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_open(): hash file mapping");
+        }
+        if (fd >= 0) close(fd);
+        free(ext->hash_dirty);
+        ext->hash_dirty = NULL;
+        return false;
+    }
+    ext->hash_fd = fd;
+    ext->hashes = hashes;
+    ext->hash_map_size = map_size;
+    mem_pin(ext, (ext->hash_blocks + 63) / 64 * sizeof(uint64_t)); // The mapping is page cache
+    return hash_check(mq, leaf_count);
+}
+
+// Uses the mapped tree if it matches the queue, rebuilds it otherwise.
+static bool hash_check(T_PERSIMQ* mq, uint64_t leaf_count)
+{
+    struct THashFile* hashes = mq->ext->hashes;
+    uint32_t block_size = mq->options.hash_block_size;
+    bool valid = !memcmp(hashes->ID, "lPmH", 4) && (hashes->block_size == block_size) &&
+        (hashes->file_size == mq->file_size) && (hashes->leaf_count == leaf_count) &&
+        (hashes->append_ptr == mq->append_ptr) && (hashes->extract_ptr == mq->extract_ptr) &&
+        (hashes->count_messages == mq->count_messages) &&
+        (eval_crc8((void*)hashes, offsetof(struct THashFile, crc)) == hashes->crc);
+    if (!valid) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_INFO) {
+            printf("PERSIMQ_open(): rebuilding the block hash tree.\n");
+        }
+        memset(hashes, 0, mq->ext->hash_map_size);
+        memcpy(hashes->ID, "lPmH", 4);
+        hashes->block_size = block_size;
+        hashes->file_size = mq->file_size;
+        hashes->leaf_count = leaf_count;
+        hash_mark(mq, wrap_lo_margin, mq->file_size - wrap_lo_margin);
+        return hash_update(mq);
+    }
+    return true;
+}
+
+// Sets up the block hash tree of a read-only queue in private memory: the tree file found by
+// PERSIMQ_open_readonly() is used if it matches the queue, the tree is built from the queue file
+// otherwise. Nothing is written to the files.
+static bool hash_attach(T_PERSIMQ* mq, uint32_t block_size)
+{
+    struct persimq_ext* ext = mq->ext;
+    uint64_t blocks = (mq->file_size - wrap_lo_margin + block_size - 1) / block_size;
+    uint64_t leaf_count = 1;
+    while (leaf_count < blocks) leaf_count *= 2;
+    // PERSIMQ_refresh() may have moved the queue state since the last call
+    if (ext->hashes && (mq->options.hash_block_size == block_size)) return hash_check(mq, leaf_count);
+    if (ext->hashes) { // Built for another block size
+        munmap(ext->hashes, ext->hash_map_size);
+        free(ext->hash_dirty);
+        ext->hashes = NULL;
+        ext->hash_dirty = NULL;
+    }
+    mq->options.hash_block_size = block_size;
+    ext->hash_blocks = blocks;
+    size_t map_size = HASH_NODES_OFFSET + 2 * leaf_count * sizeof(uint64_t);
+    ext->hash_dirty = calloc((ext->hash_blocks + 63) / 64, sizeof(uint64_t));
+    struct stat st;
+    struct THashFile* hashes = MAP_FAILED;
+    if (ext->hash_dirty && ext->hash_fd && !fstat(ext->hash_fd, &st) && (st.st_size >= map_size)) {
+        hashes = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, ext->hash_fd, 0);
+    }
+    if (ext->hash_dirty && (hashes == MAP_FAILED)) {
+        hashes = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (hashes == MAP_FAILED) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("hash_attach(): hash tree mapping");
+        }
+        free(ext->hash_dirty);
+        ext->hash_dirty = NULL;
+        return false;
+    }
+    ext->hashes = hashes;
+    ext->hash_map_size = map_size;
+    return hash_check(mq, leaf_count);
+}
+
+static void hash_close(struct persimq_ext* ext)
+{
+    if (ext->hash_fd) close(ext->hash_fd); // Read-only queues may have the file open without a tree
+    ext->hash_fd = 0;
+    if (!ext->hashes) return;
+    munmap(ext->hashes, ext->hash_map_size);
+    free(ext->hash_dirty);
+    ext->hashes = NULL;
+    ext->hash_dirty = NULL;
+}
+
+// Brings the block hash tree of a queue up to date.
+static bool hash_prepare(T_PERSIMQ* mq, const char* caller)
+{
+    if (mq->read_only && mq->fd && mq->ext && mq->ext->hashes) return true; // See hash_attach()
+    if (!mq->fd || mq->read_only || !mq->ext || !mq->ext->hashes) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "%s(): the queue has no block hash tree (see the \"hash_block_size\" option)!\n", caller);
+            fflush(stderr);
+        }
+        return false;
+    }
+    return staging_flush(mq) && hash_update(mq);
+}
+
+// Returns the root hash of a queue.
+bool PERSIMQ_hash_root(T_PERSIMQ* mq, uint64_t* root)
+{
+    if (!hash_prepare(mq, "PERSIMQ_hash_root")) return false;
+    *root = hash_nodes(mq->ext)[1];
+    return true;
+}
+
+// Collects the divergent blocks of a subtree.
+static void hash_diff_node(T_PERSIMQ* a, T_PERSIMQ* b, uint64_t node, off_t* offsets, uint64_t max_blocks,
+    uint64_t* count)
+{
+    uint64_t leaf_count = a->ext->hashes->leaf_count;
+    if (hash_nodes(a->ext)[node] == hash_nodes(b->ext)[node]) return;
+    if (node >= leaf_count) {
+        uint64_t block = node - leaf_count;
+        if (block >= a->ext->hash_blocks) return;
+        if (*count < max_blocks) hash_block_range(a, block, &offsets[*count]);
+        (*count)++;
+        return;
+    }
+    hash_diff_node(a, b, node * 2, offsets, max_blocks, count);
+    hash_diff_node(a, b, node * 2 + 1, offsets, max_blocks, count);
+}
+
+// Finds the blocks which differ between two queues.
+int64_t PERSIMQ_hash_diff(T_PERSIMQ* a, T_PERSIMQ* b, off_t* offsets, uint64_t max_blocks)
+{
+    // Read-only queues get a private tree with the block size of the other queue
+    if (a->read_only && b->read_only) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_hash_diff(): at least one of the queues must be open for writing!\n"); fflush(stderr);
+        }
+        return -1;
+    }
+    if (a->read_only && a->fd && a->ext && b->ext && b->options.hash_block_size &&
+            !hash_attach(a, b->options.hash_block_size)) return -1;
+    if (b->read_only && b->fd && b->ext && a->ext && a->options.hash_block_size &&
+            !hash_attach(b, a->options.hash_block_size)) return -1;
+    if (!hash_prepare(a, "PERSIMQ_hash_diff") || !hash_prepare(b, "PERSIMQ_hash_diff")) return -1;
+    if ((a->file_size != b->file_size) || (a->options.hash_block_size != b->options.hash_block_size)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_hash_diff(): the queue file and hash block sizes must match!\n"); fflush(stderr);
+        }
+        return -1;
+    }
+    uint64_t count = 0;
+    hash_diff_node(a, b, 1, offsets, max_blocks, &count);
+    return count;
+}
+
+// Copies the blobs the queued messages of "source" refer to into the blob file of "target". The
+// blob file is not covered by the hash tree, the blobs are copied at the same offsets.
+static bool hash_repair_blobs(T_PERSIMQ* target, T_PERSIMQ* source)
+{
+    struct persimq_ext* ext = target->ext;
+    if (!source->ext->blob_fd || !source->count_messages) return true;
+    T_PERSIMQ_Cursor cursor;
+    if (!PERSIMQ_cursor_init(&cursor, source, 65536, source->extract_ptr, source->count_bytes)) return false;
+    uint8_t chunk[65536];
+    size_t size;
+    bool result = true;
+    while (result && PERSIMQ_cursor_next(&cursor, NULL, &size)) {
+        if (cursor.blob_offset < 0) continue;
+        for (size_t done = 0; result && (done < size);) {
+            size_t length = ((size - done) < sizeof(chunk)) ? (size - done) : sizeof(chunk);
+            result = multiread(source->ext->blob_fd, chunk, length, cursor.blob_offset + done) &&
+                multiwrite(ext->blob_fd, chunk, length, cursor.blob_offset + done);
+            done += length;
+        }
+    }
+    if (!result && (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY)) {
+        perror("PERSIMQ_hash_repair(): blob copy");
+    }
+    result = result && !cursor.error;
+    PERSIMQ_cursor_free(&cursor);
+    if (ext->blob_end < source->ext->blob_end) ext->blob_end = source->ext->blob_end;
+    ext->blob_unsynced = true;
+    return result;
+}
+
+// Copies the divergent blocks, the blobs and the queue state from "source" to "target".
+bool PERSIMQ_hash_repair(T_PERSIMQ* target, T_PERSIMQ* source, uint64_t* copied_blocks)
+{
+    if (copied_blocks) *copied_blocks = 0;
+    if (target->read_only) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_hash_repair(): the target queue must be open for writing!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    int64_t count = PERSIMQ_hash_diff(target, source, NULL, 0);
+    if (count < 0) return false;
+    if (source->ext->blob_fd && !target->ext->blob_fd) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_hash_repair(): the source queue has blobs, the target has no blob file "
+                "(see the \"blob_threshold\" option)!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    if (!hash_repair_blobs(target, source)) return false;
+    uint8_t* buffer = malloc(target->options.hash_block_size);
+    if (!buffer) return false;
+    uint64_t* target_nodes = hash_nodes(target->ext);
+    uint64_t* source_nodes = hash_nodes(source->ext);
+    uint64_t leaf_count = target->ext->hashes->leaf_count;
+    for (uint64_t block = 0; count && (block < target->ext->hash_blocks); block++) {
+        if (target_nodes[leaf_count + block] == source_nodes[leaf_count + block]) continue;
+        off_t offset;
+        size_t length = hash_block_range(target, block, &offset);
+        if (!multiread(source->fd, buffer, length, offset) || !multiwrite(target->fd, buffer, length, offset)) {
+            free(buffer);
+            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                perror("PERSIMQ_hash_repair(): block copy");
+            }
+            return false;
+        }
+        cache_invalidate(target, offset, length);
+        hash_mark(target, offset, length);
+        if (copied_blocks) (*copied_blocks)++;
+        count--;
+    }
+    free(buffer);
+    target->append_ptr = source->append_ptr;
+    target->extract_ptr = source->extract_ptr;
+    target->count_bytes = source->count_bytes;
+    target->count_messages = source->count_messages;
+    if (target->ext->dedup && !dedup_rebuild(target)) return false;
+    cancel_reset(target);
+    fadvise_reset(target);
+    tail_reset(target);
+    return PERSIMQ_sync(target);
+}
+
+// Fills the options struct with the default values.
+void PERSIMQ_options_init(T_PERSIMQ_Options* options)
+{
+    memset(options, 0, sizeof(T_PERSIMQ_Options));
+}
+
+typedef enum {
+    OPTION_TYPE_SIZE,
+    OPTION_TYPE_UINT32,
+    OPTION_TYPE_BOOL,
+    OPTION_TYPE_PATH
+} T_OptionType;
+
+typedef struct {
+    const char* key;
+    T_OptionType type;
+    size_t offset;
+} T_OptionKey;
+
+// Option file keys. Keep in sync with T_PERSIMQ_Options.
+static const T_OptionKey option_table[] = {
+    { "file_size",      OPTION_TYPE_SIZE,   offsetof(T_PERSIMQ_Options, file_size) },
+    { "sync_interval",  OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_Options, sync_interval) },
+    { "sync_data_only", OPTION_TYPE_BOOL,   offsetof(T_PERSIMQ_Options, sync_data_only) },
+    { "tx_log_path",    OPTION_TYPE_PATH,   offsetof(T_PERSIMQ_Options, tx_log_path) },
+    { "read_cache_size", OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_Options, read_cache_size) },
+    { "burst_size",     OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_Options, burst_size) },
+    { "burst_max_delay_ms", OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_Options, burst_max_delay_ms) },
+    { "fadvise_window", OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_Options, fadvise_window) },
+    { "fadvise_drop_written", OPTION_TYPE_BOOL, offsetof(T_PERSIMQ_Options, fadvise_drop_written) },
+    { "payload_alignment", OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_Options, payload_alignment) },
+    { "shared_state",   OPTION_TYPE_BOOL,   offsetof(T_PERSIMQ_Options, shared_state) },
+    { "stall_io_ms",    OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_Options, stall_io_ms) },
+    { "stall_sync_ms",  OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_Options, stall_sync_ms) },
+    { "hash_block_size", OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_Options, hash_block_size) },
+    { "tail_index",     OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_Options, tail_index) },
+    { "cancel_slots",   OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_Options, cancel_slots) },
+    { "blob_threshold", OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_Options, blob_threshold) },
+    { "compress_watermark", OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_Options, compress_watermark) },
+    { "blob_dedup",     OPTION_TYPE_BOOL,   offsetof(T_PERSIMQ_Options, blob_dedup) },
+};
+
+// Parses a non-negative number with an optional K/M/G suffix.
+static bool parse_option_number(const char* text, uint64_t* value)
+{
+    char* end;
+    errno = 0;
+    *value = strtoull(text, &end, 0);
+    if (errno || (end == text) || (*text == '-')) return false;
+    switch (toupper((unsigned char)*end)) {
+        case 'K': *value <<= 10; end++; break;
+        case 'M': *value <<= 20; end++; break;
+        case 'G': *value <<= 30; end++; break;
+    }
+    return !*end;
+}
+
+// Loads the "key = value" lines of a text file to the fields of "target" described by "table".
+static bool options_parse(void* target, const T_OptionKey* table, size_t table_size, const char* path,
+    const char* caller)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "%s: file open: %s\n", caller, strerror(errno)); fflush(stderr);
+        }
+        return false;
+    }
+    bool result = true;
+    char line[512];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        char* comment = strchr(line, '#');
+        if (comment) *comment = 0;
+        char key[64], value[256];
+        int fields = sscanf(line, " %63[^= \t\r\n] = %255s", key, value);
+        if (fields <= 0) continue; // Empty line
+        size_t idx = 0;
+        while ((idx < table_size) && strcmp(table[idx].key, key)) idx++;
+        if (idx == table_size) {
+            // Unknown keys are skipped so that newer option files can still be used
+            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_AND_WARNINGS) {
+                printf("%s: unknown option \"%s\" at line %d ignored.\n", caller, key, line_number);
+            }
+            continue;
+        }
+        uint64_t number;
+        void* field = (uint8_t*)target + table[idx].offset;
+        bool parsed = (fields == 2);
+        if (parsed && (table[idx].type == OPTION_TYPE_PATH)) {
+            strcpy((char*)field, value); // Both buffers have the same size
+        } else if (parsed && (table[idx].type == OPTION_TYPE_BOOL)) {
+            if (!strcasecmp(value, "yes") || !strcasecmp(value, "true") || !strcmp(value, "1")) {
+                *(bool*)field = true;
+            } else if (!strcasecmp(value, "no") || !strcasecmp(value, "false") || !strcmp(value, "0")) {
+                *(bool*)field = false;
+            } else {
+                parsed = false;
+            }
+        } else if (parsed && parse_option_number(value, &number)) {
+            if (table[idx].type == OPTION_TYPE_SIZE) {
+                *(off_t*)field = number;
+            } else if (number <= UINT32_MAX) {
+                *(uint32_t*)field = number;
+            } else {
+                parsed = false;
+            }
+        } else {
+            parsed = false;
+        }
+        if (!parsed) {
+            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                fprintf(stderr, "%s: bad value of \"%s\" at line %d!\n", caller, key, line_number);
+                fflush(stderr);
+            }
+            result = false;
+        }
+    }
+    fclose(file);
+    return result;
+}
+
+// Loads options from a text file.
+bool PERSIMQ_options_load(T_PERSIMQ_Options* options, char* options_path)
+{
+    return options_parse(options, option_table, sizeof(option_table)/sizeof(option_table[0]), options_path,
+        "PERSIMQ_options_load()");
+}
+
+// Saves all the options to a text file.
+bool PERSIMQ_options_save(const T_PERSIMQ_Options* options, char* options_path, const char* comment)
+{
+    FILE* file = fopen(options_path, "w");
+    if (!file) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_options_save(): file open");
+        }
+        return false;
+    }
+    if (comment) {
+        // Every comment line has to be prefixed
+        fputs("# ", file);
+        for (const char* c = comment; *c; c++) {
+            fputc(*c, file);
+            if ((*c == '\n') && c[1]) fputs("# ", file);
+        }
+        if (comment[0] && (comment[strlen(comment)-1] != '\n')) fputc('\n', file);
+    }
+    for (size_t idx = 0; idx < sizeof(option_table)/sizeof(option_table[0]); idx++) {
+        const void* field = (const uint8_t*)options + option_table[idx].offset;
+        switch (option_table[idx].type) {
+            case OPTION_TYPE_SIZE:
+                fprintf(file, "%s = %" PRIu64 "\n", option_table[idx].key, (uint64_t)*(const off_t*)field);
+                break;
+            case OPTION_TYPE_UINT32:
+                fprintf(file, "%s = %" PRIu32 "\n", option_table[idx].key, *(const uint32_t*)field);
+                break;
+            case OPTION_TYPE_BOOL:
+                fprintf(file, "%s = %s\n", option_table[idx].key, *(const bool*)field ? "yes" : "no");
+                break;
+            case OPTION_TYPE_PATH:
+                if (*(const char*)field) fprintf(file, "%s = %s\n", option_table[idx].key, (const char*)field);
+                break;
+        }
+    }
+    bool result = !ferror(file);
+    result &= !fclose(file);
+    return result;
+}
+
+// --- Device model ---
+// Slow flash devices (eMMC, SD cards) can be simulated on a workstation: every queue file I/O
+// is done as usual and then the calling thread sleeps for the time the modelled device would
+// need. Garbage collection stalls follow the bytes written by all the queues of the process,
+// the sync cost follows the bytes written since the previous sync of the queue.
+
+static T_PERSIMQ_DeviceModel device_model;
+static bool device_model_set = false;
+static uint64_t device_written = 0; // Bytes written to the simulated device
+
+// Device model file keys. Keep in sync with T_PERSIMQ_DeviceModel.
+static const T_OptionKey device_table[] = {
+    { "read_us",         OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_DeviceModel, read_us) },
+    { "read_us_per_mb",  OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_DeviceModel, read_us_per_mb) },
+    { "write_us",        OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_DeviceModel, write_us) },
+    { "write_us_per_mb", OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_DeviceModel, write_us_per_mb) },
+    { "unaligned_us",    OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_DeviceModel, unaligned_us) },
+    { "page_size",       OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_DeviceModel, page_size) },
+    { "sync_us",         OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_DeviceModel, sync_us) },
+    { "sync_us_per_mb",  OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_DeviceModel, sync_us_per_mb) },
+    { "gc_interval",     OPTION_TYPE_SIZE,   offsetof(T_PERSIMQ_DeviceModel, gc_interval) },
+    { "gc_stall_us",     OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_DeviceModel, gc_stall_us) },
+    { "jitter_percent",  OPTION_TYPE_UINT32, offsetof(T_PERSIMQ_DeviceModel, jitter_percent) },
+};
+
+// Sets the process-wide simulated device.
+void PERSIMQ_set_device_model(const T_PERSIMQ_DeviceModel* model)
+{
+    if (model) device_model = *model;
+    device_model_set = (model != NULL);
+}
+
+// Loads a device model from a text file.
+bool PERSIMQ_device_model_load(T_PERSIMQ_DeviceModel* model, const char* model_path)
+{
+    return options_parse(model, device_table, sizeof(device_table)/sizeof(device_table[0]), model_path,
+        "PERSIMQ_device_model_load()");
+}
+
+// Returns a random number with a roughly exponential distribution and a mean of about 1:
+// the integer part of -log2() of a uniform number plus a uniform fraction, scaled by ln(2).
+static double device_random_tail(void)
+{
+    static __thread uint64_t state = 0;
+    if (!state) state = ((uintptr_t)&state * 2654435761u) | 1;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (__builtin_clz((uint32_t)(state >> 32) | 1) + (state & 0xFFFF) / 65536.0) * 0.6931;
+}
+
+// Sleeps for the time the simulated device needs for an operation.
+static void device_delay(T_PERSIMQ* mq, T_DeviceOp op, off_t offset, size_t length)
+{
+    if (!device_model_set) return;
+    const T_PERSIMQ_DeviceModel* model = &device_model;
+    uint64_t cost_us;
+    if (op == DEVICE_READ) {
+        cost_us = model->read_us + (((uint64_t)length * model->read_us_per_mb) >> 20);
+    } else if (op == DEVICE_WRITE) {
+        uint32_t page_size = model->page_size ? model->page_size : 4096;
+        cost_us = model->write_us + (((uint64_t)length * model->write_us_per_mb) >> 20);
+        if ((offset % page_size) || ((offset + length) % page_size)) cost_us += model->unaligned_us;
+        if (mq->ext) mq->ext->device_unsynced += length;
+        if (model->gc_interval > 0) {
+            uint64_t written = __atomic_fetch_add(&device_written, length, __ATOMIC_RELAXED);
+            if ((written / model->gc_interval) != ((written + length) / model->gc_interval)) cost_us += model->gc_stall_us;
+        }
+    } else {
+        uint64_t unsynced = mq->ext ? mq->ext->device_unsynced : length;
+        cost_us = model->sync_us + ((unsynced * model->sync_us_per_mb) >> 20);
+        if (mq->ext) mq->ext->device_unsynced = 0;
+    }
+    if (model->jitter_percent) cost_us += cost_us * model->jitter_percent / 100 * device_random_tail();
+    if (!cost_us) return;
+    struct timespec pause = { cost_us / 1000000, (cost_us % 1000000) * 1000 };
+    while (nanosleep(&pause, &pause) && (errno == EINTR));
+}
+
+// Opens a queue file and initializes a T_PERSIMQ struct.
+bool PERSIMQ_open(T_PERSIMQ* mq, char* mqfile_path, off_t mqfile_size)
+{
+    T_PERSIMQ_Options options;
+    PERSIMQ_options_init(&options);
+    options.file_size = mqfile_size;
+    return PERSIMQ_open_with_options(mq, mqfile_path, &options);
+}
+
+// Opens a queue file using the provided options.
+bool PERSIMQ_open_with_options(T_PERSIMQ* mq, char* mqfile_path, const T_PERSIMQ_Options* options)
+{
+    off_t mqfile_size = options->file_size;
+    mq->ext = NULL;
+    // some sanity checks
+    if (mqfile_size <= (sizeof(TFileHeader) + sizeof(TMessageHeader) + 1)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_open: file size error!\n"); fflush(stderr);
+        }
+        return false; // Requestd file size is not big enough to fit anytnig useful
+    }
+    uint32_t alignment = options->payload_alignment;
+    if (alignment && ((alignment < sizeof(TMessageHeader)) || (alignment > PERSIMQ_MAX_PAYLOAD_ALIGNMENT) ||
+            (alignment & (alignment - 1)))) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_open: unsupported payload alignment!\n"); fflush(stderr);
+        }
+        return false;
+    }
+
+    // Open the file (create if does not exist)
+    mode_t oldpermmask = umask(0); // Allow S_IRGRP disabled by the mask by default
+    if ((mq->fd = open(mqfile_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) == -1) {
+        mq->fd = 0;
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_open: file open");
+        }
+        return false;
+    }
+    umask(oldpermmask); // Restore the mask
+
+    #ifdef __unix__
+        if (flock(mq->fd, LOCK_EX)) {
+            mq->fd = 0;
+            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                perror("PERSIMQ_open: file lock");
+            }
+            return false;
+        }
+    #endif
+
+    // Fill the file with zeroes up to the required size in case it has just been created
+    if (ftruncate(mq->fd, mqfile_size)) return false;
+
+    // Initialize the queue structure
+    TFileHeader header;
+    if (!multiread(mq->fd, (void*)&header, sizeof(header), 0)) { // Error
+        #ifdef __unix__
+            flock(mq->fd, LOCK_UN);
+        #endif
+        close(mq->fd);
+        mq->fd = 0;
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_open(): file read");
+        }
+        return false;
+    }
+    uint8_t crc = eval_crc8((void*)&header, sizeof(header)-1);
+    bool header_found = !strncmp((void*)&header.ID, "lPmQ", 4) &&
+            (crc == header.crc) &&
+            (mqfile_size == header.file_size);
+    if (header_found) {
+        // Header found
+        mq->append_ptr = header.append_ptr;
+        mq->extract_ptr = header.extract_ptr;
+        mq->count_bytes = header.count_bytes;
+        mq->count_messages = header.count_messages;
+    } else {
+        // New queue file or file size changed or damaged header
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_AND_WARNINGS) {
+            printf("PERSIMQ_open(): incorrect file header - new or damaged queue file detected!\n");
+        }
+        mq->append_ptr = sizeof(TFileHeader);
+        mq->extract_ptr = sizeof(TFileHeader);
+        mq->count_bytes = 0;
+        mq->count_messages = 0;
+    }
+    mq->file_size = mqfile_size;
+    mq->read_only = false;
+    mq->options = *options;
+    mq->ops_since_sync = 0;
+    if (!(mq->ext = persimq_ext_create())) {
+        PERSIMQ_drop(mq);
+        mq->fd = 0;
+        return false;
+    }
+    mq->ext->file_header = header;
+    // The state file is newer than the header if the process has crashed
+    // (a new queue gets a header right away so that the state file is trusted after a crash)
+    if (mq->options.shared_state &&
+            (!state_open(mq, mqfile_path, header_found) || (!header_found && !PERSIMQ_write_header(mq)))) {
+        PERSIMQ_drop(mq);
+        mq->fd = 0;
+        return false;
+    }
+    if (mq->options.hash_block_size && !hash_open(mq, mqfile_path)) {
+        PERSIMQ_drop(mq);
+        mq->fd = 0;
+        return false;
+    }
+    if (!blob_open(mq, mqfile_path)) {
+        PERSIMQ_drop(mq);
+        mq->fd = 0;
+        return false;
+    }
+    if (mq->options.tail_index && !(mq->ext->tail_offsets = calloc(mq->options.tail_index, sizeof(off_t)))) {
+        PERSIMQ_drop(mq);
+        mq->fd = 0;
+        return false;
+    }
+    if (mq->ext->tail_offsets) mem_pin(mq->ext, mq->options.tail_index * sizeof(off_t));
+    fadvise_reset(mq);
+    stall_rebase(mq);
+    readers_publish(mq);
+    // Finish the last transaction if it has been committed but the header did not make it to the disk
+    if (mq->options.tx_log_path[0] && (!tx_mark_open(mq, mqfile_path) || (header_found && !PERSIMQ_tx_recover(mq)))) {
+        PERSIMQ_drop(mq);
+        mq->fd = 0;
+        return false;
+    }
+    if (mq->options.cancel_slots && !cancel_open(mq, mqfile_path)) {
+        PERSIMQ_drop(mq);
+        mq->fd = 0;
+        return false;
+    }
+    frame_open(mq);
+    if (!dedup_open(mq)) {
+        PERSIMQ_drop(mq);
+        mq->fd = 0;
+        return false;
+    }
+    if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_INFO) {
+        printf("PERSIMQ_open(): append_ptr=0x%" PRIX64 ", extract_ptr=0x%" PRIX64
+            ", count_bytes=%" PRId64 ", count_messages=%" PRId64 ", file_size=%" PRId64 ".\n",
+            (uint64_t)mq->append_ptr, (uint64_t)mq->extract_ptr,
+            (uint64_t)mq->count_bytes, (uint64_t)mq->count_messages, (uint64_t)mq->file_size); fflush(stdout);
+    }
+    // Done
+    return true;
+}
+
+// Reads the state of a read-only queue from the shared state file or the file header.
+// The header is only accepted if it is intact, the queue state is left as is otherwise.
+static bool PERSIMQ_load_header(T_PERSIMQ* mq)
+{
+    TFileHeader header;
+    if (pread(mq->fd, (void*)&header, sizeof(header), 0) != sizeof(header)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_load_header(): file read");
+        }
+        return false;
+    }
+    if (state_load(mq, &header)) return true; // The owner keeps the live state in the shared state file
+    if (strncmp((void*)&header.ID, "lPmQ", 4) ||
+            (eval_crc8((void*)&header, sizeof(header)-1) != header.crc) ||
+            (mq->file_size != header.file_size)) {
+        // No queue stored yet or the header is being written right now
+        return false;
+    }
+    mq->append_ptr = header.append_ptr;
+    mq->extract_ptr = header.extract_ptr;
+    mq->count_bytes = header.count_bytes;
+    mq->count_messages = header.count_messages;
+    return true;
+}
+
+// Opens a queue file for reading only.
+bool PERSIMQ_open_readonly(T_PERSIMQ* mq, char* mqfile_path)
+{
+    struct stat st;
+    mq->ext = NULL;
+    if ((mq->fd = open(mqfile_path, O_RDONLY)) == -1) {
+        mq->fd = 0;
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_open_readonly(): file open");
+        }
+        return false;
+    }
+    if (fstat(mq->fd, &st) || (st.st_size <= (sizeof(TFileHeader) + sizeof(TMessageHeader) + 1))) {
+        close(mq->fd);
+        mq->fd = 0;
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_open_readonly(): file size error!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    mq->file_size = st.st_size;
+    mq->read_only = true;
+    PERSIMQ_options_init(&mq->options);
+    mq->options.file_size = st.st_size;
+    mq->ops_since_sync = 0;
+    if (!(mq->ext = persimq_ext_create())) {
+        close(mq->fd);
+        mq->fd = 0;
+        return false;
+    }
+    mq->append_ptr = sizeof(TFileHeader);
+    mq->extract_ptr = sizeof(TFileHeader);
+    mq->count_bytes = 0;
+    mq->count_messages = 0;
+    state_attach(mq, mqfile_path);
+    blob_open(mq, mqfile_path);
+    char hash_path[4096]; // Mapped by PERSIMQ_hash_diff() if needed
+    if (snprintf(hash_path, sizeof(hash_path), "%s%s", mqfile_path, HASH_FILE_SUFFIX) < sizeof(hash_path)) {
+        int fd = open(hash_path, O_RDONLY);
+        mq->ext->hash_fd = (fd < 0) ? 0 : fd;
+    }
+    if (!PERSIMQ_load_header(mq) && (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_AND_WARNINGS)) {
+        printf("PERSIMQ_open_readonly(): incorrect file header - the queue is treated as empty!\n");
+    }
+    frame_open(mq);
+    if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_INFO) {
+        printf("PERSIMQ_open_readonly(): append_ptr=0x%" PRIX64 ", extract_ptr=0x%" PRIX64
+            ", count_bytes=%" PRId64 ", count_messages=%" PRId64 ", file_size=%" PRId64 ".\n",
+            (uint64_t)mq->append_ptr, (uint64_t)mq->extract_ptr,
+            (uint64_t)mq->count_bytes, (uint64_t)mq->count_messages, (uint64_t)mq->file_size); fflush(stdout);
+    }
+    return true;
+}
+
+// Reloads the queue state of a read-only queue from the file header.
+bool PERSIMQ_refresh(T_PERSIMQ* mq)
+{
+    if (!mq->fd || !mq->read_only) return false; // Only makes sense for read-only queues
+    return PERSIMQ_load_header(mq);
+}
+
+bool PERSIMQ_is_open(T_PERSIMQ* mq)
+{
+    return (mq->fd);
+}
+
+// Writes all the changes and closes a queue file.
+bool PERSIMQ_close(T_PERSIMQ* mq)
+{
+    if (!mq->fd) { // File already closed, do not attempt to close stdout.
+        persimq_ext_destroy(mq->ext); // The file may have been closed because of an error
+        mq->ext = NULL;
+        return true;
+    }
+    if (mq->read_only) return PERSIMQ_drop(mq); // Nothing to write
+    bool result = true;
+    result &= PERSIMQ_sync(mq);
+    #ifdef __unix__
+        flock(mq->fd, LOCK_UN); // May not be necesary but just in case...
+    #endif
+    result &= (close(mq->fd) >= 0);
+    persimq_ext_destroy(mq->ext);
+    mq->ext = NULL;
+    return result;
+}
+
+// Closes a queue file without updating the metadata.
+bool PERSIMQ_drop(T_PERSIMQ* mq)
+{
+    persimq_ext_destroy(mq->ext);
+    mq->ext = NULL;
+    if (!mq->fd) return true; // File already closed, do not attempt to close stdout.
+    #ifdef __unix__
+        flock(mq->fd, LOCK_UN); // May not be necesary but just in case...
+    #endif
+    return (close(mq->fd) >= 0);
+}
+
+// Clears the queue and writes the changes to the queue file.
+bool PERSIMQ_clear(T_PERSIMQ* mq)
+{
+    if (!mq->fd || mq->read_only) return false; // MQ uninitialized, file not opened.
+    mq->append_ptr = sizeof(TFileHeader);
+    mq->extract_ptr = sizeof(TFileHeader);
+    mq->count_bytes = 0;
+    mq->count_messages = 0;
+    if (mq->ext) mq->ext->blob_released = mq->ext->blob_end;
+    dedup_reset(mq->ext);
+    cancel_reset(mq);
+    frame_reset(mq);
+    staging_discard(mq);
+    fadvise_reset(mq);
+    tail_reset(mq);
+    return PERSIMQ_sync(mq);
+}
+
+// Stores the current queue state to the file header (without syncing).
+static bool PERSIMQ_write_header(T_PERSIMQ* mq)
+{
+    // The header must never describe records which are not in the file
+    if (!staging_flush(mq)) return false;
+    bool result = true;
+    TFileHeader header = {
+        "lPmQ",
+        mq->append_ptr,
+        mq->extract_ptr,
+        mq->count_bytes,
+        mq->count_messages,
+        mq->file_size,
+        0 // crc is filled in below
+    };
+    header.crc = eval_crc8((void*)&header, sizeof(header)-1);
+    // A header which moves the queue on from a committed state may bring it back to the state a
+    // logged commit started from, the commit must not be replayed from then on
+    if (mq->ext && mq->ext->tx_mark_sequence && memcmp(&header, &mq->ext->file_header, sizeof(header))) {
+        if (!tx_mark(mq)) return false;
+    }
+    result &= frame_save(mq); // The frame state must not be older than the header
+    struct timespec start;
+    stall_begin(mq, &start);
+    bool written = multiwrite(mq->fd, (void*)&header, sizeof(header), 0);
+    if (written && mq->ext) mq->ext->file_header = header; // Published with the state below
+    result &= written;
+    device_delay(mq, DEVICE_WRITE, 0, sizeof(header));
+    stall_end(mq, "header write", 0, sizeof(header), &start, false);
+    result &= cancel_save(mq);
+    state_publish(mq);
+    readers_publish(mq);
+    return result;
+}
+
+// Writes current queue changes to the queue file.
+bool PERSIMQ_sync(T_PERSIMQ* mq)
+{
+    if (!mq->fd || mq->read_only) return false; // MQ uninitialized, file not opened.
+    bool result = blob_sync(mq);
+    result &= PERSIMQ_write_header(mq);
+    #ifdef __unix__
+        struct timespec start;
+        stall_begin(mq, &start);
+        if (mq->options.sync_data_only) {
+            result &= (fdatasync(mq->fd) >= 0); // The file size never changes so the metadata is not needed
+        } else {
+            result &= (fsync(mq->fd) >= 0);
+        }
+        device_delay(mq, DEVICE_SYNC, 0, 0);
+        stall_end(mq, mq->options.sync_data_only ? "fdatasync" : "fsync", 0, PERSIMQ_distance(mq, mq->ext ?
+            mq->ext->synced_append : mq->append_ptr, mq->append_ptr), &start, true);
+        if (mq->ext && mq->ext->cancel_unsynced) result &= cancel_sync(mq);
+    #endif
+    result &= hash_update(mq); // The tree is stamped with the synced header
+    mq->ops_since_sync = 0;
+    if (result) fadvise_synced(mq);
+    if (result) blob_reclaim(mq);
+    stall_rebase(mq);
+    if (result) compress_check(mq);
+    return result;
+}
+
+// Syncs the queue if the configured amount of push/pop operations has been reached.
+static bool PERSIMQ_auto_sync(T_PERSIMQ* mq)
+{
+    if (!staging_expire(mq)) return false;
+    state_publish(mq);
+    readers_publish(mq);
+    if (!mq->options.sync_interval || (++mq->ops_since_sync < mq->options.sync_interval)) return true;
+    return PERSIMQ_sync(mq);
+}
+
+// Writes a record at the end of the queue.
+static bool PERSIMQ_write_record(T_PERSIMQ* mq, TMessageHeader* header, const struct iovec* parts, int part_count)
+{
+    size_t record_size = sizeof(TMessageHeader) + header->message_size;
+    off_t record_ptr = mq->append_ptr;
+    cache_invalidate(mq, mq->append_ptr, record_size);
+    cancel_forget(mq, mq->append_ptr, record_size);
+    bool staged;
+    if (!staging_push(mq, header, parts, part_count, &staged)) return false;
+    if (staged) {
+        mq->append_ptr = offset_roll(mq->append_ptr, mq->file_size, record_size);
+        mq->count_bytes += record_size;
+        cancel_wrapped(mq, record_ptr);
+        return true;
+    }
+    if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_DEBUG) {
+        printf("Writing header...\n"); fflush(stdout);
+    }
+    if (!queue_io(mq, "write", (void*)header, sizeof(TMessageHeader), mq->append_ptr, NULL, true)) {
+        #ifdef __unix__
+            flock(mq->fd, LOCK_UN);
+        #endif
+        close(mq->fd);
+        mq->fd = 0;
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_push(): file write (header)"); fflush(stderr);
+        }
+        return false;
+    }
+    if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_DEBUG) {
+        printf("Writing data...\n"); fflush(stdout);
+    }
+    off_t data_ptr = offset_roll(mq->append_ptr, mq->file_size, sizeof(TMessageHeader));
+    for (int idx = 0; idx < part_count; idx++) {
+        if (!parts[idx].iov_len) continue;
+        if (!queue_io(mq, "write", parts[idx].iov_base, parts[idx].iov_len, data_ptr, &data_ptr, true)) {
+            #ifdef __unix__
+                flock(mq->fd, LOCK_UN);
+            #endif
+            close(mq->fd);
+            mq->fd = 0;
+            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                perror("PERSIMQ_push(): file write (data)");
+            }
+            return false;
+        }
+    }
+    mq->append_ptr = data_ptr;
+    mq->count_bytes += record_size;
+    cancel_wrapped(mq, record_ptr);
+    return true;
+}
+
+// Returns the size of the padding record needed in front of the next record (0 - none).
+static size_t PERSIMQ_padding_size(T_PERSIMQ* mq)
+{
+    size_t alignment = mq->options.payload_alignment;
+    if (!alignment) return 0;
+    size_t padding = (alignment - ((mq->append_ptr + sizeof(TMessageHeader)) & (alignment - 1))) & (alignment - 1);
+    if (padding && (padding < sizeof(TMessageHeader))) padding += alignment; // Room for the padding header
+    return padding;
+}
+
+// Writes a message made of several parts at the end of the queue.
+// "reserved_bytes" of the free space are not touched.
+static bool PERSIMQ_push_message(T_PERSIMQ* mq, const struct iovec* parts, int part_count, off_t reserved_bytes)
+{
+    if (!mq->fd) { // MQ uninitialized, file not opened.
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_push(): Uninitialized MQ struct provided!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    if (mq->read_only) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_push(): The queue is opened read-only!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    size_t message_size = 0;
+    uint8_t crc = 0;
+    for (int idx = 0; idx < part_count; idx++) {
+        message_size += parts[idx].iov_len;
+        crc = eval_crc8_continue(crc, parts[idx].iov_base, parts[idx].iov_len);
+    }
+    // Big payloads go to the blob file, the queue only gets a reference to them
+    bool in_blob = mq->options.blob_threshold && (message_size > mq->options.blob_threshold) &&
+        mq->ext && mq->ext->blob_fd;
+    size_t record_payload = in_blob ? sizeof(TBlobRef) : message_size;
+    size_t padding = PERSIMQ_padding_size(mq);
+    if ((message_size > UINT32_MAX) ||
+            (PERSIMQ_bytes_free(mq) < (padding + sizeof(TMessageHeader) + record_payload + reserved_bytes))) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_push(): MQ does not have enough free space to accept the message!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    TBlobRef ref;
+    struct iovec ref_part = { &ref, sizeof(ref) };
+    struct blob_dedup* dedup = NULL; // Counted when the reference is written
+    if (in_blob && mq->options.blob_dedup && mq->ext->dedup) {
+        uint64_t hash = hash_parts(parts, part_count, message_size);
+        if ((dedup = dedup_find(mq, parts, part_count, message_size, hash))) {
+            ref = (TBlobRef){ dedup->offset, message_size, crc };
+        } else {
+            if (!blob_store(mq, parts, part_count, message_size, crc, &ref)) return false;
+            dedup_add(mq->ext, hash, &ref);
+        }
+    } else if (in_blob && !blob_store(mq, parts, part_count, message_size, crc, &ref)) {
+        return false;
+    }
+    if (in_blob) {
+        parts = &ref_part;
+        part_count = 1;
+        crc = eval_crc8((void*)&ref, sizeof(ref));
+    }
+    if (padding) {
+        TMessageHeader padding_header = { "PMP", 0, padding - sizeof(TMessageHeader) };
+        struct iovec padding_part = { (void*)padding_data, padding_header.message_size };
+        if (!PERSIMQ_write_record(mq, &padding_header, &padding_part, 1)) return false;
+    }
+    TMessageHeader header = {
+        "PMQ",
+        crc,
+        record_payload
+    };
+    if (in_blob) memcpy(header.ID, "PMB", 3);
+    off_t record_ptr = mq->append_ptr;
+    if (!PERSIMQ_write_record(mq, &header, parts, part_count)) return false;
+    if (dedup) dedup->refs++;
+    mq->count_messages++;
+    tail_add(mq, record_ptr);
+    return true;
+}
+
+// Adds a message to the queue.
+bool PERSIMQ_push(T_PERSIMQ* mq, void* message, size_t message_size)
+{
+    struct iovec part = { message, message_size };
+    return PERSIMQ_push_message(mq, &part, 1, 0) && PERSIMQ_auto_sync(mq);
+}
+
+// Adds a message to the queue and returns its key for PERSIMQ_cancel().
+bool PERSIMQ_push_keyed(T_PERSIMQ* mq, void* message, size_t message_size, off_t* key)
+{
+    struct iovec part = { message, message_size };
+    off_t record_ptr = offset_roll(mq->append_ptr, mq->file_size, PERSIMQ_padding_size(mq));
+    if (!PERSIMQ_push_message(mq, &part, 1, 0)) return false;
+    TMessageHeader header;
+    if (key && mq->ext && mq->ext->cancel_offsets) {
+        if (!PERSIMQ_read_data(mq, &header, sizeof(header), record_ptr)) return false;
+        *key = cancel_key(mq, record_ptr, header.message_crc);
+    } else if (key) {
+        *key = record_ptr; // Can not be cancelled anyway
+    }
+    return PERSIMQ_auto_sync(mq);
+}
+
+// Adds a message made of several parts to the queue.
+bool PERSIMQ_pushv(T_PERSIMQ* mq, const struct iovec* parts, int part_count)
+{
+    return PERSIMQ_push_message(mq, parts, part_count, 0) && PERSIMQ_auto_sync(mq);
+}
+
+// Reads the header of the message at "*offset". Padding records are skipped, "*offset" is moved
+// to the message header in this case.
+static bool PERSIMQ_read_message_header(T_PERSIMQ* mq, TMessageHeader* header, off_t* offset)
+{
+    if (!mq->fd) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_read_message_header(): Uninitialized MQ struct provided!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    if (!header) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_read_message_header(): incorrect TMessageHeader pointer!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    *offset = offset_roll(*offset, mq->file_size, 0); // Sanitize the offset (should not be needed but just in case...)
+
+    bool padding;
+    do {
+        if (!PERSIMQ_read_data(mq, (void*)header, sizeof(TMessageHeader), *offset)) {
+            #ifdef __unix__
+                flock(mq->fd, LOCK_UN);
+            #endif
+            close(mq->fd);
+            mq->fd = 0;
+            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                perror("PERSIMQ_read_message_header(): file read error");
+            }
+            return false;
+        }
+        padding = is_padding(header);
+        if (padding) *offset = offset_roll(*offset, mq->file_size, sizeof(TMessageHeader) + header->message_size);
+    } while (padding);
+    // Check the header
+    if (!is_message(header) && memcmp(header->ID, "PMZ", 3)) { // Broken header
+        #ifdef __unix__
+            flock(mq->fd, LOCK_UN);
+        #endif
+        close(mq->fd);
+        mq->fd = 0;
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            printf("PERSIMQ_read_message_header(): bad ID (damaged message header at offset 0x%" PRIX64 ")! File closed!\n",
+                (int64_t)*offset);
+        }
+        return false;
+    }
+    return true;
+}
+
+
+// Removes the first record from a queue. The size of the removed record is stored to "record_size".
+static bool PERSIMQ_pop_record(T_PERSIMQ* mq, off_t* record_size)
+{
+    if (!mq->fd) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_pop(): Uninitialized MQ struct provided!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    if (mq->read_only) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_pop(): The queue is opened read-only!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    // Check if we have any mesasges left to read
+    if (!PERSIMQ_messages_available(mq)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_pop(): Can not remove messages from an empty queue!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    // Read the header
+    TMessageHeader header;
+    off_t message_ptr = mq->extract_ptr;
+    if (!PERSIMQ_read_message_header(mq, &header, &message_ptr)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_pop(): Message header read error!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    bool record_done = true; // A compressed frame is removed with its last message
+    if (!memcmp(header.ID, "PMZ", 3)) {
+        if (!frame_pop(mq, &header, message_ptr, &record_done)) return false;
+    } else if (!memcmp(header.ID, "PMB", 3)) {
+        TPayload payload;
+        if (!PERSIMQ_locate_payload(mq, &header, message_ptr, &payload)) return false;
+        blob_release(mq, &payload);
+    }
+    // Roll the indexes (the padding in front of the message is removed too)
+    off_t removed = PERSIMQ_distance(mq, mq->extract_ptr, message_ptr);
+    if (record_done) {
+        removed += header.message_size + sizeof(header);
+        message_ptr = offset_roll(message_ptr, mq->file_size, header.message_size+sizeof(header));
+    }
+    mq->extract_ptr = message_ptr;
+    mq->count_bytes -= removed;
+    mq->count_messages--;
+    if (record_size) *record_size = removed;
+    staging_trim(mq);
+    fadvise_consumed(mq);
+    return true;
+}
+
+// Removes the first message from a queue together with the cancelled messages behind it.
+// The size of the removed records is stored to "record_size".
+static bool PERSIMQ_pop_message(T_PERSIMQ* mq, off_t* record_size)
+{
+    off_t removed;
+    if (!PERSIMQ_pop_record(mq, &removed) || !cancel_skip(mq, &removed)) return false;
+    if (record_size) *record_size = removed;
+    return true;
+}
+
+// Removes the first message from a queue (if available).
+bool PERSIMQ_pop(T_PERSIMQ* mq)
+{
+    return PERSIMQ_pop_message(mq, NULL) && PERSIMQ_auto_sync(mq);
+}
+
+// Removes "pop_count" messages from a queue (if available - otherwise all the messages are
+// removed unless the queue is empty in which case "false" is returned).
+bool PERSIMQ_pop_n(T_PERSIMQ* mq, uint64_t pop_count)
+{
+    if (mq->read_only) return false;
+    if (pop_count >= mq->count_messages) {
+        // The quick option - just clear the entire queue
+        if ((PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_INFO) && (pop_count > mq->count_messages)) {
+            printf("PERSIMQ_get(): Buffer does not contain the requested amount of messages!\n");
+        }
+        pop_count = mq->count_messages;
+        mq->extract_ptr = mq->append_ptr;
+        mq->count_bytes = 0;
+        mq->count_messages = 0;
+        if (mq->ext) mq->ext->blob_released = mq->ext->blob_end;
+        dedup_reset(mq->ext);
+        frame_reset(mq);
+        staging_trim(mq);
+        fadvise_consumed(mq);
+        state_publish(mq);
+        readers_publish(mq);
+        return true;
+    } else {
+        // The long option - remove them one by one
+        bool result = true;
+        for (int i = 0; i < pop_count; i++) result &= PERSIMQ_pop(mq);
+        return result;
+    }
+}
+
+static bool PERSIMQ_read_message_data(T_PERSIMQ* mq, void* buffer, size_t buffer_size,
+    const size_t message_size, const uint8_t message_crc,
+    const off_t extract_ptr)
+{
+    // Read the message
+    if (!PERSIMQ_read_data(mq, buffer, message_size, extract_ptr)) {
+        #ifdef __unix__
+            flock(mq->fd, LOCK_UN);
+        #endif
+        close(mq->fd);
+        mq->fd = 0;
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_read_message_data(): file read (data)");
+        }
+        return false;
+    }
+    // Check the message
+    uint8_t crc = eval_crc8(buffer, message_size);
+    if (crc != message_crc) { // Corrupted message detected
+        #ifdef __unix__
+            flock(mq->fd, LOCK_UN);
+        #endif
+        close(mq->fd);
+        mq->fd = 0;
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_read_message_data(): bad CRC (damaged message at offset 0x%" PRId64 ")! File closed!\n", (int64_t)extract_ptr);
+            fflush(stderr);
+        }
+        return false;
+    }
+    return true; // Done!
+}
+
+// Finds the payload of a message record. For a blob reference it is in the blob file, for a
+// compressed frame it is the first message of the frame which has not been popped yet.
+static bool PERSIMQ_locate_payload(T_PERSIMQ* mq, const TMessageHeader* header, off_t message_ptr,
+    TPayload* payload)
+{
+    memset(payload, 0, sizeof(*payload));
+    if (!memcmp(header->ID, "PMZ", 3)) {
+        TFrame frame;
+        return frame_load(mq, header, message_ptr, &frame) &&
+            frame_payload(mq, frame_consumed(mq, message_ptr, &frame), payload);
+    }
+    if (!memcmp(header->ID, "PMB", 3)) {
+        TBlobRef ref;
+        if (!blob_read_ref(mq, header, message_ptr, &ref)) return false;
+        payload->in_blob = true;
+        payload->offset = ref.offset;
+        payload->size = ref.size;
+        payload->crc = ref.crc;
+        return true;
+    }
+    payload->offset = offset_roll(message_ptr, mq->file_size, sizeof(TMessageHeader));
+    payload->size = header->message_size;
+    payload->crc = header->message_crc;
+    return true;
+}
+
+// Reads a payload found by PERSIMQ_locate_payload().
+static bool PERSIMQ_read_payload(T_PERSIMQ* mq, const TPayload* payload, void* buffer, size_t buffer_size)
+{
+    if (payload->in_blob) {
+        TBlobRef ref = { payload->offset, payload->size, payload->crc };
+        return blob_read(mq, &ref, buffer);
+    }
+    if (payload->data) {
+        if (eval_crc8((uint8_t*)payload->data, payload->size) != payload->crc) {
+            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                fprintf(stderr, "PERSIMQ_get(): bad CRC (damaged message in a compressed frame)!\n"); fflush(stderr);
+            }
+            return false;
+        }
+        memcpy(buffer, payload->data, payload->size);
+        return true;
+    }
+    return PERSIMQ_read_message_data(mq, buffer, buffer_size, payload->size, payload->crc, payload->offset);
+}
+
+// Reads the first message from a queue (if available).
+bool PERSIMQ_get(T_PERSIMQ* mq, void* buffer, size_t buffer_size, size_t* message_size)
+{
+    if (!mq->fd) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_pop(): Uninitialized MQ struct provided!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    if (!mq->read_only && !staging_expire(mq)) return false;
+    // Check if we have any mesasges left to read
+    if (!PERSIMQ_messages_available(mq)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_INFO) {
+            printf("PERSIMQ_get(): Buffer does not contain any messages!\n");
+        }
+        return false;
+    }
+    // Read the header
+    TMessageHeader header;
+    off_t message_ptr = mq->extract_ptr;
+    if (!PERSIMQ_read_message_header(mq, &header, &message_ptr)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_get_message_by_offset(): Message header read error!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    TPayload payload;
+    if (!PERSIMQ_locate_payload(mq, &header, message_ptr, &payload)) return false;
+    if (message_size) *message_size = payload.size;
+    if (payload.size > buffer_size) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            printf("PERSIMQ_get(): Buffer size is not big enough to fit the message!\n");
+        }
+        return false;
+    }
+    return PERSIMQ_read_payload(mq, &payload, buffer, buffer_size);
+}
+
+// Writes the payload of the first message of a queue to a file, pipe or socket.
+bool PERSIMQ_get_to_fd(T_PERSIMQ* mq, int out_fd, size_t* message_size)
+{
+    TMessageHeader header;
+    off_t message_ptr = mq->extract_ptr;
+    if (!mq->fd || !PERSIMQ_messages_available(mq) || !PERSIMQ_read_message_header(mq, &header, &message_ptr)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_INFO) {
+            printf("PERSIMQ_get_to_fd(): no message to read!\n");
+        }
+        return false;
+    }
+    TPayload payload;
+    if (!PERSIMQ_locate_payload(mq, &header, message_ptr, &payload)) return false;
+    if (message_size) *message_size = payload.size;
+    off_t offset = payload.offset;
+    uint8_t* buffer = NULL;
+    if (!payload.in_blob) { // Payloads in the queue file are read (and checked) through the usual path
+        buffer = malloc(payload.size + 1);
+        if (!buffer || !PERSIMQ_read_payload(mq, &payload, buffer, payload.size)) {
+            free(buffer);
+            return false;
+        }
+    }
+    size_t done = 0;
+    while (done < payload.size) {
+        ssize_t sent = payload.in_blob ? sendfile(out_fd, mq->ext->blob_fd, &offset, payload.size - done) :
+            write(out_fd, buffer + done, payload.size - done);
+        if ((sent < 0) && (errno == EINTR)) continue;
+        if (sent <= 0) break;
+        done += sent;
+    }
+    free(buffer);
+    if ((done < payload.size) && (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY)) {
+        perror("PERSIMQ_get_to_fd(): write");
+    }
+    return (done == payload.size);
+}
+
+// Reads all the messages from a queue (up to the "messages_limit" and up to the buffer size).
+bool PERSIMQ_get_all(T_PERSIMQ* mq, void* buffer, size_t buffer_size, uint64_t max_messages,
+    size_t* total_size, uint64_t* messages_read)
+{
+    if (!mq->fd) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_pop(): Uninitialized MQ struct provided!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    // Check if we have any mesasges left to read
+    if (!PERSIMQ_messages_available(mq)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_INFO) {
+            printf("PERSIMQ_get(): Buffer does not contain any messages!\n");
+        }
+        return false;
+    }
+    // Start extracting the messages
+    bool result = true;
+    size_t total_size_used = buffer_size;
+    uint64_t message_idx = 0;
+    uint64_t messages_seen = 0;
+    off_t current_ptr = mq->extract_ptr;
+    while ((messages_seen < mq->count_messages) && (message_idx < max_messages)) {
+        messages_seen++;
+        // Get message header
+        TMessageHeader header;
+        if (!PERSIMQ_read_message_header(mq, &header, &current_ptr)) {
+            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                fprintf(stderr, "PERSIMQ_get_message_by_offset(): Message header read error!\n"); fflush(stderr);
+            }
+            return false;
+        }
+        if (cancel_find(mq->ext, current_ptr) >= 0) { // Cancelled - the payload is not read
+            current_ptr = offset_roll(current_ptr, mq->file_size, header.message_size + sizeof(header));
+            continue;
+        }
+        // A compressed frame holds several messages
+        TFrame frame = { .messages = 1 };
+        bool in_frame = !memcmp(header.ID, "PMZ", 3);
+        if (in_frame && !frame_load(mq, &header, current_ptr, &frame)) return false;
+        uint32_t frame_idx = in_frame ? frame_consumed(mq, current_ptr, &frame) : 0;
+        messages_seen--;
+        bool stop = false;
+        while ((frame_idx < frame.messages) && (messages_seen < mq->count_messages) && (message_idx < max_messages)) {
+            messages_seen++;
+            message_idx++;
+            TPayload payload;
+            if (in_frame ? !frame_payload(mq, frame_idx++, &payload) :
+                    !PERSIMQ_locate_payload(mq, &header, current_ptr, &payload)) {
+                return false;
+            }
+            if (payload.size > buffer_size) { // No space left in the user buffer
+                stop = true;
+                break;
+            }
+            // Read the message and adjust the buffer pointer
+            result &= PERSIMQ_read_payload(mq, &payload, buffer, buffer_size);
+            if (!result) break; // Do not continue on read errors
+            buffer += payload.size; buffer_size -= payload.size;
+            frame_idx += !in_frame;
+        }
+        if (stop || !result) break;
+        // Go to the next message
+        current_ptr = offset_roll(current_ptr, mq->file_size, header.message_size + sizeof(header));
+    }
+    if (total_size) *total_size = total_size_used - buffer_size;
+    if (messages_read) *messages_read = message_idx;
+    return result;
+}
+
+// Starts a new cursor chunk at the current record. At least "needed" bytes are read.
+// The chunk is placed at the same alignment as the record in the file and does not go
+// over the end of the file unless the record itself is split there.
+static bool PERSIMQ_cursor_fill(T_PERSIMQ_Cursor* cursor, size_t needed)
+{
+    T_PERSIMQ* mq = cursor->mq;
+    size_t shift = cursor->offset & (PERSIMQ_MAX_PAYLOAD_ALIGNMENT - 1);
+    if (needed > cursor->buffer_size) { // Oversized record - grow the buffer to fit it
+        void* new_buffer;
+        if (posix_memalign(&new_buffer, PERSIMQ_MAX_PAYLOAD_ALIGNMENT, needed + PERSIMQ_MAX_PAYLOAD_ALIGNMENT)) {
+            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                fprintf(stderr, "PERSIMQ_cursor_next(): Out of memory!\n"); fflush(stderr);
+            }
+            cursor->error = true;
+            return false;
+        }
+        free(cursor->buffer);
+        cursor->buffer = new_buffer;
+        cursor->buffer_size = needed;
+    }
+    size_t length = cursor->buffer_size;
+    if (length > cursor->bytes_left) length = cursor->bytes_left;
+    if (length > (mq->file_size - cursor->offset)) length = mq->file_size - cursor->offset;
+    if ((length < needed) || (length >= (mq->file_size - wrap_lo_margin))) length = needed;
+    if (!queue_io(mq, "read", cursor->buffer + shift, length, cursor->offset, NULL, false)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_cursor_next(): file read");
+        }
+        cursor->error = true;
+        return false;
+    }
+    cursor->chunk_pos = shift;
+    cursor->chunk_length = shift + length;
+    return true;
+}
+
+// Prepares a cursor for walking "length" queue bytes starting from the record at "offset".
+bool PERSIMQ_cursor_init(T_PERSIMQ_Cursor* cursor, T_PERSIMQ* mq, size_t chunk_size,
+    off_t offset, off_t length)
+{
+    memset(cursor, 0, sizeof(*cursor)); // PERSIMQ_cursor_free() is safe even when this fails
+    cursor->blob_offset = -1;
     if (!mq->fd) {
         if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            fprintf(stderr, "PERSIMQ_pop(): Uninitialized MQ struct provided!\n"); fflush(stderr);
+            fprintf(stderr, "PERSIMQ_cursor_init(): Uninitialized MQ struct provided!\n"); fflush(stderr);
+        }
+        cursor->error = true;
+        return false;
+    }
+    if (!mq->read_only && !staging_flush(mq)) { // The cursor reads the file only
+        cursor->error = true;
+        return false;
+    }
+    if (chunk_size < sizeof(TMessageHeader)) chunk_size = sizeof(TMessageHeader);
+    void* buffer = NULL;
+    cursor->mq = mq;
+    cursor->offset = offset_roll(offset, mq->file_size, 0);
+    cursor->bytes_left = length;
+    cursor->error = !!posix_memalign(&buffer, PERSIMQ_MAX_PAYLOAD_ALIGNMENT, chunk_size + PERSIMQ_MAX_PAYLOAD_ALIGNMENT);
+    cursor->buffer = cursor->error ? NULL : buffer;
+    cursor->buffer_size = cursor->error ? 0 : chunk_size;
+    return !cursor->error;
+}
+
+// Checks the payload of a message record returned by a cursor and resolves blob references.
+static bool PERSIMQ_cursor_payload(T_PERSIMQ_Cursor* cursor, const TMessageHeader* header, uint8_t* data,
+    const void** message, size_t* message_size)
+{
+    if (eval_crc8(data, header->message_size) != header->message_crc) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_cursor_next(): bad CRC (damaged message at offset 0x%" PRIX64 ")!\n",
+                (uint64_t)cursor->offset); fflush(stderr);
+        }
+        cursor->error = true;
+        return false;
+    }
+    size_t payload_size = header->message_size;
+    cursor->blob_offset = -1;
+    if (!memcmp(header->ID, "PMB", 3)) { // The payload is in the blob file
+        TBlobRef ref;
+        struct persimq_ext* ext = cursor->mq->ext;
+        if ((header->message_size != sizeof(ref)) || !ext || !ext->blob_fd) {
+            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                fprintf(stderr, "PERSIMQ_cursor_next(): bad blob reference at offset 0x%" PRIX64 " or no blob file!\n",
+                    (uint64_t)cursor->offset); fflush(stderr);
+            }
+            cursor->error = true;
+            return false;
+        }
+        memcpy(&ref, data, sizeof(ref));
+        cursor->blob_offset = ref.offset;
+        if (message) {
+            if (ref.size > cursor->blob_size) {
+                free(cursor->blob);
+                cursor->blob_size = 0;
+                if (!(cursor->blob = malloc(ref.size))) {
+                    if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                        fprintf(stderr, "PERSIMQ_cursor_next(): Out of memory!\n"); fflush(stderr);
+                    }
+                    cursor->error = true;
+                    return false;
+                }
+                cursor->blob_size = ref.size;
+            }
+            if (!blob_read(cursor->mq, &ref, cursor->blob)) {
+                cursor->error = true;
+                return false;
+            }
+            data = cursor->blob;
+        }
+        payload_size = ref.size;
+    }
+    if (message) *message = data;
+    if (message_size) *message_size = payload_size;
+    return true;
+}
+
+// Returns the next message of the compressed frame being walked by a cursor.
+static bool PERSIMQ_cursor_frame_next(T_PERSIMQ_Cursor* cursor, const void** message, size_t* message_size)
+{
+    TMessageHeader header;
+    size_t left = cursor->frame_length - cursor->frame_pos;
+    if (left >= sizeof(header)) memcpy(&header, cursor->frame + cursor->frame_pos, sizeof(header));
+    if ((left < sizeof(header)) || !is_message(&header) || (header.message_size > (left - sizeof(header)))) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_cursor_next(): damaged compressed frame before offset 0x%" PRIX64 "!\n",
+                (uint64_t)cursor->offset); fflush(stderr);
+        }
+        cursor->error = true;
+        return false;
+    }
+    if (!PERSIMQ_cursor_payload(cursor, &header, cursor->frame + cursor->frame_pos + sizeof(header),
+            message, message_size)) {
+        return false;
+    }
+    cursor->record_offset = 0; // Not a record of the queue file
+    cursor->frame_pos += sizeof(header) + header.message_size;
+    return true;
+}
+
+// Decompresses the frame record at the cursor position and skips its popped messages.
+static bool PERSIMQ_cursor_frame_load(T_PERSIMQ_Cursor* cursor, const TMessageHeader* header, uint8_t* data)
+{
+    TFrame frame;
+    uint32_t compressed = header->message_size - sizeof(frame);
+    memcpy(&frame, data, sizeof(frame));
+    if (!frame_size_valid(cursor->mq, &frame)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_cursor_next(): damaged compressed frame at offset 0x%" PRIX64 "!\n",
+                (uint64_t)cursor->offset); fflush(stderr);
+        }
+        cursor->error = true;
+        return false;
+    }
+    if (frame.raw_size > cursor->frame_size) {
+        free(cursor->frame);
+        cursor->frame_size = 0;
+        if (!(cursor->frame = malloc(frame.raw_size))) {
+            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                fprintf(stderr, "PERSIMQ_cursor_next(): Out of memory!\n"); fflush(stderr);
+            }
+            cursor->error = true;
+            return false;
+        }
+        cursor->frame_size = frame.raw_size;
+    }
+    if ((eval_crc8(data + sizeof(frame), compressed) != header->message_crc) ||
+            (lz_decompress(data + sizeof(frame), compressed, cursor->frame, frame.raw_size) != frame.raw_size)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_cursor_next(): damaged compressed frame at offset 0x%" PRIX64 "!\n",
+                (uint64_t)cursor->offset); fflush(stderr);
+        }
+        cursor->error = true;
+        return false;
+    }
+    cursor->frame_pos = 0;
+    cursor->frame_length = frame.raw_size;
+    for (uint32_t idx = frame_consumed(cursor->mq, cursor->offset, &frame); idx; idx--) {
+        TMessageHeader inner;
+        if ((cursor->frame_length - cursor->frame_pos) < sizeof(inner)) break;
+        memcpy(&inner, cursor->frame + cursor->frame_pos, sizeof(inner));
+        cursor->frame_pos += sizeof(inner) + inner.message_size;
+        if (cursor->frame_pos > cursor->frame_length) cursor->frame_pos = cursor->frame_length;
+    }
+    return true;
+}
+
+// Returns the next message of a cursor.
+bool PERSIMQ_cursor_next(T_PERSIMQ_Cursor* cursor, const void** message, size_t* message_size)
+{
+    TMessageHeader header;
+    size_t record_size;
+    while (true) {
+        if (cursor->error) return false;
+        if (cursor->frame_pos < cursor->frame_length) {
+            return PERSIMQ_cursor_frame_next(cursor, message, message_size);
+        }
+        if (cursor->bytes_left < sizeof(TMessageHeader)) return false;
+        if ((cursor->chunk_length - cursor->chunk_pos) < sizeof(TMessageHeader)) {
+            if (!PERSIMQ_cursor_fill(cursor, sizeof(TMessageHeader))) return false;
+        }
+        memcpy(&header, cursor->buffer + cursor->chunk_pos, sizeof(header));
+        record_size = sizeof(header) + header.message_size;
+        bool frame = !memcmp(header.ID, "PMZ", 3) && (header.message_size >= sizeof(TFrame));
+        if ((!is_padding(&header) && !frame) || (record_size > cursor->bytes_left)) break;
+        if (frame) { // The messages of a compressed frame are returned from memory
+            if ((cursor->chunk_length - cursor->chunk_pos) < record_size) {
+                if (!PERSIMQ_cursor_fill(cursor, record_size)) return false;
+            }
+            if (!PERSIMQ_cursor_frame_load(cursor, &header, cursor->buffer + cursor->chunk_pos + sizeof(header))) {
+                return false;
+            }
+        }
+        // Skip the padding (or the loaded frame)
+        if ((cursor->chunk_length - cursor->chunk_pos) < record_size) {
+            cursor->chunk_length = cursor->chunk_pos; // The rest of the chunk is useless
+        } else {
+            cursor->chunk_pos += record_size;
+        }
+        cursor->bytes_left -= record_size;
+        cursor->offset = offset_roll(cursor->offset, cursor->mq->file_size, record_size);
+        if (cursor->chunk_length == cursor->chunk_pos) cursor->chunk_pos = cursor->chunk_length = 0;
+    }
+    if (!is_message(&header) || (record_size > cursor->bytes_left)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_cursor_next(): damaged message header at offset 0x%" PRIX64 "!\n",
+                (uint64_t)cursor->offset); fflush(stderr);
+        }
+        cursor->error = true;
+        return false;
+    }
+    if ((cursor->chunk_length - cursor->chunk_pos) < record_size) {
+        if (!PERSIMQ_cursor_fill(cursor, record_size)) return false;
+    }
+    uint8_t* data = cursor->buffer + cursor->chunk_pos + sizeof(header);
+    if (!PERSIMQ_cursor_payload(cursor, &header, data, message, message_size)) return false;
+    cursor->record_offset = cursor->offset;
+    cursor->chunk_pos += record_size;
+    cursor->bytes_left -= record_size;
+    cursor->offset = offset_roll(cursor->offset, cursor->mq->file_size, record_size);
+    return true;
+}
+
+// Releases the cursor buffer.
+void PERSIMQ_cursor_free(T_PERSIMQ_Cursor* cursor)
+{
+    free(cursor->buffer);
+    cursor->buffer = NULL;
+    cursor->buffer_size = 0;
+    free(cursor->blob);
+    cursor->blob = NULL;
+    cursor->blob_size = 0;
+    free(cursor->frame);
+    cursor->frame = NULL;
+    cursor->frame_size = cursor->frame_pos = cursor->frame_length = 0;
+}
+
+// Ruturns the distance in queue bytes from "from_offset" to "to_offset" going forward.
+off_t PERSIMQ_distance(T_PERSIMQ* mq, off_t from_offset, off_t to_offset)
+{
+    off_t data_size = mq->file_size - wrap_lo_margin;
+    return (to_offset - from_offset + data_size) % data_size;
+}
+
+// --- Bulk ingest ---
+// The stream is read in big chunks and only the length prefixes are parsed. The payloads are
+// written straight from the read buffer: the headers and payloads of a batch go to the file with
+// a single pwritev() call (split in two at the end of the file). The payload CRC in the message
+// headers needs every byte once, so the data is not spliced past user space. With the burst mode
+// or the payload alignment the messages go through the regular push path instead, as do the
+// payloads stored in the blob file (and deduplicated there).
+
+#define INGEST_BATCH_RECORDS  (IOV_MAX / 2)
+
+// Writes a gathered buffer list at a file offset.
+static bool multiwritev(int fd, struct iovec* parts, int part_count, off_t offset)
+{
+    while (part_count) {
+        ssize_t result = pwritev(fd, parts, part_count, offset);
+        if (result <= 0) return false;
+        offset += result;
+        while (part_count && (result >= parts->iov_len)) {
+            result -= parts->iov_len;
+            parts++;
+            part_count--;
+        }
+        if (part_count) {
+            parts->iov_base = (uint8_t*)parts->iov_base + result;
+            parts->iov_len -= result;
+        }
+    }
+    return true;
+}
+
+// Writes a batch of records at the end of the queue ("parts" holds the header and the payload of
+// each record and is used up by the write).
+static bool ingest_write(T_PERSIMQ* mq, const TMessageHeader* headers, struct iovec* parts, int count, size_t length)
+{
+    int part_count = count * 2;
+    off_t offset = mq->append_ptr;
+    size_t first_length = mq->file_size - offset;
+    cache_invalidate(mq, offset, length);
+    cancel_forget(mq, offset, length);
+    struct timespec start;
+    stall_begin(mq, &start);
+    bool result;
+    if (length <= first_length) {
+        result = multiwritev(mq->fd, parts, part_count, offset);
+    } else { // Split the part crossing the end of the file
+        int idx = 0;
+        size_t done = 0;
+        while ((done + parts[idx].iov_len) <= first_length) done += parts[idx++].iov_len;
+        size_t cut = first_length - done;
+        struct iovec rest = { (uint8_t*)parts[idx].iov_base + cut, parts[idx].iov_len - cut };
+        parts[idx].iov_len = cut;
+        result = multiwritev(mq->fd, parts, idx + 1, offset);
+        parts[idx] = rest;
+        result = result && multiwritev(mq->fd, parts + idx, part_count - idx, wrap_lo_margin);
+    }
+    device_delay(mq, DEVICE_WRITE, offset, length);
+    stall_end(mq, "ingest write", offset, length, &start, false);
+    hash_mark(mq, offset, length);
+    if (!result) {
+        #ifdef __unix__
+            flock(mq->fd, LOCK_UN);
+        #endif
+        close(mq->fd);
+        mq->fd = 0;
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_ingest_from_fd(): file write");
+        }
+        return false;
+    }
+    mq->append_ptr = offset_roll(offset, mq->file_size, length);
+    mq->count_bytes += length;
+    mq->count_messages += count;
+    cancel_wrapped(mq, offset);
+    for (int idx = 0; idx < count; idx++) {
+        tail_add(mq, offset);
+        offset = offset_roll(offset, mq->file_size, sizeof(TMessageHeader) + headers[idx].message_size);
+    }
+    mq->ops_since_sync += count - 1; // The batch counts as "count" push operations
+    return PERSIMQ_auto_sync(mq);
+}
+
+// Prepares a bulk ingest of a length prefixed message stream.
+bool PERSIMQ_ingest_init(T_PERSIMQ_Ingest* ingest, T_PERSIMQ_Framing framing, uint32_t max_message_size,
+    size_t buffer_size)
+{
+    memset(ingest, 0, sizeof(*ingest));
+    if (framing == PERSIMQ_FRAMING_U16_BE && (max_message_size > UINT16_MAX)) max_message_size = UINT16_MAX;
+    if (buffer_size < (max_message_size + sizeof(uint32_t))) buffer_size = max_message_size + sizeof(uint32_t);
+    ingest->buffer = malloc(buffer_size);
+    if (!ingest->buffer) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_ingest_init(): Out of memory!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    ingest->framing = framing;
+    ingest->max_message_size = max_message_size;
+    ingest->buffer_size = buffer_size;
+    return true;
+}
+
+// Adds the messages of a length prefixed stream to the queue.
+bool PERSIMQ_ingest_from_fd(T_PERSIMQ* mq, int in_fd, T_PERSIMQ_Ingest* ingest)
+{
+    if (!mq->fd || mq->read_only || !ingest->buffer) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_ingest_from_fd(): Uninitialized MQ or ingest struct provided!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    bool per_message = mq->options.burst_size || mq->options.payload_alignment;
+    size_t prefix = (ingest->framing == PERSIMQ_FRAMING_U16_BE) ? sizeof(uint16_t) : sizeof(uint32_t);
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    bool limit = false;
+    ingest->queue_full = false;
+    while (!limit && !ingest->queue_full) {
+        // Take all the whole frames buffered so far
+        TMessageHeader headers[INGEST_BATCH_RECORDS];
+        struct iovec parts[INGEST_BATCH_RECORDS * 2];
+        int count = 0;
+        size_t length = 0;
+        size_t space = per_message ? 0 : PERSIMQ_bytes_free(mq);
+        bool need_data = false;
+        while (count < INGEST_BATCH_RECORDS) {
+            size_t available = ingest->buffer_length - ingest->buffer_pos;
+            const uint8_t* frame = ingest->buffer + ingest->buffer_pos;
+            if (available < prefix) {
+                need_data = true;
+                break;
+            }
+            uint32_t size;
+            switch (ingest->framing) {
+                case PERSIMQ_FRAMING_U32_LE:
+                    size = frame[0] | (frame[1] << 8) | (frame[2] << 16) | ((uint32_t)frame[3] << 24); break;
+                case PERSIMQ_FRAMING_U32_BE:
+                    size = ((uint32_t)frame[0] << 24) | (frame[1] << 16) | (frame[2] << 8) | frame[3]; break;
+                default:
+                    size = (frame[0] << 8) | frame[1]; break;
+            }
+            if (size > ingest->max_message_size) {
+                if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                    fprintf(stderr, "PERSIMQ_ingest_from_fd(): message size %" PRIu32 " is over the limit!\n", size);
+                    fflush(stderr);
+                }
+                return false;
+            }
+            if (available < (prefix + size)) {
+                need_data = true;
+                break;
+            }
+            limit = (ingest->max_messages && ((messages + count) >= ingest->max_messages)) ||
+                (ingest->max_bytes && ((bytes + length - count * sizeof(TMessageHeader) + size) > ingest->max_bytes));
+            if (limit) break;
+            struct iovec payload = { (void*)(frame + prefix), size };
+            bool in_blob = mq->options.blob_threshold && (size > mq->options.blob_threshold);
+            if (in_blob && count) break; // Write the batch first
+            if (per_message || in_blob) {
+                size_t record_size = sizeof(TMessageHeader) + (in_blob ? sizeof(TBlobRef) : size);
+                if (PERSIMQ_bytes_free(mq) < (PERSIMQ_padding_size(mq) + record_size)) {
+                    ingest->queue_full = true;
+                    break;
+                }
+                if (!PERSIMQ_push_message(mq, &payload, 1, 0) || !PERSIMQ_auto_sync(mq)) return false;
+                messages++;
+                bytes += size;
+            } else {
+                if ((length + sizeof(TMessageHeader) + size) > space) {
+                    ingest->queue_full = true;
+                    break;
+                }
+                TMessageHeader header = { "PMQ", eval_crc8(payload.iov_base, size), size };
+                headers[count] = header;
+                parts[count * 2].iov_base = &headers[count];
+                parts[count * 2].iov_len = sizeof(TMessageHeader);
+                parts[count * 2 + 1] = payload;
+                length += sizeof(TMessageHeader) + size;
+                count++;
+            }
+            ingest->buffer_pos += prefix + size;
+        }
+        if (count) {
+            if (!ingest_write(mq, headers, parts, count, length)) return false;
+            messages += count;
+            bytes += length - count * sizeof(TMessageHeader);
+        }
+        if (!need_data || limit || ingest->queue_full) continue;
+        // Keep the partial frame and read more data after it
+        ingest->buffer_length -= ingest->buffer_pos;
+        memmove(ingest->buffer, ingest->buffer + ingest->buffer_pos, ingest->buffer_length);
+        ingest->buffer_pos = 0;
+        ssize_t received = read(in_fd, ingest->buffer + ingest->buffer_length, ingest->buffer_size - ingest->buffer_length);
+        if (received > 0) {
+            ingest->buffer_length += received;
+        } else if (!received) {
+            ingest->eof = true;
+            break;
+        } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            break;
+        } else if (errno != EINTR) {
+            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                perror("PERSIMQ_ingest_from_fd(): stream read");
+            }
+            ingest->messages += messages;
+            ingest->bytes += bytes;
+            return false;
+        }
+    }
+    ingest->messages += messages;
+    ingest->bytes += bytes;
+    return true;
+}
+
+// Releases the ingest buffer.
+void PERSIMQ_ingest_free(T_PERSIMQ_Ingest* ingest)
+{
+    free(ingest->buffer);
+    ingest->buffer = NULL;
+    ingest->buffer_size = ingest->buffer_pos = ingest->buffer_length = 0;
+}
+
+// --- Newest-first reads ---
+// The offsets of the newest message records are kept in a ring as they are pushed so the latest
+// messages are found without walking the queue from its head. The record format is not changed:
+// the index is built by a single walk over the queue when it is needed for the first time after
+// opening the queue (or after the queue has been changed by other means), then it is kept up to
+// date in O(1) per push. The consumer does not use the index, pops only make its oldest entries stale.
+
+// Adds a pushed message record to the index.
+static void tail_add(T_PERSIMQ* mq, off_t offset)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext || !ext->tail_offsets || !ext->tail_valid) return;
+    ext->tail_offsets[ext->tail_head] = offset;
+    ext->tail_head = (ext->tail_head + 1) % mq->options.tail_index;
+    if (ext->tail_count < mq->options.tail_index) ext->tail_count++;
+    ext->tail_append = mq->append_ptr;
+}
+
+// Drops the index (it is built again when needed).
+static void tail_reset(T_PERSIMQ* mq)
+{
+    if (mq->ext) mq->ext->tail_valid = false;
+}
+
+// Builds the index by walking the queue.
+static bool tail_rebuild(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    ext->tail_head = 0;
+    ext->tail_count = 0;
+    ext->tail_valid = true;
+    T_PERSIMQ_Cursor cursor;
+    if (!PERSIMQ_cursor_init(&cursor, mq, 65536, mq->extract_ptr, mq->count_bytes)) return false;
+    while (PERSIMQ_cursor_next(&cursor, NULL, NULL)) {
+        if (cursor.record_offset) tail_add(mq, cursor.record_offset); // Compressed messages are not indexed
+    }
+    bool result = !cursor.error;
+    PERSIMQ_cursor_free(&cursor);
+    ext->tail_append = mq->append_ptr;
+    ext->tail_valid = result;
+    return result;
+}
+
+// Ruturns the amount of the newest messages which can be read with PERSIMQ_get_newest().
+off_t PERSIMQ_newest_available(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!mq->fd || mq->read_only || !ext || !ext->tail_offsets) return 0;
+    if ((!ext->tail_valid || (ext->tail_append != mq->append_ptr)) && !tail_rebuild(mq)) return 0;
+    return (ext->tail_count < mq->count_messages) ? ext->tail_count : mq->count_messages;
+}
+
+// Reads the "index"-th newest message of the queue (0 - the last pushed one).
+bool PERSIMQ_get_newest(T_PERSIMQ* mq, uint64_t index, void* buffer, size_t buffer_size, size_t* message_size)
+{
+    if (index >= PERSIMQ_newest_available(mq)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_INFO) {
+            printf("PERSIMQ_get_newest(): the message is not in the queue or not indexed!\n");
+        }
+        return false;
+    }
+    struct persimq_ext* ext = mq->ext;
+    uint32_t slot = (ext->tail_head + mq->options.tail_index - 1 - index) % mq->options.tail_index;
+    off_t message_ptr = ext->tail_offsets[slot];
+    TMessageHeader header;
+    TPayload payload;
+    if (!PERSIMQ_read_message_header(mq, &header, &message_ptr) ||
+            !PERSIMQ_locate_payload(mq, &header, message_ptr, &payload)) {
+        return false;
+    }
+    if (message_size) *message_size = payload.size;
+    if (payload.size > buffer_size) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            printf("PERSIMQ_get_newest(): Buffer size is not big enough to fit the message!\n");
+        }
+        return false;
+    }
+    return PERSIMQ_read_payload(mq, &payload, buffer, buffer_size);
+}
+
+// --- Cancellation ---
+// A cancelled message is not removed from the file. Its record offset (the key returned at push
+// time) goes to a small table of tombstones and the consumer skips the record after reading only
+// its header. The first record of a queue is never a cancelled one: cancelled records reaching the
+// head are popped right away. A tombstone is dropped when the record is overwritten and the
+// tombstones behind the head are dropped when the table is written to "<queue file>.cancel".
+
+#define CANCEL_FILE_SUFFIX ".cancel"
+
+#define CANCEL_TEMP_SUFFIX ".new" // The cancel file is replaced by renaming a new one
+#define CANCEL_KEY_CRC_SHIFT (55)  // Key bits: record CRC | epoch | offset (as many bits as the file needs)
+
+// Cancel file header, followed by "count" 64-bit record offsets (the CRC covers both)
+typedef struct {
+    char ID[4];
+    uint32_t count;
+    uint32_t epoch;
+    uint8_t crc;
+} __attribute__((packed)) TCancelFile;
+
+// Returns the number of the low key bits holding the record offset.
+static unsigned cancel_offset_bits(T_PERSIMQ* mq)
+{
+    unsigned bits = 1;
+    while ((bits < CANCEL_KEY_CRC_SHIFT) && ((uint64_t)(mq->file_size - 1) >> bits)) bits++;
+    return bits;
+}
+
+// Returns the key of the message record at "offset": the offset, the epoch the record was written
+// in and the record CRC. A stale key of a consumed message does not match a newer record written
+// at the same offset until the epoch bits left above the offset wrap around.
+static off_t cancel_key(T_PERSIMQ* mq, off_t offset, uint8_t crc)
+{
+    unsigned bits = cancel_offset_bits(mq);
+    // Live records behind append_ptr were written before it went back to the file start
+    uint64_t epoch = (uint32_t)(mq->ext->cancel_epoch - (offset >= mq->append_ptr));
+    epoch &= (1ULL << (CANCEL_KEY_CRC_SHIFT - bits)) - 1;
+    return (off_t)((uint64_t)offset | (epoch << bits) | ((uint64_t)crc << CANCEL_KEY_CRC_SHIFT));
+}
+
+// Counts the returns of append_ptr to the file start (called after it has been moved from "old_append").
+static void cancel_wrapped(T_PERSIMQ* mq, off_t old_append)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext || !ext->cancel_offsets || (mq->append_ptr >= old_append)) return;
+    ext->cancel_epoch++;
+    ext->cancel_dirty = true;
+}
+
+// Drops the tombstones and invalidates the keys (the queue content has been replaced).
+static void cancel_reset(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext || !ext->cancel_offsets) return;
+    ext->cancel_count = 0;
+    ext->cancel_epoch++;
+    ext->cancel_dirty = true;
+}
+
+// Returns the tombstone slot of a record (-1 - the record is not cancelled).
+static int cancel_find(struct persimq_ext* ext, off_t offset)
+{
+    if (!ext) return -1;
+    for (uint32_t idx = 0; idx < ext->cancel_count; idx++) {
+        if (ext->cancel_offsets[idx] == offset) return idx;
+    }
+    return -1;
+}
+
+static void cancel_remove(struct persimq_ext* ext, uint32_t idx)
+{
+    ext->cancel_offsets[idx] = ext->cancel_offsets[--ext->cancel_count];
+    ext->cancel_dirty = true;
+}
+
+// Drops the tombstones of the records in "length" bytes from "offset" (they are being overwritten).
+static void cancel_forget(T_PERSIMQ* mq, off_t offset, size_t length)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext) return;
+    for (uint32_t idx = ext->cancel_count; idx-- > 0;) {
+        if (PERSIMQ_distance(mq, offset, ext->cancel_offsets[idx]) < length) cancel_remove(ext, idx);
+    }
+}
+
+// Drops the tombstones of the records which are not in the queue anymore.
+static void cancel_compact(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    for (uint32_t idx = ext->cancel_count; idx-- > 0;) {
+        if (PERSIMQ_distance(mq, mq->extract_ptr, ext->cancel_offsets[idx]) >= mq->count_bytes) {
+            cancel_remove(ext, idx);
+        }
+    }
+}
+
+// Pops the cancelled messages at the head of a queue. Their size is added to "record_size".
+static bool cancel_skip(T_PERSIMQ* mq, off_t* record_size)
+{
+    struct persimq_ext* ext = mq->ext;
+    while (ext && ext->cancel_count && mq->count_messages) {
+        TMessageHeader header;
+        off_t message_ptr = mq->extract_ptr;
+        if (!PERSIMQ_read_message_header(mq, &header, &message_ptr)) return false;
+        if (cancel_find(ext, message_ptr) < 0) break;
+        off_t removed;
+        if (!PERSIMQ_pop_record(mq, &removed)) return false;
+        if (record_size) *record_size += removed;
+    }
+    return true;
+}
+
+// Writes the tombstones to the cancel file if they have changed (without syncing).
+static bool cancel_save(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext || !ext->cancel_offsets || !ext->cancel_dirty) return true;
+    cancel_compact(mq);
+    size_t length = sizeof(TCancelFile) + ext->cancel_count * sizeof(uint64_t);
+    uint8_t* buffer = malloc(length);
+    if (!buffer) return false;
+    TCancelFile* header = (TCancelFile*)buffer;
+    memcpy(header->ID, "lPmC", 4);
+    header->count = ext->cancel_count;
+    header->epoch = ext->cancel_epoch;
+    for (uint32_t idx = 0; idx < ext->cancel_count; idx++) {
+        uint64_t offset = ext->cancel_offsets[idx];
+        memcpy(buffer + sizeof(TCancelFile) + idx * sizeof(uint64_t), &offset, sizeof(offset));
+    }
+    header->crc = eval_crc8_continue(eval_crc8(buffer, offsetof(TCancelFile, crc)),
+        buffer + sizeof(TCancelFile), length - sizeof(TCancelFile));
+    // Written to a new file which replaces the old one when synced
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%s", ext->cancel_path, CANCEL_TEMP_SUFFIX);
+    if (!ext->cancel_fd) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+        ext->cancel_fd = (fd < 0) ? 0 : fd;
+    }
+    bool result = ext->cancel_fd && multiwrite(ext->cancel_fd, buffer, length, 0) &&
+        (ftruncate(ext->cancel_fd, length) >= 0);
+    free(buffer);
+    if (!result) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_sync(): cancel file write");
+        }
+        return false;
+    }
+    ext->cancel_dirty = false;
+    ext->cancel_unsynced = true;
+    return true;
+}
+
+// Makes the new cancel file durable and puts it in place of the old one.
+static bool cancel_sync(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%s", ext->cancel_path, CANCEL_TEMP_SUFFIX);
+    bool result = (fdatasync(ext->cancel_fd) >= 0);
+    result &= (close(ext->cancel_fd) >= 0);
+    ext->cancel_fd = 0;
+    result = result && (rename(path, ext->cancel_path) >= 0);
+    if (!result) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_sync(): cancel file replace");
+        }
+        ext->cancel_dirty = true; // Written again at the next sync
+    }
+    ext->cancel_unsynced = false;
+    return result;
+}
+
+// Opens the cancel file of a queue and loads the tombstones of the records still in the queue.
+static bool cancel_open(T_PERSIMQ* mq, const char* mqfile_path)
+{
+    struct persimq_ext* ext = mq->ext;
+    size_t path_size = strlen(mqfile_path) + sizeof(CANCEL_FILE_SUFFIX);
+    if ((path_size + strlen(CANCEL_TEMP_SUFFIX)) > 4096) return false;
+    ext->cancel_offsets = calloc(mq->options.cancel_slots, sizeof(off_t));
+    ext->cancel_path = malloc(path_size);
+    if (ext->cancel_path) snprintf(ext->cancel_path, path_size, "%s%s", mqfile_path, CANCEL_FILE_SUFFIX);
+    int fd = ext->cancel_path ? open(ext->cancel_path, O_RDONLY) : -1;
+    if (!ext->cancel_offsets || !ext->cancel_path || ((fd < 0) && (errno != ENOENT))) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_open(): cancel file open");
+        }
+        if (fd >= 0) close(fd);
+        free(ext->cancel_offsets);
+        ext->cancel_offsets = NULL;
+        free(ext->cancel_path);
+        ext->cancel_path = NULL;
+        return false;
+    }
+    mem_pin(ext, mq->options.cancel_slots * sizeof(off_t));
+    TCancelFile header;
+    uint64_t* offsets = NULL;
+    bool valid = (fd >= 0) && multiread(fd, &header, sizeof(header), 0) && !memcmp(header.ID, "lPmC", 4) &&
+        (offsets = malloc(header.count * sizeof(uint64_t) + 1)) &&
+        (!header.count || multiread(fd, offsets, header.count * sizeof(uint64_t), sizeof(header))) &&
+        (eval_crc8_continue(eval_crc8((void*)&header, offsetof(TCancelFile, crc)),
+            (void*)offsets, header.count * sizeof(uint64_t)) == header.crc);
+    if (fd >= 0) close(fd);
+    if (valid) {
+        ext->cancel_epoch = header.epoch;
+        for (uint32_t idx = 0; (idx < header.count) && (ext->cancel_count < mq->options.cancel_slots); idx++) {
+            TMessageHeader record;
+            off_t offset = offsets[idx];
+            if ((offset >= wrap_lo_margin) && (offset < mq->file_size) &&
+                    (PERSIMQ_distance(mq, mq->extract_ptr, offset) < mq->count_bytes) &&
+                    PERSIMQ_read_data(mq, &record, sizeof(record), offset) && is_message(&record)) {
+                ext->cancel_offsets[ext->cancel_count++] = offset;
+            }
+        }
+        ext->cancel_dirty = (ext->cancel_count != header.count);
+    } else {
+        ext->cancel_dirty = true; // Creates the file
+        if ((fd >= 0) && (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_AND_WARNINGS)) {
+            printf("PERSIMQ_open(): no valid cancel file - no messages are cancelled.\n");
+        }
+    }
+    free(offsets);
+    if (!cancel_skip(mq, NULL)) return false;
+    state_publish(mq);
+    readers_publish(mq);
+    return true;
+}
+
+static void cancel_close(struct persimq_ext* ext)
+{
+    if (!ext->cancel_offsets) return;
+    if (ext->cancel_fd) close(ext->cancel_fd); // Not synced, the old file stays
+    free(ext->cancel_offsets);
+    ext->cancel_offsets = NULL;
+    free(ext->cancel_path);
+    ext->cancel_path = NULL;
+}
+
+// Cancels a pending message.
+bool PERSIMQ_cancel(T_PERSIMQ* mq, off_t key)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!mq->fd || mq->read_only || !ext || !ext->cancel_offsets) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_cancel(): the queue can not cancel messages (see the \"cancel_slots\" option)!\n");
+            fflush(stderr);
+        }
+        return false;
+    }
+    TMessageHeader header;
+    off_t offset = key & ((1ULL << cancel_offset_bits(mq)) - 1);
+    if ((offset < wrap_lo_margin) || (offset >= mq->file_size) ||
+            (PERSIMQ_distance(mq, mq->extract_ptr, offset) >= mq->count_bytes) ||
+            !PERSIMQ_read_data(mq, &header, sizeof(header), offset) || !is_message(&header) ||
+            (cancel_key(mq, offset, header.message_crc) != key)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_INFO) {
+            printf("PERSIMQ_cancel(): no pending message with the key 0x%" PRIX64 ".\n", (uint64_t)key);
+        }
+        return false;
+    }
+    if (cancel_find(ext, offset) >= 0) return true;
+    if (ext->cancel_count == mq->options.cancel_slots) cancel_compact(mq);
+    if (ext->cancel_count == mq->options.cancel_slots) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_cancel(): too many cancelled messages!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    ext->cancel_offsets[ext->cancel_count++] = offset;
+    ext->cancel_dirty = true;
+    return cancel_skip(mq, NULL) && PERSIMQ_auto_sync(mq);
+}
+
+// --- Backlog compression ---
+// Records are always written raw. When the queue is filled over the "compress_watermark" the
+// oldest records (all but the newest quarter of the backlog) are packed into LZ compressed frames.
+// Space can only be freed next to the free gap of the ring, so the frames are written to the gap
+// first, then the head is moved to them and a jump record leads from the frames to the first raw
+// record; after a sync the frames are copied right in front of that record and the head is moved
+// again. Both steps leave a valid queue file behind. Frames keep the records as they were pushed
+// (blob references included) and are popped message by message, the pop state of a frame is
+// stored in the frame itself. The codec is a simple built-in LZ77 (a literal run and a match per
+// sequence, 16-bit match offsets). A run walks a bounded part of the backlog so that the sync
+// which starts it does not stall for long, the next syncs go on with the rest. Jumps over more
+// than 4 GiB are chained through the free gap.
+
+#define LZ_HASH_BITS (14)
+#define LZ_MIN_MATCH (4)
+#define LZ_MAX_OFFSET (65535)
+#define LZ_BOUND(size) ((size) + (size) / 128 + 16) // Worst case compressed size
+#define COMPRESS_FRAME_SIZE (1024*1024)             // Raw records per frame
+#define COMPRESS_MAX_RUN ((off_t)64*1024*1024)      // Backlog compressed by one run
+#define COMPRESS_MAX_JUMP ((off_t)UINT32_MAX & ~(off_t)7) // Dead data skipped by one jump record
+
+static uint8_t* lz_put_varint(uint8_t* out, size_t value)
+{
+    while (value >= 0x80) {
+        *out++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *out++ = value;
+    return out;
+}
+
+static bool lz_get_varint(const uint8_t** in, const uint8_t* end, size_t* value)
+{
+    *value = 0;
+    for (unsigned shift = 0; (*in < end) && (shift < 64); shift += 7) {
+        uint8_t byte = *(*in)++;
+        *value |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Compresses "length" bytes to "out" (LZ_BOUND(length) bytes). Returns the compressed size.
+static size_t lz_compress(const uint8_t* in, size_t length, uint8_t* out)
+{
+    uint32_t table[1 << LZ_HASH_BITS]; // Position + 1 of the last sequence with the same hash
+    memset(table, 0, sizeof(table));
+    uint8_t* op = out;
+    size_t pos = 0, anchor = 0;
+    while (pos + LZ_MIN_MATCH <= length) {
+        uint32_t sequence;
+        memcpy(&sequence, in + pos, sizeof(sequence));
+        uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[hash];
+        table[hash] = pos + 1;
+        if (!candidate || ((pos - (candidate - 1)) > LZ_MAX_OFFSET) || memcmp(in + candidate - 1, in + pos, LZ_MIN_MATCH)) {
+            pos++;
+            continue;
+        }
+        size_t match = candidate - 1;
+        size_t match_length = LZ_MIN_MATCH;
+        while ((pos + match_length < length) && (in[match + match_length] == in[pos + match_length])) match_length++;
+        op = lz_put_varint(op, pos - anchor);
+        memcpy(op, in + anchor, pos - anchor);
+        op += pos - anchor;
+        op = lz_put_varint(op, match_length - LZ_MIN_MATCH + 1); // 0 marks the end
+        *op++ = (pos - match) & 0xFF;
+        *op++ = (pos - match) >> 8;
+        pos += match_length;
+        anchor = pos;
+    }
+    op = lz_put_varint(op, length - anchor);
+    memcpy(op, in + anchor, length - anchor);
+    op += length - anchor;
+    op = lz_put_varint(op, 0);
+    return op - out;
+}
+
+// Decompresses to "out". Returns the decompressed size (SIZE_MAX for damaged data).
+static size_t lz_decompress(const uint8_t* in, size_t length, uint8_t* out, size_t out_size)
+{
+    const uint8_t* end = in + length;
+    size_t pos = 0;
+    while (true) {
+        size_t literals, match_length;
+        if (!lz_get_varint(&in, end, &literals) || (literals > (size_t)(end - in)) || (literals > (out_size - pos))) {
+            return SIZE_MAX;
+        }
+        memcpy(out + pos, in, literals);
+        in += literals;
+        pos += literals;
+        if (!lz_get_varint(&in, end, &match_length)) return SIZE_MAX;
+        if (!match_length) return pos;
+        match_length += LZ_MIN_MATCH - 1;
+        if ((end - in) < 2) return SIZE_MAX;
+        size_t distance = in[0] | (in[1] << 8);
+        in += 2;
+        if (!distance || (distance > pos) || (match_length > (out_size - pos))) return SIZE_MAX;
+        for (size_t idx = 0; idx < match_length; idx++) out[pos + idx] = out[pos + idx - distance];
+        pos += match_length;
+    }
+}
+
+// Forgets the decompressed frame and the pop state of the first frame.
+static void frame_reset(T_PERSIMQ* mq)
+{
+    if (!mq->ext) return;
+    mq->ext->frame_offset = 0;
+    mq->ext->head_frame = 0;
+}
+
+// Returns the amount of messages popped from a frame.
+static uint32_t frame_consumed(T_PERSIMQ* mq, off_t record_ptr, const TFrame* frame)
+{
+    struct persimq_ext* ext = mq->ext;
+    // Only the first frame can have a pop state which is newer than the file header
+    uint32_t consumed = (ext && ext->head_frame && (ext->head_frame == record_ptr)) ?
+        ext->head_consumed : frame->prev_consumed;
+    return (consumed < frame->messages) ? consumed : frame->messages;
+}
+
+// Checks the decompressed size read from a frame header before it is allocated: the records of a
+// frame have all been in the queue file at once.
+static bool frame_size_valid(T_PERSIMQ* mq, const TFrame* frame)
+{
+    return (frame->raw_size >= sizeof(TMessageHeader)) && (frame->raw_size <= (mq->file_size - wrap_lo_margin));
+}
+
+// Reads the frame header of a compressed frame record and decompresses the frame (unless done already).
+static bool frame_load(T_PERSIMQ* mq, const TMessageHeader* header, off_t record_ptr, TFrame* frame)
+{
+    struct persimq_ext* ext = mq->ext;
+    off_t data_ptr = offset_roll(record_ptr, mq->file_size, sizeof(TMessageHeader));
+    bool result = ext && (header->message_size >= sizeof(TFrame)) &&
+        PERSIMQ_read_data(mq, frame, sizeof(TFrame), data_ptr) && frame->messages && frame_size_valid(mq, frame);
+    if (result && (ext->frame_offset != record_ptr)) {
+        size_t compressed = header->message_size - sizeof(TFrame);
+        uint8_t* buffer = malloc(compressed + 1);
+        if (result && (frame->raw_size > ext->frame_size)) {
+            free(ext->frame_data);
+            mem_pin(ext, -(ssize_t)ext->frame_size);
+            ext->frame_size = 0;
+            if ((ext->frame_data = malloc(frame->raw_size))) ext->frame_size = frame->raw_size;
+            mem_pin(ext, ext->frame_size);
+        }
+        ext->frame_offset = 0;
+        result = buffer && (ext->frame_size >= frame->raw_size) &&
+            PERSIMQ_read_data(mq, buffer, compressed, offset_roll(data_ptr, mq->file_size, sizeof(TFrame))) &&
+            (eval_crc8(buffer, compressed) == header->message_crc) &&
+            (lz_decompress(buffer, compressed, ext->frame_data, frame->raw_size) == frame->raw_size);
+        free(buffer);
+        if (result) {
+            ext->frame_offset = record_ptr;
+            ext->frame_length = frame->raw_size;
+            ext->frame_index = 0;
+            ext->frame_pos = 0;
+        }
+    }
+    if (!result && (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY)) {
+        fprintf(stderr, "PERSIMQ_get(): damaged compressed frame at offset 0x%" PRIX64 " or out of memory!\n",
+            (uint64_t)record_ptr); fflush(stderr);
+    }
+    return result;
+}
+
+// Finds the payload of the "index"-th message of the frame loaded by frame_load().
+static bool frame_payload(T_PERSIMQ* mq, uint32_t index, TPayload* payload)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (index < ext->frame_index) { // The messages are found by walking the frame
+        ext->frame_index = 0;
+        ext->frame_pos = 0;
+    }
+    TMessageHeader header;
+    bool result;
+    while (true) {
+        size_t left = ext->frame_length - ext->frame_pos;
+        if (left >= sizeof(header)) memcpy(&header, ext->frame_data + ext->frame_pos, sizeof(header));
+        result = (left >= sizeof(header)) && is_message(&header) && (header.message_size <= (left - sizeof(header)));
+        if (!result || (ext->frame_index == index)) break;
+        ext->frame_pos += sizeof(header) + header.message_size;
+        ext->frame_index++;
+    }
+    memset(payload, 0, sizeof(*payload));
+    const uint8_t* data = ext->frame_data + ext->frame_pos + sizeof(header);
+    if (result && !memcmp(header.ID, "PMB", 3)) {
+        TBlobRef ref;
+        result = (header.message_size == sizeof(ref)) && (eval_crc8((uint8_t*)data, sizeof(ref)) == header.message_crc);
+        if (result) {
+            memcpy(&ref, data, sizeof(ref));
+            payload->in_blob = true;
+            payload->offset = ref.offset;
+            payload->size = ref.size;
+            payload->crc = ref.crc;
+        }
+    } else if (result) {
+        payload->data = data;
+        payload->size = header.message_size;
+        payload->crc = header.message_crc;
+    }
+    if (!result && (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY)) {
+        fprintf(stderr, "PERSIMQ_get(): damaged message %" PRIu32 " of the compressed frame at offset 0x%" PRIX64 "!\n",
+            index, (uint64_t)ext->frame_offset); fflush(stderr);
+    }
+    return result;
+}
+
+// Pops the first message of a frame. "frame_done" is set when the frame has no messages left.
+static bool frame_pop(T_PERSIMQ* mq, const TMessageHeader* header, off_t record_ptr, bool* frame_done)
+{
+    struct persimq_ext* ext = mq->ext;
+    TFrame frame;
+    TPayload payload;
+    if (!frame_load(mq, header, record_ptr, &frame)) return false;
+    uint32_t consumed = frame_consumed(mq, record_ptr, &frame);
+    if ((consumed >= frame.messages) || !frame_payload(mq, consumed, &payload)) return false;
+    blob_release(mq, &payload);
+    if (ext->head_frame != record_ptr) {
+        ext->head_frame = record_ptr;
+        ext->head_saved = consumed;
+        ext->head_disk = frame.consumed;
+        ext->head_prev = frame.prev_consumed;
+    }
+    ext->head_consumed = consumed + 1;
+    *frame_done = (ext->head_consumed == frame.messages);
+    if (*frame_done) frame_reset(mq);
+    return true;
+}
+
+// Writes the pop state of the first frame (called right before the file header is written).
+static bool frame_save(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext || !ext->head_frame || ((ext->head_disk == ext->head_consumed) && (ext->head_prev == ext->head_saved))) {
+        return true;
+    }
+    TFrame frame = { 0, 0, ext->head_consumed, ext->head_saved, mq->append_ptr, mq->count_messages };
+    size_t length = sizeof(frame) - offsetof(TFrame, consumed);
+    off_t offset = offset_roll(ext->head_frame, mq->file_size, sizeof(TMessageHeader) + offsetof(TFrame, consumed));
+    cache_invalidate(mq, offset, length);
+    if (!queue_io(mq, "frame state write", &frame.consumed, length, offset, NULL, true)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_sync(): frame state write");
+        }
+        return false;
+    }
+    ext->head_prev = ext->head_saved;
+    ext->head_disk = ext->head_saved = ext->head_consumed;
+    return true;
+}
+
+// Finds the pop state of the first frame when the queue is opened.
+static void frame_open(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    TMessageHeader header;
+    TFrame frame;
+    off_t record_ptr = mq->extract_ptr;
+    if (!ext || !mq->count_messages) return;
+    do {
+        if (!PERSIMQ_read_data(mq, &header, sizeof(header), record_ptr)) return;
+        if (is_padding(&header)) record_ptr = offset_roll(record_ptr, mq->file_size, sizeof(header) + header.message_size);
+    } while (is_padding(&header));
+    if (memcmp(header.ID, "PMZ", 3) || (header.message_size < sizeof(frame)) ||
+            !PERSIMQ_read_data(mq, &frame, sizeof(frame), offset_roll(record_ptr, mq->file_size, sizeof(header)))) {
+        return;
+    }
+    bool current = (frame.state_append == mq->append_ptr) && (frame.state_count == mq->count_messages);
+    ext->head_frame = record_ptr;
+    ext->head_consumed = ext->head_saved = current ? frame.consumed : frame.prev_consumed;
+    ext->head_disk = frame.consumed;
+    ext->head_prev = frame.prev_consumed;
+}
+
+// Compresses the raw records of a frame and writes the frame record at "offset".
+static bool compress_frame(T_PERSIMQ* mq, const uint8_t* raw, size_t raw_length, uint32_t messages,
+    uint8_t* packed, off_t offset, off_t* written)
+{
+    TMessageHeader header = { "PMZ", 0, 0 };
+    TFrame frame = { messages, raw_length, 0, 0, 0, 0 };
+    size_t compressed = lz_compress(raw, raw_length, packed + sizeof(header) + sizeof(frame));
+    header.message_crc = eval_crc8(packed + sizeof(header) + sizeof(frame), compressed);
+    header.message_size = sizeof(frame) + compressed;
+    memcpy(packed, &header, sizeof(header));
+    memcpy(packed + sizeof(header), &frame, sizeof(frame));
+    size_t length = sizeof(header) + header.message_size;
+    offset = offset_roll(offset, mq->file_size, *written);
+    cache_invalidate(mq, offset, length);
+    *written += length;
+    return queue_io(mq, "frame write", packed, length, offset, NULL, true);
+}
+
+// Moves "length" queue bytes from "from" to "to" (the ranges must not overlap).
+static bool compress_move(T_PERSIMQ* mq, off_t from, off_t to, off_t length, uint8_t* buffer, size_t buffer_size)
+{
+    for (off_t done = 0; done < length; done += buffer_size) {
+        size_t chunk = ((length - done) < buffer_size) ? (length - done) : buffer_size;
+        off_t target = offset_roll(to, mq->file_size, done);
+        cache_invalidate(mq, target, chunk);
+        if (!queue_io(mq, "read", buffer, chunk, offset_roll(from, mq->file_size, done), NULL, false) ||
+                !queue_io(mq, "frame write", buffer, chunk, target, NULL, true)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Writes the jump records leading from "jump_ptr" to "target_ptr" through the free gap.
+static bool compress_jump(T_PERSIMQ* mq, off_t jump_ptr, off_t target_ptr)
+{
+    TMessageHeader jump = { "PMJ", 0, 0 };
+    while (true) {
+        off_t distance = PERSIMQ_distance(mq, offset_roll(jump_ptr, mq->file_size, sizeof(jump)), target_ptr);
+        // The last jump gets the longest distance, so that it starts in the gap as well (a run walks
+        // much less of the backlog)
+        off_t step = distance - (off_t)sizeof(jump) - COMPRESS_MAX_JUMP;
+        if (distance <= COMPRESS_MAX_JUMP) {
+            step = distance;
+        } else if (step < 0) {
+            step = 0;
+        } else if (step > COMPRESS_MAX_JUMP) {
+            step = COMPRESS_MAX_JUMP;
+        }
+        jump.message_size = step;
+        cache_invalidate(mq, jump_ptr, sizeof(jump));
+        if (!queue_io(mq, "frame write", &jump, sizeof(jump), jump_ptr, NULL, true)) return false;
+        if (step == distance) return true;
+        jump_ptr = offset_roll(jump_ptr, mq->file_size, sizeof(jump) + jump.message_size);
+    }
+}
+
+// Does a compression run (see PERSIMQ_compress_backlog()).
+static bool compress_run(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    off_t data_size = mq->file_size - wrap_lo_margin;
+    if (!PERSIMQ_sync(mq)) return false; // Nothing staged, the pop state of the first frame is in the file
+    ext->compress_append = mq->append_ptr;
+    off_t start = mq->extract_ptr;
+    off_t frames_ptr = offset_roll(mq->append_ptr, mq->file_size, sizeof(TMessageHeader));
+    off_t room = data_size - mq->count_bytes - 2 * sizeof(TMessageHeader); // Frames and the jump record
+    off_t cold = mq->count_bytes - mq->count_bytes / 4;
+    bool more = (cold > COMPRESS_MAX_RUN); // Left for the next syncs
+    if (room > COMPRESS_MAX_RUN) room = COMPRESS_MAX_RUN;
+    if (cold > COMPRESS_MAX_RUN) cold = COMPRESS_MAX_RUN;
+    if (!mq->count_messages || (room < (off_t)LZ_BOUND(4096))) return true;
+
+    size_t raw_size = COMPRESS_FRAME_SIZE;
+    uint8_t* raw = malloc(raw_size);
+    uint8_t* packed = malloc(sizeof(TMessageHeader) + sizeof(TFrame) + LZ_BOUND(raw_size));
+    size_t raw_length = 0;
+    uint32_t raw_messages = 0;
+    off_t walked = 0, written = 0, packed_bytes = 0;
+    bool result = raw && packed;
+    while (result && (walked < cold)) {
+        TMessageHeader header;
+        off_t record_ptr = offset_roll(start, mq->file_size, walked);
+        if (!(result = PERSIMQ_read_data(mq, &header, sizeof(header), record_ptr))) break;
+        off_t record_size = sizeof(header) + header.message_size;
+        if ((walked + record_size) >= mq->count_bytes) break; // The newest message stays raw
+        if (is_padding(&header)) {
+            walked += record_size;
+            continue;
+        }
+        bool frame = !memcmp(header.ID, "PMZ", 3);
+        if (!(result = is_message(&header) || (frame && (header.message_size >= sizeof(TFrame))))) {
+            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                fprintf(stderr, "PERSIMQ_compress_backlog(): damaged record at offset 0x%" PRIX64 "!\n",
+                    (uint64_t)record_ptr); fflush(stderr);
+            }
+            break;
+        }
+        if (raw_length && (frame || ((raw_length + record_size) > COMPRESS_FRAME_SIZE))) {
+            if (!(result = compress_frame(mq, raw, raw_length, raw_messages, packed, frames_ptr, &written))) break;
+            packed_bytes += raw_length;
+            raw_length = raw_messages = 0;
+        }
+        if (record_size > raw_size) { // A big record gets a frame of its own
+            uint8_t* new_raw = realloc(raw, record_size);
+            uint8_t* new_packed = new_raw ? realloc(packed, sizeof(header) + sizeof(TFrame) + LZ_BOUND(record_size)) : NULL;
+            if (new_raw) raw = new_raw;
+            if (new_packed) packed = new_packed;
+            if (!(result = new_raw && new_packed)) break;
+            raw_size = record_size;
+        }
+        off_t needed = frame ? record_size : (off_t)(sizeof(header) + sizeof(TFrame) + LZ_BOUND(raw_length + record_size));
+        if ((written + needed) > room) break;
+        if (!(result = PERSIMQ_read_data(mq, raw + raw_length, record_size, record_ptr))) break;
+        if (frame) { // Compressed already - moved as it is, with its pop state settled
+            TFrame state;
+            memcpy(&state, raw + sizeof(header), sizeof(state));
+            state.consumed = state.prev_consumed = frame_consumed(mq, record_ptr, &state);
+            state.state_append = state.state_count = 0;
+            memcpy(raw + sizeof(header), &state, sizeof(state));
+            off_t offset = offset_roll(frames_ptr, mq->file_size, written);
+            cache_invalidate(mq, offset, record_size);
+            if (!(result = queue_io(mq, "frame write", raw, record_size, offset, NULL, true))) break;
+            written += record_size;
+        } else {
+            if (!(result = (eval_crc8(raw + raw_length + sizeof(header), header.message_size) == header.message_crc))) {
+                if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                    fprintf(stderr, "PERSIMQ_compress_backlog(): bad CRC (damaged message at offset 0x%" PRIX64 ")!\n",
+                        (uint64_t)record_ptr); fflush(stderr);
+                }
+                break;
+            }
+            raw_length += record_size;
+            raw_messages++;
+        }
+        walked += record_size;
+    }
+    if (result && raw_length) {
+        result = compress_frame(mq, raw, raw_length, raw_messages, packed, frames_ptr, &written);
+        packed_bytes += raw_length;
+    }
+    free(raw);
+    // Not worth it when less than 1/64 of the file (or of a full run) would be freed
+    off_t worth = ((data_size / 64) < (COMPRESS_MAX_RUN / 64)) ? (data_size / 64) : (COMPRESS_MAX_RUN / 64);
+    if (!result || !packed_bytes || ((walked - written) < worth)) {
+        free(packed);
+        if (!result && (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY)) {
+            perror("PERSIMQ_compress_backlog(): compression failed");
+        }
+        return result;
+    }
+    // Step 1: the queue starts with the frames, the jump record leads to the first raw record
+    off_t raw_ptr = offset_roll(start, mq->file_size, walked);
+    off_t jump_ptr = offset_roll(frames_ptr, mq->file_size, written);
+    result = compress_jump(mq, jump_ptr, raw_ptr) && (fdatasync(mq->fd) >= 0);
+    off_t count_bytes = mq->count_bytes - walked + written;
+    if (result) {
+        frame_reset(mq);
+        mq->extract_ptr = frames_ptr;
+        mq->count_bytes = PERSIMQ_distance(mq, frames_ptr, mq->append_ptr);
+        result = PERSIMQ_sync(mq);
+    }
+    // Step 2: the frames are moved in front of the first raw record
+    off_t moved_ptr = offset_roll(raw_ptr, mq->file_size, data_size - written);
+    result = result && compress_move(mq, frames_ptr, moved_ptr, written, packed, COMPRESS_FRAME_SIZE) &&
+        (fdatasync(mq->fd) >= 0);
+    free(packed);
+    if (result) {
+        mq->extract_ptr = moved_ptr;
+        mq->count_bytes = count_bytes;
+        result = PERSIMQ_sync(mq);
+    }
+    frame_reset(mq);
+    fadvise_reset(mq);
+    tail_reset(mq);
+    if (result && more) ext->compress_append = 0; // Go on at the next sync
+    if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_INFO) {
+        printf("PERSIMQ_compress_backlog(): %" PRId64 " bytes of records packed to %" PRId64 " bytes, %" PRId64
+            " bytes freed.\n", (int64_t)packed_bytes, (int64_t)written, (int64_t)(walked - written)); fflush(stdout);
+    }
+    if (!result && (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY)) {
+        perror("PERSIMQ_compress_backlog(): frame write");
+    }
+    return result;
+}
+
+// Compresses the older part of the backlog.
+bool PERSIMQ_compress_backlog(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!mq->fd || mq->read_only || !ext) return false;
+    if (mq->options.cancel_slots || mq->options.tx_log_path[0]) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_compress_backlog(): not supported with cancel_slots or transactions!\n");
+            fflush(stderr);
+        }
+        return false;
+    }
+    // Readers keep record offsets, the records must not move under them
+    if (ext->compressing || __atomic_load_n(&ext->reader_count, __ATOMIC_SEQ_CST)) return true;
+    ext->compressing = true;
+    bool result = compress_run(mq);
+    ext->compressing = false;
+    return result;
+}
+
+// Starts a compression run at a sync when the queue is filled over the watermark.
+static void compress_check(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    off_t data_size = mq->file_size - wrap_lo_margin;
+    if (!mq->options.compress_watermark || !ext || ext->compressing || mq->options.cancel_slots ||
+            mq->options.tx_log_path[0] || ((uint64_t)mq->count_bytes * 100 < (uint64_t)data_size * mq->options.compress_watermark)) {
+        return;
+    }
+    // Not again until a part of the file has been refilled
+    if (ext->compress_append && (PERSIMQ_distance(mq, ext->compress_append, mq->append_ptr) < (data_size / 16))) return;
+    PERSIMQ_compress_backlog(mq);
+}
+
+// --- Hot backup ---
+// The queue is only held for the time it takes to write the staged records and the header. A
+// reflink clone shares the file extents so it takes the same time for any queue size. Without
+// reflinks the header and the live span are copied in kernel, the rest of the backup stays sparse
+// (unless the queue has a block hash tree). The side files are copied as well. A queue which is a
+// part of an open transaction is not backed up: its header would describe uncommitted operations.
+
+// Copies a file range to the same offset of another file.
+static bool backup_copy(int source_fd, int backup_fd, off_t offset, off_t length)
+{
+    while (length > 0) {
+        loff_t source_offset = offset;
+        loff_t backup_offset = offset;
+        ssize_t copied = copy_file_range(source_fd, &source_offset, backup_fd, &backup_offset, length, 0);
+        if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+            // Not supported between these files - copy through a buffer
+            uint8_t buffer[65536];
+            copied = (length < (off_t)sizeof(buffer)) ? length : (off_t)sizeof(buffer);
+            if (!multiread(source_fd, buffer, copied, offset) || !multiwrite(backup_fd, buffer, copied, offset)) {
+                return false;
+            }
+        }
+        if (copied <= 0) return false;
+        offset += copied;
+        length -= copied;
+    }
+    return true;
+}
+
+// Copies "length" bytes at "offset" of a side file to "<backup_path><suffix>" of "size" bytes,
+// the whole file is cloned where possible. The copy is synced.
+static bool backup_side_file(int source_fd, const char* backup_path, const char* suffix, off_t size,
+    off_t offset, off_t length)
+{
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s%s", backup_path, suffix) >= sizeof(path)) return false;
+    int backup_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (backup_fd == -1) return false;
+    bool result = false;
+    #ifdef FICLONE
+        result = (ioctl(backup_fd, FICLONE, source_fd) >= 0);
+    #endif
+    if (!result) {
+        result = (ftruncate(backup_fd, size) >= 0) && backup_copy(source_fd, backup_fd, offset, length);
+    }
+    result = result && (fsync(backup_fd) >= 0);
+    result &= (close(backup_fd) >= 0);
+    return result;
+}
+
+// Copies the side files of a queue next to the backup: the blobs of the messages still in the
+// queue, the shared state, the block hash tree and the newest cancel file.
+static bool backup_side_files(T_PERSIMQ* mq, const char* backup_path)
+{
+    struct persimq_ext* ext = mq->ext;
+    bool result = true;
+    if (ext->blob_fd) {
+        result &= backup_side_file(ext->blob_fd, backup_path, BLOB_FILE_SUFFIX, ext->blob_end,
+            blob_live_start(ext), ext->blob_end - blob_live_start(ext));
+    }
+    if (ext->state) {
+        result &= backup_side_file(ext->state_fd, backup_path, STATE_FILE_SUFFIX, sizeof(TStateFile),
+            0, sizeof(TStateFile));
+    }
+    if (ext->hashes) { // Stamped with the header of the backup by hash_update()
+        result &= backup_side_file(ext->hash_fd, backup_path, HASH_FILE_SUFFIX, ext->hash_map_size,
+            0, ext->hash_map_size);
+    }
+    if (ext->cancel_path) { // The file written last is only renamed at the next sync
+        char path[4096];
+        snprintf(path, sizeof(path), "%s%s", ext->cancel_path, ext->cancel_unsynced ? CANCEL_TEMP_SUFFIX : "");
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd >= 0) {
+            result &= !fstat(fd, &st) &&
+                backup_side_file(fd, backup_path, CANCEL_FILE_SUFFIX, st.st_size, 0, st.st_size);
+            close(fd);
+        } else {
+            result &= (errno == ENOENT); // No message has been cancelled yet
+        }
+    }
+    return result;
+}
+
+// Makes a consistent copy of a live queue file.
+bool PERSIMQ_backup(T_PERSIMQ* mq, const char* backup_path)
+{
+    if (!mq->fd || mq->read_only) return false; // MQ uninitialized, file not opened.
+    if (mq->ext && mq->ext->tx_pending) { // The header would describe uncommitted operations
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_backup(): the queue is part of an open transaction!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    if (!PERSIMQ_write_header(mq) || !hash_update(mq)) return false;
+    int backup_fd = open(backup_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (backup_fd == -1) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_backup(): backup file open");
+        }
+        return false;
+    }
+    bool result = false;
+    #ifdef FICLONE
+        result = (ioctl(backup_fd, FICLONE, mq->fd) >= 0);
+    #endif
+    if (!result && mq->ext && mq->ext->hashes) { // The hash tree covers the whole data section
+        result = (ftruncate(backup_fd, mq->file_size) >= 0) && backup_copy(mq->fd, backup_fd, 0, mq->file_size);
+    } else if (!result) {
+        result = (ftruncate(backup_fd, mq->file_size) >= 0);
+        result = result && backup_copy(mq->fd, backup_fd, 0, sizeof(TFileHeader));
+        off_t first_length = mq->file_size - mq->extract_ptr;
+        if (first_length > mq->count_bytes) first_length = mq->count_bytes;
+        result = result && backup_copy(mq->fd, backup_fd, mq->extract_ptr, first_length);
+        result = result && backup_copy(mq->fd, backup_fd, wrap_lo_margin, mq->count_bytes - first_length);
+    }
+    result = result && (fsync(backup_fd) >= 0);
+    result = result && (!mq->ext || backup_side_files(mq, backup_path));
+    if (!result && (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY)) {
+        perror("PERSIMQ_backup(): backup file write");
+    }
+    result &= (close(backup_fd) >= 0);
+    return result;
+}
+
+// --- Concurrent readers ---
+// Every reader pins the offset it is about to read from in a slot of the queue. The owner thread
+// publishes the live queue range after each operation and never reuses the space behind the
+// oldest pin. A reader re-checks its pin against the published range after storing it so the
+// space can not be taken between the two steps (hazard pointer style, no locks on either side).
+
+// Publishes the live queue range to the readers. Staged records are not in the file yet.
+static void readers_publish(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    if (!ext) return;
+    off_t live_end = (ext->staged_length && mq->count_bytes) ? ext->staged_offset : mq->append_ptr;
+    __atomic_add_fetch(&ext->live_sequence, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ext->live_start, mq->extract_ptr, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ext->live_end, live_end, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&ext->live_sequence, 1, __ATOMIC_SEQ_CST);
+}
+
+// Reads a consistent live queue range.
+static void readers_live_range(struct persimq_ext* ext, off_t* live_start, off_t* live_end)
+{
+    uint32_t sequence;
+    do {
+        sequence = __atomic_load_n(&ext->live_sequence, __ATOMIC_SEQ_CST);
+        *live_start = __atomic_load_n(&ext->live_start, __ATOMIC_SEQ_CST);
+        *live_end = __atomic_load_n(&ext->live_end, __ATOMIC_SEQ_CST);
+    } while ((sequence & 1) || (sequence != __atomic_load_n(&ext->live_sequence, __ATOMIC_SEQ_CST)));
+}
+
+// Returns the amount of queue bytes held by the readers and the queue itself.
+static off_t readers_retained(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    off_t retained = mq->count_bytes;
+    if (!ext || !__atomic_load_n(&ext->reader_count, __ATOMIC_SEQ_CST)) return retained;
+    for (int slot = 0; slot < PERSIMQ_MAX_READERS; slot++) {
+        off_t pin = __atomic_load_n(&ext->reader_pins[slot], __ATOMIC_SEQ_CST);
+        if (!pin) continue;
+        off_t distance = PERSIMQ_distance(mq, pin, mq->append_ptr);
+        if (distance > retained) retained = distance;
+    }
+    return retained;
+}
+
+// Pins the next reader offset. Returns the amount of bytes which can be read from there.
+static off_t reader_pin(T_PERSIMQ_Reader* reader)
+{
+    struct persimq_ext* ext = reader->mq->ext;
+    T_PERSIMQ_Cursor* cursor = &reader->cursor;
+    while (true) {
+        __atomic_store_n(&ext->reader_pins[reader->slot], cursor->offset, __ATOMIC_SEQ_CST);
+        off_t live_start, live_end;
+        readers_live_range(ext, &live_start, &live_end);
+        off_t live_length = PERSIMQ_distance(reader->mq, live_start, live_end);
+        off_t position = PERSIMQ_distance(reader->mq, live_start, cursor->offset);
+        if (position <= live_length) return live_length - position;
+        // The space has been consumed (and may be reused): continue from the first message
+        cursor->offset = live_start;
+        cursor->chunk_pos = cursor->chunk_length = 0;
+        cursor->frame_pos = cursor->frame_length = 0;
+        reader->skipped++;
+    }
+}
+
+// Attaches a concurrent reader to a queue.
+bool PERSIMQ_reader_open(T_PERSIMQ_Reader* reader, T_PERSIMQ* mq, size_t chunk_size)
+{
+    struct persimq_ext* ext = mq->ext;
+    memset(reader, 0, sizeof(*reader)); // PERSIMQ_reader_close() is safe even when this fails
+    reader->mq = mq;
+    reader->slot = PERSIMQ_MAX_READERS;
+    if (!ext) return false;
+    off_t start, end;
+    readers_live_range(ext, &start, &end);
+    for (reader->slot = 0; reader->slot < PERSIMQ_MAX_READERS; reader->slot++) {
+        off_t free_slot = 0;
+        if (__atomic_compare_exchange_n(&ext->reader_pins[reader->slot], &free_slot, start, false,
+                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+    }
+    if (reader->slot >= PERSIMQ_MAX_READERS) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_reader_open(): Too many readers!\n"); fflush(stderr);
+        }
+        return false;
+    }
+    __atomic_add_fetch(&ext->reader_count, 1, __ATOMIC_SEQ_CST);
+    stall_in_reader = true;
+    bool result = PERSIMQ_cursor_init(&reader->cursor, mq, chunk_size, start, 0);
+    stall_in_reader = false;
+    if (!result) {
+        PERSIMQ_reader_close(reader);
+        return false;
+    }
+    return true;
+}
+
+// Returns the next message for a reader.
+bool PERSIMQ_reader_next(T_PERSIMQ_Reader* reader, const void** message, size_t* message_size)
+{
+    T_PERSIMQ_Cursor* cursor = &reader->cursor;
+    if (cursor->error) return false;
+    if (cursor->chunk_pos >= cursor->chunk_length) {
+        // Only the buffered chunk is being used, the pin can move to the next record
+        cursor->bytes_left = reader_pin(reader);
+        cursor->chunk_pos = cursor->chunk_length = 0;
+    }
+    stall_in_reader = true;
+    bool result = PERSIMQ_cursor_next(cursor, message, message_size);
+    stall_in_reader = false;
+    return result;
+}
+
+// Detaches a reader from the queue.
+void PERSIMQ_reader_close(T_PERSIMQ_Reader* reader)
+{
+    struct persimq_ext* ext = reader->mq->ext;
+    if (reader->slot < PERSIMQ_MAX_READERS) {
+        __atomic_store_n(&ext->reader_pins[reader->slot], 0, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&ext->reader_count, 1, __ATOMIC_SEQ_CST);
+        reader->slot = PERSIMQ_MAX_READERS;
+    }
+    PERSIMQ_cursor_free(&reader->cursor);
+}
+
+// --- Multi-queue transactions ---
+// A commit stores the state of every queue involved before and after the transaction to the
+// intent log and then syncs the data and the log in one barrier (the files are synced in
+// parallel, see tx_barrier()). The queue headers are updated after that without syncing: if they
+// get lost the queue is rolled forward from the log when opened. Two log slots are used in turn so that a torn log write never
+// destroys the previous commit record. The headers left unsynced by a commit are synced by the
+// barrier of the next one, so a slot is only reused when the headers of its commit are durable.
+// The recovery replays both records, the older one first.
+// A commit is replayed when the queue is found in the state it started from, but a queue can get
+// back to such a state later (PERSIMQ_clear() on the state of a new queue). Every queue keeps the
+// sequence of the last commit whose header is durable in a "<queue file>.tx" file and the records
+// up to it are never replayed. The file is only written (and synced together with the committed
+// header) when the queue header is about to move on from the committed state, so the queues only
+// used in transactions never pay for it.
+
+#define TX_MARK_FILE_SUFFIX ".tx"
+
+// Transaction mark file
+typedef struct __attribute__((packed)) {
+    char ID[4];
+    uint64_t log_dev;  // The log the sequence belongs to
+    uint64_t log_ino;
+    uint64_t sequence; // Commit records up to this one are applied
+    uint8_t crc;
+} TTxMark;
+
+typedef struct __attribute__((packed)) {
+    uint64_t append_ptr;
+    uint64_t extract_ptr;
+    uint64_t count_bytes;
+    uint64_t count_messages;
+} TTxQueueState;
+
+typedef struct __attribute__((packed)) {
+    uint64_t dev;
+    uint64_t ino;
+    TTxQueueState before;
+    TTxQueueState after;
+} TTxLogEntry;
+
+typedef struct __attribute__((packed)) {
+    char ID[4];
+    uint64_t sequence;
+    uint32_t count;
+    TTxLogEntry entries[PERSIMQ_TX_MAX_QUEUES];
+    uint8_t crc;
+} TTxLogRecord;
+
+static void tx_get_state(T_PERSIMQ* mq, TTxQueueState* state)
+{
+    state->append_ptr = mq->append_ptr;
+    state->extract_ptr = mq->extract_ptr;
+    state->count_bytes = mq->count_bytes;
+    state->count_messages = mq->count_messages;
+}
+
+// Reads the intact log records, the older one first. Returns their amount.
+static int tx_read_log(int fd, TTxLogRecord records[2])
+{
+    int count = 0;
+    for (int slot = 0; slot < 2; slot++) {
+        TTxLogRecord* candidate = &records[count];
+        if (pread(fd, (void*)candidate, sizeof(*candidate), slot * sizeof(*candidate)) != sizeof(*candidate)) continue;
+        if (strncmp(candidate->ID, "lPmT", 4) ||
+                (eval_crc8((void*)candidate, sizeof(*candidate)-1) != candidate->crc) ||
+                (candidate->count > PERSIMQ_TX_MAX_QUEUES)) continue;
+        count++;
+    }
+    if ((count == 2) && (records[0].sequence > records[1].sequence)) {
+        TTxLogRecord newer = records[0];
+        records[0] = records[1];
+        records[1] = newer;
+    }
+    return count;
+}
+
+// Rolls the queue forward by a commit record which has not been applied. Returns false on errors,
+// "applied" tells whether the queue state has been changed.
+static bool tx_apply(T_PERSIMQ* mq, const struct stat* st, const TTxLogRecord* record, bool* applied)
+{
+    *applied = false;
+    for (uint32_t idx = 0; idx < record->count; idx++) {
+        const TTxLogEntry* entry = &record->entries[idx];
+        if ((entry->dev != st->st_dev) || (entry->ino != st->st_ino)) continue;
+        TTxQueueState current;
+        tx_get_state(mq, &current);
+        if (memcmp(&current, &entry->before, sizeof(current))) return true; // Applied or superseded
+        // The commit record is durable, make sure that the pushed messages are intact as well
+        off_t pushed_bytes = entry->after.count_bytes - entry->before.count_bytes +
+            PERSIMQ_distance(mq, entry->before.extract_ptr, entry->after.extract_ptr);
+        T_PERSIMQ_Cursor cursor;
+        if (!PERSIMQ_cursor_init(&cursor, mq, 64*1024, entry->before.append_ptr, pushed_bytes)) return false;
+        while (PERSIMQ_cursor_next(&cursor, NULL, NULL));
+        bool intact = !cursor.error && !cursor.bytes_left && (cursor.offset == entry->after.append_ptr);
+        PERSIMQ_cursor_free(&cursor);
+        if (!intact) {
+            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_AND_WARNINGS) {
+                printf("PERSIMQ_open(): incomplete transaction %" PRIu64 " data - rolled back.\n", record->sequence);
+            }
+            return true;
+        }
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_INFO) {
+            printf("PERSIMQ_open(): transaction %" PRIu64 " recovered.\n", record->sequence);
+        }
+        mq->append_ptr = entry->after.append_ptr;
+        mq->extract_ptr = entry->after.extract_ptr;
+        mq->count_bytes = entry->after.count_bytes;
+        mq->count_messages = entry->after.count_messages;
+        *applied = true;
+        return true;
+    }
+    return true;
+}
+
+// Opens the transaction mark file of a queue.
+static bool tx_mark_open(T_PERSIMQ* mq, const char* mqfile_path)
+{
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s%s", mqfile_path, TX_MARK_FILE_SUFFIX) >= sizeof(path)) return false;
+    int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (fd < 0) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_open(): transaction mark file open");
+        }
+        return false;
+    }
+    mq->ext->tx_mark_fd = fd;
+    return true;
+}
+
+// Makes the header of the pending commit durable and stores its sequence to the mark file.
+static bool tx_mark(T_PERSIMQ* mq)
+{
+    struct persimq_ext* ext = mq->ext;
+    bool result = true;
+    if (ext->tx_mark_fd) {
+        TTxMark mark;
+        memset(&mark, 0, sizeof(mark));
+        memcpy(mark.ID, "lPmX", 4);
+        mark.log_dev = ext->tx_mark_dev;
+        mark.log_ino = ext->tx_mark_ino;
+        mark.sequence = ext->tx_mark_sequence;
+        mark.crc = eval_crc8((void*)&mark, sizeof(mark)-1);
+        result = (fdatasync(mq->fd) >= 0) && multiwrite(ext->tx_mark_fd, &mark, sizeof(mark), 0) &&
+            (fdatasync(ext->tx_mark_fd) >= 0);
+    }
+    if (!result) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_write_header(): transaction mark write");
+        }
+        return false;
+    }
+    ext->tx_mark_sequence = 0;
+    return true;
+}
+
+// Rolls the queue forward if the log has commit records for it which have not been applied.
+static bool PERSIMQ_tx_recover(T_PERSIMQ* mq)
+{
+    int log_fd = open(mq->options.tx_log_path, O_RDONLY);
+    if (log_fd < 0) return (errno == ENOENT); // No transactions have been made yet
+    TTxLogRecord records[2];
+    int count = tx_read_log(log_fd, records);
+    struct stat log_st;
+    bool log_ok = !fstat(log_fd, &log_st);
+    close(log_fd);
+    if (!count) return true;
+    struct stat st;
+    if (fstat(mq->fd, &st)) { // The records can not be matched to the queue
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_open(): transaction recovery");
+        }
+        return false;
+    }
+
+    // The commits up to the marked one are applied, the queue may be back in their "before" state
+    TTxMark mark;
+    uint64_t applied_sequence = 0;
+    if (log_ok && (pread(mq->ext->tx_mark_fd, &mark, sizeof(mark), 0) == sizeof(mark)) &&
+            !memcmp(mark.ID, "lPmX", 4) && (eval_crc8((void*)&mark, sizeof(mark)-1) == mark.crc) &&
+            (mark.log_dev == log_st.st_dev) && (mark.log_ino == log_st.st_ino)) {
+        applied_sequence = mark.sequence;
+    }
+    bool changed = false;
+    for (int idx = 0; idx < count; idx++) {
+        if (records[idx].sequence <= applied_sequence) continue;
+        bool applied;
+        if (!tx_apply(mq, &st, &records[idx], &applied)) return false;
+        changed |= applied;
+        // The header is durable once the recovery is done (it has been read from the disk or it is
+        // synced below), the record must not be replayed after the queue has moved on
+        mq->ext->tx_mark_sequence = records[idx].sequence;
+        mq->ext->tx_mark_dev = log_st.st_dev;
+        mq->ext->tx_mark_ino = log_st.st_ino;
+    }
+    if (!log_ok) mq->ext->tx_mark_sequence = 0;
+    return !changed || PERSIMQ_sync(mq);
+}
+
+// Opens (creates) a transaction log.
+bool PERSIMQ_tx_open(T_PERSIMQ_Transaction* tx, char* log_path)
+{
+    mode_t oldpermmask = umask(0); // Same permissions as the queue files
+    tx->log_fd = open(log_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    umask(oldpermmask);
+    if (tx->log_fd == -1) {
+        tx->log_fd = 0;
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_tx_open(): file open");
+        }
+        return false;
+    }
+    TTxLogRecord records[2];
+    int count = tx_read_log(tx->log_fd, records);
+    struct stat st;
+    if (fstat(tx->log_fd, &st)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_tx_open(): file stat");
+        }
+        close(tx->log_fd);
+        tx->log_fd = 0;
+        return false;
+    }
+    tx->log_dev = st.st_dev;
+    tx->log_ino = st.st_ino;
+    tx->sequence = count ? records[count-1].sequence : 0;
+    tx->queue_count = 0;
+    tx->header_fd_count = 0;
+    return true;
+}
+
+// Returns the transaction state of a queue, the queue is added to the transaction on first use.
+static T_PERSIMQ_TxQueue* tx_queue(T_PERSIMQ_Transaction* tx, T_PERSIMQ* mq)
+{
+    for (unsigned idx = 0; idx < tx->queue_count; idx++) {
+        if (tx->queues[idx].mq == mq) return &tx->queues[idx];
+    }
+    if (!tx->log_fd || !mq->fd || mq->read_only) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_tx: Uninitialized transaction or MQ struct provided!\n"); fflush(stderr);
+        }
+        return NULL;
+    }
+    if (tx->queue_count >= PERSIMQ_TX_MAX_QUEUES) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_tx: Too many queues in a transaction!\n"); fflush(stderr);
         }
-        return false;
+        return NULL;
     }
-    // Check if we have any mesasges left to read
-    if (!PERSIMQ_messages_available(mq)) {
+    struct stat st;
+    // The file header has to describe the state the transaction starts from. It gets synced
+    // together with the rest of the transaction.
+    if (fstat(mq->fd, &st) || !PERSIMQ_write_header(mq)) {
         if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            fprintf(stderr, "PERSIMQ_pop(): Can not remove messages from an empty queue!\n"); fflush(stderr);
+            perror("PERSIMQ_tx: queue header write");
+        }
+        return NULL;
+    }
+    T_PERSIMQ_TxQueue* queue = &tx->queues[tx->queue_count++];
+    queue->mq = mq;
+    queue->dev = st.st_dev;
+    queue->ino = st.st_ino;
+    queue->append_ptr = mq->append_ptr;
+    queue->extract_ptr = mq->extract_ptr;
+    queue->count_bytes = mq->count_bytes;
+    queue->count_messages = mq->count_messages;
+    queue->released_bytes = 0;
+    mq->ext->tx_pending = true;
+    return queue;
+}
+
+// Stages a message push within a transaction.
+bool PERSIMQ_tx_push(T_PERSIMQ_Transaction* tx, T_PERSIMQ* mq, void* message, size_t message_size)
+{
+    T_PERSIMQ_TxQueue* queue = tx_queue(tx, mq);
+    // The space freed by the transaction pops still holds live data until the commit
+    struct iovec part = { message, message_size };
+    return queue && PERSIMQ_push_message(mq, &part, 1, queue->released_bytes);
+}
+
+// Stages removal of the first message of a queue within a transaction.
+bool PERSIMQ_tx_pop(T_PERSIMQ_Transaction* tx, T_PERSIMQ* mq)
+{
+    T_PERSIMQ_TxQueue* queue = tx_queue(tx, mq);
+    off_t record_size;
+    if (!queue || !PERSIMQ_pop_message(mq, &record_size)) return false;
+    queue->released_bytes += record_size;
+    return true;
+}
+
+// Syncs the queue headers the last commit has left unsynced.
+static bool tx_sync_headers(T_PERSIMQ_Transaction* tx)
+{
+    bool result = true;
+    for (unsigned idx = 0; idx < tx->header_fd_count; idx++) {
+        result &= (fdatasync(tx->header_fds[idx]) >= 0);
+        close(tx->header_fds[idx]);
+    }
+    tx->header_fd_count = 0;
+    return result;
+}
+
+// The log, every queue, its blobs and a header of the previous commit
+#define TX_BARRIER_MAX_FILES  (1 + 3 * PERSIMQ_TX_MAX_QUEUES)
+
+typedef struct {
+    int fd;
+    bool result;
+} TTxSyncTask;
+
+static void* tx_sync_task(void* arg)
+{
+    TTxSyncTask* task = arg;
+    task->result = (fdatasync(task->fd) >= 0); // The queue file size never changes
+    return NULL;
+}
+
+// Syncs the files a transaction has written: the log, the queues with their blobs and the queue
+// headers of the previous commit. The syncs are issued in parallel (one thread per file, the last
+// one in place) so that the device gets the flushes together and the barrier costs about one
+// storage round trip instead of one per file.
+static bool tx_barrier(T_PERSIMQ_Transaction* tx)
+{
+    TTxSyncTask tasks[TX_BARRIER_MAX_FILES];
+    unsigned count = 0;
+    tasks[count++].fd = tx->log_fd;
+    for (unsigned idx = 0; idx < tx->queue_count; idx++) {
+        T_PERSIMQ* mq = tx->queues[idx].mq;
+        tasks[count++].fd = mq->fd;
+        if (mq->ext && mq->ext->blob_unsynced) { // See blob_sync()
+            mq->ext->blob_unsynced = false;
+            tasks[count++].fd = mq->ext->blob_fd;
+        }
+    }
+    for (unsigned idx = 0; idx < tx->header_fd_count; idx++) tasks[count++].fd = tx->header_fds[idx];
+    pthread_t threads[TX_BARRIER_MAX_FILES];
+    bool started[TX_BARRIER_MAX_FILES];
+    for (unsigned idx = 0; idx < count; idx++) {
+        started[idx] = (idx + 1 < count) && !pthread_create(&threads[idx], NULL, tx_sync_task, &tasks[idx]);
+        if (!started[idx]) tx_sync_task(&tasks[idx]);
+    }
+    bool result = true;
+    for (unsigned idx = 0; idx < count; idx++) {
+        if (started[idx]) pthread_join(threads[idx], NULL);
+        result &= tasks[idx].result;
+    }
+    for (unsigned idx = 0; idx < tx->header_fd_count; idx++) close(tx->header_fds[idx]);
+    tx->header_fd_count = 0;
+    return result;
+}
+
+// Makes all the staged operations durable at once.
+bool PERSIMQ_tx_commit(T_PERSIMQ_Transaction* tx)
+{
+    if (!tx->log_fd) return false;
+    if (!tx->queue_count) return true; // Nothing to commit
+    TTxLogRecord record;
+    memset(&record, 0, sizeof(record));
+    memcpy(record.ID, "lPmT", 4);
+    record.sequence = tx->sequence + 1;
+    record.count = tx->queue_count;
+    for (unsigned idx = 0; idx < tx->queue_count; idx++) {
+        T_PERSIMQ_TxQueue* queue = &tx->queues[idx];
+        TTxLogEntry* entry = &record.entries[idx];
+        if (!staging_flush(queue->mq)) { // The barrier has to cover the pushed records
+            PERSIMQ_tx_abort(tx);
+            return false;
         }
+        entry->dev = queue->dev;
+        entry->ino = queue->ino;
+        entry->before.append_ptr = queue->append_ptr;
+        entry->before.extract_ptr = queue->extract_ptr;
+        entry->before.count_bytes = queue->count_bytes;
+        entry->before.count_messages = queue->count_messages;
+        tx_get_state(queue->mq, &entry->after);
+    }
+    record.crc = eval_crc8((void*)&record, sizeof(record)-1);
+    if (pwrite(tx->log_fd, (void*)&record, sizeof(record), (record.sequence % 2) * sizeof(record)) != sizeof(record)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            perror("PERSIMQ_tx_commit(): log write");
+        }
+        PERSIMQ_tx_abort(tx);
         return false;
     }
-    // Read the header
-    TMessageHeader header;
-    if (!PERSIMQ_read_message_header(mq, &header, mq->extract_ptr)) {
+    // The commit point. If the barrier fails the outcome is decided by the recovery on the next open.
+    bool result = tx_barrier(tx);
+    if (!result && (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY)) {
+        perror("PERSIMQ_tx_commit(): sync");
+    }
+    tx->sequence = record.sequence;
+    for (unsigned idx = 0; idx < tx->queue_count; idx++) {
+        T_PERSIMQ* mq = tx->queues[idx].mq;
+        mq->ext->tx_pending = false;
+        mq->ext->tx_mark_sequence = 0; // Covered by this commit, the header is synced with it
+        result &= PERSIMQ_write_header(mq);
+        mq->ext->tx_mark_sequence = record.sequence;
+        mq->ext->tx_mark_dev = tx->log_dev;
+        mq->ext->tx_mark_ino = tx->log_ino;
+        // Synced by the next commit (the queue may be closed by then)
+        int fd = dup(mq->fd);
+        if (fd >= 0) {
+            tx->header_fds[tx->header_fd_count++] = fd;
+        } else {
+            result &= (fdatasync(mq->fd) >= 0);
+        }
+    }
+    tx->queue_count = 0;
+    return result;
+}
+
+// Rolls back all the staged operations.
+void PERSIMQ_tx_abort(T_PERSIMQ_Transaction* tx)
+{
+    for (unsigned idx = 0; idx < tx->queue_count; idx++) {
+        T_PERSIMQ_TxQueue* queue = &tx->queues[idx];
+        struct persimq_ext* ext = queue->mq->ext;
+        if (ext) ext->tx_pending = false;
+        if (ext && ext->cancel_offsets && (queue->append_ptr > queue->mq->append_ptr)) {
+            ext->cancel_epoch--; // The pushes went back to the file start
+            ext->cancel_dirty = true;
+        }
+        queue->mq->append_ptr = queue->append_ptr;
+        queue->mq->extract_ptr = queue->extract_ptr;
+        queue->mq->count_bytes = queue->count_bytes;
+        queue->mq->count_messages = queue->count_messages;
+        staging_discard(queue->mq); // Everything staged before the transaction has been written
+        tail_reset(queue->mq);
+        // The popped blobs and the references taken by the pushes are counted again
+        if (ext && ext->dedup) dedup_rebuild(queue->mq);
+    }
+    tx->queue_count = 0;
+}
+
+// Closes a transaction log.
+bool PERSIMQ_tx_close(T_PERSIMQ_Transaction* tx)
+{
+    if (!tx->log_fd) return true;
+    PERSIMQ_tx_abort(tx);
+    bool result = tx_sync_headers(tx);
+    result &= (close(tx->log_fd) >= 0);
+    tx->log_fd = 0;
+    return result;
+}
+
+// --- Real-time producers ---
+// Every ring record is a 32-bit message size followed by the message, the records wrap around
+// the end of the ring. "head" and "tail" are free running byte counters published with
+// release/acquire ordering, so neither side ever waits for the other.
+
+#define RT_RECORD_HEADER_SIZE  (sizeof(uint32_t))
+
+// Copies data to the ring at a free running position (split around the end of the ring).
+static void rt_copy_in(T_PERSIMQ_RtRing* ring, uint64_t position, const void* data, size_t length)
+{
+    size_t offset = position & (ring->size - 1);
+    size_t first_part = ring->size - offset;
+    if (first_part > length) first_part = length;
+    memcpy(ring->buffer + offset, data, first_part);
+    memcpy(ring->buffer, (const uint8_t*)data + first_part, length - first_part);
+}
+
+// Describes the ring data at a free running position as one or two parts. Returns the part count.
+static int rt_parts(T_PERSIMQ_RtRing* ring, uint64_t position, size_t length, struct iovec* parts)
+{
+    size_t offset = position & (ring->size - 1);
+    size_t first_part = ring->size - offset;
+    parts[0].iov_base = ring->buffer + offset;
+    if (first_part >= length) {
+        parts[0].iov_len = length;
+        return 1;
+    }
+    parts[0].iov_len = first_part;
+    parts[1].iov_base = ring->buffer;
+    parts[1].iov_len = length - first_part;
+    return 2;
+}
+
+// Prepares a real-time producer ring for a queue.
+bool PERSIMQ_rt_init(T_PERSIMQ_RtRing* ring, T_PERSIMQ* mq, size_t ring_size)
+{
+    memset(ring, 0, sizeof(*ring));
+    uint64_t size = 4096;
+    while (size < ring_size) size <<= 1;
+    void* buffer;
+    if (posix_memalign(&buffer, 4096, size)) {
         if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            fprintf(stderr, "PERSIMQ_pop(): Message header read error!\n"); fflush(stderr);
+            fprintf(stderr, "PERSIMQ_rt_init(): Out of memory!\n"); fflush(stderr);
         }
         return false;
     }
-    // Roll the indexes
-    mq->extract_ptr = offset_roll(mq->extract_ptr, mq->file_size, header.message_size+sizeof(header));
-    mq->count_bytes -= header.message_size+sizeof(header);
-    mq->count_messages--;
+    memset(buffer, 0, size); // Fault all the pages in now
+    ring->locked = !mlock(buffer, size);
+    if (!ring->locked && (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_AND_WARNINGS)) {
+        perror("PERSIMQ_rt_init(): mlock (the ring may get swapped out)");
+    }
+    ring->mq = mq;
+    ring->buffer = buffer;
+    ring->size = size;
     return true;
 }
 
-// Removes "pop_count" messages from a queue (if available - otherwise all the messages are
-// removed unless the queue is empty in which case "false" is returned).
-bool PERSIMQ_pop_n(T_PERSIMQ* mq, uint64_t pop_count)
+// Real-time safe push.
+bool PERSIMQ_rt_push(T_PERSIMQ_RtRing* ring, const void* message, size_t message_size)
 {
-    if (pop_count >= mq->count_messages) {
-        // The quick option - just clear the entire queue
-        if ((PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_INFO) && (pop_count > mq->count_messages)) {
-            printf("PERSIMQ_get(): Buffer does not contain the requested amount of messages!\n");
+    uint64_t head = ring->head; // Only this thread changes it
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint64_t record_size = RT_RECORD_HEADER_SIZE + message_size;
+    if (!ring->buffer || (record_size > ring->size - (head - tail))) {
+        __atomic_store_n(&ring->overflows, ring->overflows + 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    uint32_t size_field = message_size;
+    rt_copy_in(ring, head, &size_field, RT_RECORD_HEADER_SIZE);
+    rt_copy_in(ring, head + RT_RECORD_HEADER_SIZE, message, message_size);
+    __atomic_store_n(&ring->head, head + record_size, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Moves messages from the ring to the queue.
+bool PERSIMQ_rt_drain(T_PERSIMQ_RtRing* ring, uint64_t max_messages, uint64_t* drained)
+{
+    uint64_t tail = ring->tail; // Only this thread changes it
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t count = 0;
+    bool result = true;
+    while ((tail != head) && (!max_messages || (count < max_messages))) {
+        uint32_t message_size;
+        struct iovec parts[2];
+        int part_count = rt_parts(ring, tail, RT_RECORD_HEADER_SIZE, parts);
+        memcpy(&message_size, parts[0].iov_base, parts[0].iov_len);
+        if (part_count > 1) memcpy((uint8_t*)&message_size + parts[0].iov_len, parts[1].iov_base, parts[1].iov_len);
+        part_count = rt_parts(ring, tail + RT_RECORD_HEADER_SIZE, message_size, parts);
+        if (!PERSIMQ_pushv(ring->mq, parts, part_count)) { // The queue is full: keep the message in the ring
+            result = false;
+            break;
         }
-        pop_count = mq->count_messages;
-        mq->extract_ptr = mq->append_ptr;
-        mq->count_bytes = 0;
-        mq->count_messages = 0;
-        return true;
-    } else {
-        // The long option - remove them one by one
-        bool result = true;
-        for (int i = 0; i < pop_count; i++) result &= PERSIMQ_pop(mq);
-        return result;
+        tail += RT_RECORD_HEADER_SIZE + message_size;
+        // Hand the space back to the producer as soon as possible
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        count++;
     }
+    if (drained) *drained = count;
+    return result;
 }
 
-static bool PERSIMQ_read_message_data(T_PERSIMQ* mq, void* buffer, size_t buffer_size,
-    const size_t message_size, const uint8_t message_crc,
-    const off_t extract_ptr)
+// Releases the ring memory.
+void PERSIMQ_rt_free(T_PERSIMQ_RtRing* ring)
 {
-    // Read the message
-    if (!wrapped_io(mq->fd, buffer, message_size, extract_ptr, mq->file_size, NULL, false)) {
-        #ifdef __unix__
-            flock(mq->fd, LOCK_UN);
-        #endif
-        close(mq->fd);
-        mq->fd = 0;
-        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            perror("PERSIMQ_read_message_data(): file read (data)");
+    if (!ring->buffer) return;
+    if (ring->locked) munlock(ring->buffer, ring->size);
+    free(ring->buffer);
+    ring->buffer = NULL;
+    ring->locked = false;
+}
+
+// --- Striped queues ---
+// Every message of a striped queue is prefixed with a 64-bit sequence number and put to the
+// stripe "sequence % count". Each stripe is an ordinary queue file so the stripes can be written
+// and synced in parallel (one thread per stripe) and the consumer merges them back by taking the
+// stripe with the lowest head sequence. Messages lost from the tail of some stripe after a crash
+// only leave gaps in the sequence, the order of the remaining messages is kept.
+
+#define STRIPE_SEQUENCE_SIZE  (sizeof(uint64_t))
+
+typedef struct {
+    T_PERSIMQ* mq;
+    bool result;
+    uint64_t last_sequence; // Scan result: the newest sequence of the stripe
+} TStripeTask;
+
+// Runs a task for every stripe in parallel, "false" is returned if any of the tasks failed.
+static bool stripe_run(T_PERSIMQ_Stripe* smq, TStripeTask* tasks, void* (*task)(void*))
+{
+    pthread_t threads[PERSIMQ_STRIPE_MAX_QUEUES];
+    bool started[PERSIMQ_STRIPE_MAX_QUEUES];
+    for (unsigned idx = 0; idx < smq->count; idx++) {
+        tasks[idx].mq = &smq->stripes[idx];
+        tasks[idx].result = false;
+        // The last stripe (and any stripe the thread can not be created for) is done in place
+        started[idx] = (idx + 1 < smq->count) && !pthread_create(&threads[idx], NULL, task, &tasks[idx]);
+        if (!started[idx]) task(&tasks[idx]);
+    }
+    bool result = true;
+    for (unsigned idx = 0; idx < smq->count; idx++) {
+        if (started[idx]) pthread_join(threads[idx], NULL);
+        result &= tasks[idx].result;
+    }
+    return result;
+}
+
+static void* stripe_task_sync(void* arg)
+{
+    TStripeTask* task = arg;
+    task->result = PERSIMQ_sync(task->mq);
+    return NULL;
+}
+
+static void* stripe_task_close(void* arg)
+{
+    TStripeTask* task = arg;
+    task->result = PERSIMQ_close(task->mq);
+    task->mq->fd = 0;
+    return NULL;
+}
+
+// Finds the newest sequence stored in a stripe.
+static void* stripe_task_scan(void* arg)
+{
+    TStripeTask* task = arg;
+    T_PERSIMQ_Cursor cursor;
+    const void* message;
+    size_t message_size;
+    task->last_sequence = 0;
+    task->result = false;
+    if (!PERSIMQ_cursor_init(&cursor, task->mq, 1024*1024, task->mq->extract_ptr, task->mq->count_bytes)) {
+        return NULL;
+    }
+    bool damaged = false;
+    while (PERSIMQ_cursor_next(&cursor, &message, &message_size)) {
+        if (message_size < STRIPE_SEQUENCE_SIZE) {
+            damaged = true;
+            break;
         }
+        memcpy(&task->last_sequence, message, STRIPE_SEQUENCE_SIZE);
+    }
+    task->result = !damaged && !cursor.error;
+    PERSIMQ_cursor_free(&cursor);
+    return NULL;
+}
+
+// Reads "length" payload bytes of a message after the first "skip" ones.
+static bool stripe_read_part(T_PERSIMQ* mq, const TPayload* payload, size_t skip, void* buffer, size_t length)
+{
+    if (payload->data) {
+        memcpy(buffer, payload->data + skip, length);
+        return true;
+    }
+    if (payload->in_blob) return multiread(mq->ext->blob_fd, buffer, length, payload->offset + skip);
+    return PERSIMQ_read_data(mq, buffer, length, offset_roll(payload->offset, mq->file_size, skip));
+}
+
+// Reads the header, the offset, the payload location and the sequence of the first message of a stripe.
+static bool stripe_read_head(T_PERSIMQ* mq, TMessageHeader* header, off_t* message_ptr, TPayload* payload,
+    uint64_t* sequence)
+{
+    *message_ptr = mq->extract_ptr;
+    if (!PERSIMQ_read_message_header(mq, header, message_ptr) ||
+            !PERSIMQ_locate_payload(mq, header, *message_ptr, payload)) {
         return false;
     }
-    // Check the message
-    uint8_t crc = eval_crc8(buffer, message_size);
-    if (crc != message_crc) { // Corrupted message detected
-        #ifdef __unix__
-            flock(mq->fd, LOCK_UN);
-        #endif
-        close(mq->fd);
-        mq->fd = 0;
+    if (payload->size < STRIPE_SEQUENCE_SIZE) {
         if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            fprintf(stderr, "PERSIMQ_read_message_data(): bad CRC (damaged message at offset 0x%" PRId64 ")! File closed!\n", (int64_t)extract_ptr);
-            fflush(stderr);
+            fprintf(stderr, "PERSIMQ_stripe_get(): Not a striped queue message at offset 0x%" PRIX64 "!\n",
+                (uint64_t)*message_ptr); fflush(stderr);
         }
         return false;
     }
-    return true; // Done!
+    return stripe_read_part(mq, payload, 0, sequence, STRIPE_SEQUENCE_SIZE);
 }
 
-// Reads the first message from a queue (if available).
-bool PERSIMQ_get(T_PERSIMQ* mq, void* buffer, size_t buffer_size, size_t* message_size)
+// Returns the stripe holding the first message of the striped queue (-1 if empty or on errors).
+static int stripe_first(T_PERSIMQ_Stripe* smq)
 {
-    if (!mq->fd) {
+    int first = -1;
+    for (unsigned idx = 0; idx < smq->count; idx++) {
+        T_PERSIMQ* mq = &smq->stripes[idx];
+        if (!mq->fd || !mq->count_messages) continue;
+        if (!smq->heads_valid[idx]) {
+            TMessageHeader header;
+            off_t message_ptr;
+            TPayload payload;
+            if (!stripe_read_head(mq, &header, &message_ptr, &payload, &smq->heads[idx])) return -1;
+            smq->heads_valid[idx] = true;
+        }
+        if ((first < 0) || (smq->heads[idx] < smq->heads[first])) first = idx;
+    }
+    return first;
+}
+
+// Opens a striped queue made of "count" queue files named "file_name" in the given directories.
+bool PERSIMQ_stripe_open(T_PERSIMQ_Stripe* smq, char** directories, unsigned count,
+    char* file_name, const T_PERSIMQ_Options* options)
+{
+    if (!count || (count > PERSIMQ_STRIPE_MAX_QUEUES)) {
         if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            fprintf(stderr, "PERSIMQ_pop(): Uninitialized MQ struct provided!\n"); fflush(stderr);
+            fprintf(stderr, "PERSIMQ_stripe_open(): 1 to %u stripes are supported!\n",
+                PERSIMQ_STRIPE_MAX_QUEUES); fflush(stderr);
         }
         return false;
     }
-    // Check if we have any mesasges left to read
-    if (!PERSIMQ_messages_available(mq)) {
-        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_INFO) {
-            printf("PERSIMQ_get(): Buffer does not contain any messages!\n");
+    memset(smq, 0, sizeof(*smq));
+    for (unsigned idx = 0; idx < count; idx++) {
+        char path[4096];
+        if ((snprintf(path, sizeof(path), "%s/%s", directories[idx], file_name) >= sizeof(path)) ||
+                !PERSIMQ_open_with_options(&smq->stripes[idx], path, options)) {
+            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+                fprintf(stderr, "PERSIMQ_stripe_open(): Unable to open stripe %u (%s)!\n", idx, path);
+                fflush(stderr);
+            }
+            for (unsigned opened = 0; opened < idx; opened++) PERSIMQ_close(&smq->stripes[opened]);
+            smq->count = 0;
+            return false;
+        }
+        smq->count = idx + 1;
+    }
+    // Continue the sequence after the newest message of all the stripes
+    TStripeTask tasks[PERSIMQ_STRIPE_MAX_QUEUES];
+    if (!stripe_run(smq, tasks, stripe_task_scan)) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_stripe_open(): Damaged stripe data!\n"); fflush(stderr);
         }
+        PERSIMQ_stripe_close(smq);
         return false;
     }
-    // Read the header
+    for (unsigned idx = 0; idx < count; idx++) {
+        if (smq->stripes[idx].count_messages && (tasks[idx].last_sequence >= smq->push_sequence)) {
+            smq->push_sequence = tasks[idx].last_sequence + 1;
+        }
+    }
+    return true;
+}
+
+// Writes all the changes and closes all the stripe files.
+bool PERSIMQ_stripe_close(T_PERSIMQ_Stripe* smq)
+{
+    TStripeTask tasks[PERSIMQ_STRIPE_MAX_QUEUES];
+    bool result = stripe_run(smq, tasks, stripe_task_close);
+    smq->count = 0;
+    return result;
+}
+
+// Writes and syncs the changes of all the stripes in parallel.
+bool PERSIMQ_stripe_sync(T_PERSIMQ_Stripe* smq)
+{
+    TStripeTask tasks[PERSIMQ_STRIPE_MAX_QUEUES];
+    return stripe_run(smq, tasks, stripe_task_sync);
+}
+
+// Adds a message to the striped queue.
+bool PERSIMQ_stripe_push(T_PERSIMQ_Stripe* smq, void* message, size_t message_size)
+{
+    if (!smq->count) return false;
+    uint64_t sequence = smq->push_sequence;
+    unsigned idx = sequence % smq->count;
+    T_PERSIMQ* mq = &smq->stripes[idx];
+    struct iovec parts[2] = {
+        { &sequence, STRIPE_SEQUENCE_SIZE },
+        { message, message_size }
+    };
+    bool was_empty = !mq->count_messages;
+    if (!PERSIMQ_pushv(mq, parts, 2)) return false;
+    if (was_empty) {
+        smq->heads[idx] = sequence;
+        smq->heads_valid[idx] = true;
+    }
+    smq->push_sequence++;
+    return true;
+}
+
+// Reads the first message of the striped queue (if available).
+bool PERSIMQ_stripe_get(T_PERSIMQ_Stripe* smq, void* buffer, size_t buffer_size, size_t* message_size)
+{
+    int first = stripe_first(smq);
+    if (first < 0) return false;
+    T_PERSIMQ* mq = &smq->stripes[first];
     TMessageHeader header;
-    if (!PERSIMQ_read_message_header(mq, &header, mq->extract_ptr)) {
+    off_t message_ptr;
+    TPayload payload;
+    uint64_t sequence;
+    if (!stripe_read_head(mq, &header, &message_ptr, &payload, &sequence)) return false;
+    size_t size = payload.size - STRIPE_SEQUENCE_SIZE;
+    if (message_size) *message_size = size;
+    if (size > buffer_size) {
         if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            fprintf(stderr, "PERSIMQ_get_message_by_offset(): Message header read error!\n"); fflush(stderr);
+            printf("PERSIMQ_stripe_get(): Buffer size is not big enough to fit the message!\n");
         }
         return false;
     }
-    if (message_size) *message_size = header.message_size;
-    if (header.message_size > buffer_size) {
+    if (!stripe_read_part(mq, &payload, STRIPE_SEQUENCE_SIZE, buffer, size)) {
         if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            printf("PERSIMQ_get(): Buffer size is not big enough to fit the message!\n");
+            perror("PERSIMQ_stripe_get(): file read (data)");
+        }
+        return false;
+    }
+    uint8_t crc = eval_crc8_continue(eval_crc8((uint8_t*)&sequence, STRIPE_SEQUENCE_SIZE), buffer, size);
+    if (crc != payload.crc) {
+        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
+            fprintf(stderr, "PERSIMQ_stripe_get(): bad CRC (damaged message at offset 0x%" PRIX64 " of stripe %d)!\n",
+                (uint64_t)message_ptr, first); fflush(stderr);
         }
         return false;
     }
-    return PERSIMQ_read_message_data(mq, buffer, buffer_size,
-        header.message_size, header.message_crc,
-        mq->extract_ptr+sizeof(header) );
+    return true;
 }
 
-// Reads all the messages from a queue (up to the "messages_limit" and up to the buffer size).
-bool PERSIMQ_get_all(T_PERSIMQ* mq, void* buffer, size_t buffer_size, uint64_t max_messages,
-    size_t* total_size, uint64_t* messages_read)
+// Removes the first message of the striped queue (if available).
+bool PERSIMQ_stripe_pop(T_PERSIMQ_Stripe* smq)
 {
-    if (!mq->fd) {
+    int first = stripe_first(smq);
+    if (first < 0) return false;
+    smq->heads_valid[first] = false;
+    return PERSIMQ_pop(&smq->stripes[first]);
+}
+
+// Checks if there are any messages left in the striped queue.
+bool PERSIMQ_stripe_is_empty(T_PERSIMQ_Stripe* smq)
+{
+    return !PERSIMQ_stripe_messages_available(smq);
+}
+
+// Ruturns the amount of messages left in the striped queue.
+off_t PERSIMQ_stripe_messages_available(T_PERSIMQ_Stripe* smq)
+{
+    off_t count = 0;
+    for (unsigned idx = 0; idx < smq->count; idx++) count += smq->stripes[idx].count_messages;
+    return count;
+}
+
+// --- Merging ---
+// Every source keeps its current message in its cursor buffer. A loser tree holds the result of
+// every match between the sources so replacing the winner takes log2(count) key comparisons along
+// a single path of the tree. Exhausted sources lose every match.
+
+struct persimq_merge_source {
+    T_PERSIMQ mq;
+    T_PERSIMQ_Cursor cursor;
+    const void* message;
+    size_t message_size;
+    uint64_t key;
+    bool done;
+};
+
+// Reads the next message of a merge source and evaluates its key.
+static void merge_advance(T_PERSIMQ_Merge* merge, unsigned idx)
+{
+    struct persimq_merge_source* source = &merge->sources[idx];
+    if (source->done) return;
+    if (!PERSIMQ_cursor_next(&source->cursor, &source->message, &source->message_size)) {
+        if (source->cursor.error) merge->error = true;
+        source->done = true;
+        return;
+    }
+    if (!merge->key_size) { // Take the messages in turn
+        source->key++;
+        return;
+    }
+    source->key = 0;
+    if ((merge->key_offset + merge->key_size) > source->message_size) return;
+    const uint8_t* field = (const uint8_t*)source->message + merge->key_offset;
+    for (size_t byte = 0; byte < merge->key_size; byte++) source->key |= (uint64_t)field[byte] << (byte * 8);
+}
+
+// Checks if the current message of source "a" goes before the one of source "b".
+static bool merge_less(T_PERSIMQ_Merge* merge, unsigned a, unsigned b)
+{
+    struct persimq_merge_source* source_a = &merge->sources[a];
+    struct persimq_merge_source* source_b = &merge->sources[b];
+    if (source_a->done != source_b->done) return source_b->done;
+    if (source_a->key != source_b->key) return (source_a->key < source_b->key);
+    return (a < b);
+}
+
+// Plays all the matches of a subtree (leaves are the nodes "count" to "2*count-1").
+static unsigned merge_build(T_PERSIMQ_Merge* merge, unsigned node)
+{
+    if (node >= merge->count) return node - merge->count;
+    unsigned left = merge_build(merge, node * 2);
+    unsigned right = merge_build(merge, node * 2 + 1);
+    bool left_wins = merge_less(merge, left, right);
+    merge->tree[node] = left_wins ? right : left;
+    return left_wins ? left : right;
+}
+
+// Opens the source queue files of a merge.
+bool PERSIMQ_merge_open(T_PERSIMQ_Merge* merge, char** paths, unsigned count, size_t chunk_size,
+    size_t key_offset, size_t key_size)
+{
+    memset(merge, 0, sizeof(*merge));
+    if (!count || (key_size > sizeof(uint64_t))) return false;
+    merge->key_offset = key_offset;
+    merge->key_size = key_size;
+    merge->sources = calloc(count, sizeof(struct persimq_merge_source));
+    merge->tree = calloc(count, sizeof(unsigned));
+    if (!merge->sources || !merge->tree) {
         if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-            fprintf(stderr, "PERSIMQ_pop(): Uninitialized MQ struct provided!\n"); fflush(stderr);
+            fprintf(stderr, "PERSIMQ_merge_open(): Out of memory!\n"); fflush(stderr);
         }
+        PERSIMQ_merge_close(merge);
         return false;
     }
-    // Check if we have any mesasges left to read
-    if (!PERSIMQ_messages_available(mq)) {
-        if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_INFO) {
-            printf("PERSIMQ_get(): Buffer does not contain any messages!\n");
+    for (; merge->count < count; merge->count++) {
+        struct persimq_merge_source* source = &merge->sources[merge->count];
+        if (!PERSIMQ_open_readonly(&source->mq, paths[merge->count])) {
+            PERSIMQ_merge_close(merge);
+            return false;
         }
-        return false;
+        if (!PERSIMQ_cursor_init(&source->cursor, &source->mq, chunk_size, source->mq.extract_ptr,
+                source->mq.count_bytes)) {
+            PERSIMQ_drop(&source->mq);
+            PERSIMQ_merge_close(merge);
+            return false;
+        }
+        merge->total_bytes += source->mq.count_bytes;
+        merge->total_messages += source->mq.count_messages;
     }
-    // Start extracting the messages
-    bool result = true;
-    size_t total_size_used = buffer_size;
-    uint64_t message_idx = 0;
-    off_t current_ptr = mq->extract_ptr;
-    while ((message_idx < mq->count_messages) && (message_idx < max_messages)) {
-        message_idx++;
-        // Get message header
-        TMessageHeader header;
-        if (!PERSIMQ_read_message_header(mq, &header, current_ptr)) {
-            if (PERSIMQ_Verbosity >= PERSIMQ_VERBOSITY_ERRORS_ONLY) {
-                fprintf(stderr, "PERSIMQ_get_message_by_offset(): Message header read error!\n"); fflush(stderr);
+    return true;
+}
+
+// Returns the next message of the merged stream.
+bool PERSIMQ_merge_next(T_PERSIMQ_Merge* merge, const void** message, size_t* message_size, unsigned* source)
+{
+    if (!merge->count || merge->error) return false;
+    unsigned winner;
+    if (!merge->started) {
+        for (unsigned idx = 0; idx < merge->count; idx++) merge_advance(merge, idx);
+        winner = merge_build(merge, 1);
+        merge->started = true;
+    } else {
+        // Replace the message returned last time and replay its path to the root
+        winner = merge->tree[0];
+        merge_advance(merge, winner);
+        for (unsigned node = (winner + merge->count) / 2; node; node /= 2) {
+            if (merge_less(merge, merge->tree[node], winner)) {
+                unsigned loser = winner;
+                winner = merge->tree[node];
+                merge->tree[node] = loser;
             }
-            return false;
         }
-        if (header.message_size > buffer_size) break; // No space left in the user buffer
-        // Read the message and adjust the buffer pointer
-        result &= PERSIMQ_read_message_data(mq, buffer, buffer_size,
-            header.message_size, header.message_crc, current_ptr+sizeof(header));
-        if (!result) break; // Do not continue on read errors
-        buffer += header.message_size; buffer_size -= header.message_size;
-        // Go to the next message
-        current_ptr = offset_roll(current_ptr, mq->file_size, header.message_size + sizeof(header));
     }
-    if (total_size) *total_size = total_size_used - buffer_size;
-    if (messages_read) *messages_read = message_idx;
-    return result;
+    merge->tree[0] = winner;
+    struct persimq_merge_source* head = &merge->sources[winner];
+    if (merge->error || head->done) return false;
+    if (message) *message = head->message;
+    if (message_size) *message_size = head->message_size;
+    if (source) *source = winner;
+    return true;
+}
+
+// Closes all the source queue files of a merge.
+void PERSIMQ_merge_close(T_PERSIMQ_Merge* merge)
+{
+    for (unsigned idx = 0; idx < merge->count; idx++) {
+        PERSIMQ_cursor_free(&merge->sources[idx].cursor);
+        PERSIMQ_drop(&merge->sources[idx].mq);
+    }
+    free(merge->sources);
+    free(merge->tree);
+    merge->sources = NULL;
+    merge->tree = NULL;
+    merge->count = 0;
 }
 
 // Checks if there are any messages left in the queue.
@@ -565,15 +5680,17 @@ off_t PERSIMQ_messages_available(T_PERSIMQ* mq)
 }
 
 // Ruturns the amount of data bytes stored in all messages left in the queue.
+// Compressed frames (see the "compress_watermark" option) are counted by their compressed size.
 size_t PERSIMQ_bytes_available(T_PERSIMQ* mq)
 {
-    return mq->count_bytes - (sizeof(TMessageHeader) * mq->count_messages);
+    off_t headers = sizeof(TMessageHeader) * mq->count_messages;
+    return (mq->count_bytes > headers) ? mq->count_bytes - headers : 0;
 }
 
 // Ruturns the amount of free bytes in the queue.
 size_t PERSIMQ_bytes_free(T_PERSIMQ* mq)
 {
-    return mq->file_size - (mq->count_bytes + sizeof(TFileHeader));
+    return mq->file_size - (readers_retained(mq) + sizeof(TFileHeader));
 }
 
 // Changes the amount of debug messages to be put out by the library (PERSIMQ_ERRORS_ONLY is the default).
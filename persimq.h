@@ -11,6 +11,8 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <sys/types.h>
+#include <time.h>     // struct timespec
+#include <sys/uio.h>  // struct iovec
 
 #ifdef __cplusplus
 extern "C" {
@@ -18,6 +20,46 @@ extern "C" {
 
 extern const char PERSIMQ_VERSION[]; // PERSIMQ library version
 
+// Queue options (see PERSIMQ_options_init() for the defaults).
+// The options can be stored in a "key = value" text file, see PERSIMQ_options_load().
+typedef struct {
+	off_t file_size;          // Queue file size
+	uint32_t sync_interval;   // Automatic PERSIMQ_sync() after this amount of push/pop calls (0 - disabled)
+	bool sync_data_only;      // Use fdatasync() instead of fsync() when syncing
+	char tx_log_path[256];    // Transaction log to recover the queue from on open (empty - none), the
+	                          // commits already applied are noted in a "<queue file>.tx" file
+	uint32_t read_cache_size; // Consumer read cache size in bytes (0 - disabled)
+	uint32_t burst_size;      // Burst mode: pushed data is kept in RAM up to this amount of bytes (0 - disabled)
+	uint32_t burst_max_delay_ms; // Burst mode: maximum age of the data kept in RAM (0 - not limited). The age is
+	                          // checked by the push, pop and get calls, an idle queue keeps the data until then.
+	uint32_t fadvise_window;  // Page cache management: readahead window ahead of the consumer,
+	                          // consumed data is dropped from the page cache (0 - disabled)
+	bool fadvise_drop_written; // Also drop synced data from the page cache if the consumer is far behind
+	uint32_t payload_alignment; // Pushed records are padded so that every payload starts at a file offset
+	                          // aligned to this amount of bytes (8 to PERSIMQ_MAX_PAYLOAD_ALIGNMENT, 0 - no padding)
+	bool shared_state;        // Keep the live queue state in a memory mapped "<queue file>.state" file so that
+	                          // nothing is lost if the process crashes (syncs are only needed for power losses)
+	uint32_t stall_io_ms;     // Stall detector: report reads and writes taking longer than this (0 - disabled)
+	uint32_t stall_sync_ms;   // Stall detector: report syncs taking longer than this (0 - disabled)
+	uint32_t hash_block_size; // Keep a hash tree of the data blocks of this size (power of two) in a memory
+	                          // mapped "<queue file>.hashes" file to compare replicas (0 - disabled)
+	uint32_t tail_index;      // Index this amount of the newest messages for PERSIMQ_get_newest() (0 - disabled)
+	uint32_t cancel_slots;    // Up to this amount of pending messages can be cancelled at a time, the cancelled
+	                          // records are kept in a "<queue file>.cancel" file (0 - disabled)
+	uint32_t blob_threshold;  // Pushed payloads bigger than this are stored in a "<queue file>.blobs" file and
+	                          // the queue only keeps references to them (0 - disabled). Where holes can not be
+	                          // punched in files the blob file may grow up to file_size bytes.
+	uint32_t compress_watermark; // Compress the older part of the backlog at syncs when the queue is filled
+	                          // over this percentage (0 - disabled). Not for queues with cancel_slots or
+	                          // transactions.
+	bool blob_dedup;          // A pushed blob payload identical to a queued one is stored only once, the new
+	                          // message refers to the old copy
+} T_PERSIMQ_Options;
+
+#define PERSIMQ_MAX_PAYLOAD_ALIGNMENT (64)
+
+struct persimq_ext; // Private state of the optional features (caches, buffers)
+
 // PERSIMQ object descriptor
 typedef struct {
 	int fd;
@@ -26,8 +68,93 @@ typedef struct {
 	off_t count_bytes;
 	off_t count_messages;
 	off_t file_size;
+	bool read_only;
+	T_PERSIMQ_Options options;
+	uint32_t ops_since_sync;
+	struct persimq_ext* ext;
 } T_PERSIMQ;
 
+// Burst mode statistics (see PERSIMQ_burst_stats()).
+typedef struct {
+	uint64_t bursts;           // Amount of burst writes done
+	uint64_t staged_messages;  // Messages which went through the RAM buffer
+	uint64_t writes_avoided;   // Device writes (wake-ups) saved compared to writing each message
+	uint64_t bytes_skipped;    // Bytes consumed before they had to be written at all
+} T_PERSIMQ_BurstStats;
+
+// Diagnostic snapshot of an I/O stall (see the "stall_io_ms" and "stall_sync_ms" options).
+typedef struct {
+	const char* operation;     // "read", "write", "burst write", "header write", "fsync" or "fdatasync"
+	off_t offset;              // Queue file offset and size of the stalled operation
+	size_t length;
+	uint64_t duration_us;
+	struct timespec time;      // When the stall ended (CLOCK_REALTIME)
+	off_t unsynced_bytes;      // Queue bytes written since the last sync
+	int64_t dirty_bytes;       // System-wide dirty page cache ("Dirty" of /proc/meminfo)
+	off_t count_bytes;         // Queue fill level
+	off_t file_size;
+	int64_t io_read_bytes;     // Process storage I/O since the last sync (/proc/self/io)
+	int64_t io_write_bytes;
+	int64_t pressure_some_us;  // System I/O stall time since the last sync (/proc/pressure/io)
+	int64_t pressure_full_us;
+} T_PERSIMQ_StallSnapshot;     // Values which could not be read are set to -1
+
+// Stall detector statistics (see PERSIMQ_stall_stats()).
+typedef struct {
+	uint64_t stalls;           // Amount of operations over the thresholds
+	uint64_t worst_us;         // The longest stall
+	T_PERSIMQ_StallSnapshot last;
+} T_PERSIMQ_StallStats;
+
+// Stall handler, called by the thread which has done the stalled operation. Must not use the queue.
+// The snapshot is only valid during the call.
+typedef void (*T_PERSIMQ_StallHandler)(T_PERSIMQ* mq, const T_PERSIMQ_StallSnapshot* snapshot, void* user_data);
+
+// Simulated storage device (see PERSIMQ_set_device_model()). The times are in microseconds.
+typedef struct {
+	uint32_t read_us;          // Cost of every read
+	uint32_t read_us_per_mb;
+	uint32_t write_us;         // Cost of every write
+	uint32_t write_us_per_mb;
+	uint32_t unaligned_us;     // Extra cost of a write which does not start and end on a page
+	uint32_t page_size;        // 0 - 4096
+	uint32_t sync_us;          // Cost of every fsync()
+	uint32_t sync_us_per_mb;   // Cost per MB written since the previous sync
+	off_t gc_interval;         // A garbage collection stall every gc_interval written bytes (0 - none)
+	uint32_t gc_stall_us;
+	uint32_t jitter_percent;   // Mean of the random extra cost (exponentially distributed)
+} T_PERSIMQ_DeviceModel;
+
+// Library memory usage (see PERSIMQ_set_memory_budget()).
+typedef struct {
+	size_t budget;           // Configured budget (0 - unlimited)
+	size_t used;             // Memory held by the queues: caches, buffers and the tables of the options
+	size_t pooled;           // Released memory kept in the shared pool for reuse
+	uint64_t shrinks;        // Amount of caches released to stay within the budget
+	uint64_t denied;         // Allocations refused because of the budget
+} T_PERSIMQ_MemoryStats;
+
+// Sequential batched reader over the records of a queue (see PERSIMQ_cursor_*()).
+// Records are read in big chunks so that only a few syscalls are needed per batch.
+typedef struct {
+	T_PERSIMQ* mq;
+	off_t offset;        // Offset of the next record to be returned
+	off_t bytes_left;    // Amount of queue bytes (headers included) left to walk
+	uint8_t* buffer;     // Chunk buffer
+	size_t buffer_size;
+	size_t chunk_pos;    // Position of the next record within the chunk buffer
+	size_t chunk_length; // Amount of valid bytes in the chunk buffer
+	off_t record_offset; // Offset of the record returned last (0 - from a compressed frame)
+	off_t blob_offset;   // Blob file offset of the payload returned last (-1 - not in the blob file)
+	uint8_t* blob;       // Payload buffer for the messages stored in the blob file
+	size_t blob_size;
+	uint8_t* frame;      // Decompressed frame (see the "compress_watermark" option)
+	size_t frame_size;
+	size_t frame_pos;    // Position of the next message within the frame
+	size_t frame_length;
+	bool error;          // Set when reading stopped because of an I/O error or damaged data
+} T_PERSIMQ_Cursor;
+
 typedef enum {
 	PERSIMQ_VERBOSITY_SILENT = 0,
 	PERSIMQ_VERBOSITY_ERRORS_ONLY,
@@ -38,9 +165,135 @@ typedef enum {
 } T_PERSIMQ_DebugVerbosityLevel;
 
 
+#define PERSIMQ_TX_MAX_QUEUES (8) // Maximum amount of queues in a single transaction
+
+// Queue state saved at the start of a transaction.
+typedef struct {
+	T_PERSIMQ* mq;
+	dev_t dev;
+	ino_t ino;
+	off_t append_ptr;
+	off_t extract_ptr;
+	off_t count_bytes;
+	off_t count_messages;
+	off_t released_bytes; // Space freed by the transaction pops (can not be reused before the commit)
+} T_PERSIMQ_TxQueue;
+
+// Multi-queue transaction. Pushes and pops staged on several queues are committed atomically
+// with a single intent log record and one barrier which syncs all the files in parallel
+// (see PERSIMQ_tx_*()).
+typedef struct {
+	int log_fd;
+	dev_t log_dev;
+	ino_t log_ino;
+	uint64_t sequence;
+	unsigned queue_count;
+	T_PERSIMQ_TxQueue queues[PERSIMQ_TX_MAX_QUEUES];
+	int header_fds[PERSIMQ_TX_MAX_QUEUES]; // Queue files whose headers the last commit left unsynced
+	unsigned header_fd_count;
+} T_PERSIMQ_Transaction;
+
+#define PERSIMQ_STRIPE_MAX_QUEUES (8) // Maximum amount of stripes in a striped queue
+
+// Striped queue. Messages are spread over several queue files (usually on different devices)
+// in turn, the files are written and synced in parallel and read back in the push order
+// (see PERSIMQ_stripe_*()).
+typedef struct {
+	unsigned count;
+	T_PERSIMQ stripes[PERSIMQ_STRIPE_MAX_QUEUES];
+	uint64_t heads[PERSIMQ_STRIPE_MAX_QUEUES]; // Sequence of the first message of every stripe
+	bool heads_valid[PERSIMQ_STRIPE_MAX_QUEUES];
+	uint64_t push_sequence;                    // Sequence of the next message to be pushed
+} T_PERSIMQ_Stripe;
+
+// Length prefix formats of the streams read by PERSIMQ_ingest_from_fd().
+typedef enum {
+	PERSIMQ_FRAMING_U32_LE = 0,  // 32-bit little endian payload size
+	PERSIMQ_FRAMING_U32_BE,      // 32-bit big endian (network order) payload size
+	PERSIMQ_FRAMING_U16_BE       // 16-bit big endian payload size
+} T_PERSIMQ_Framing;
+
+// Bulk ingest state (see PERSIMQ_ingest_*()). The bytes read past the last whole message
+// are kept in the buffer until the next call.
+typedef struct {
+	T_PERSIMQ_Framing framing;
+	uint32_t max_message_size;   // Longer frames are treated as a stream error
+	uint64_t max_messages;       // Limits of a single PERSIMQ_ingest_from_fd() call (0 - not limited)
+	uint64_t max_bytes;          // (payload bytes)
+	uint8_t* buffer;
+	size_t buffer_size;
+	size_t buffer_pos;           // Unprocessed data is buffer[buffer_pos..buffer_length)
+	size_t buffer_length;
+	bool eof;                    // The input has been closed
+	bool queue_full;             // The last call stopped because the queue was full
+	uint64_t messages;           // Totals of all the calls
+	uint64_t bytes;
+} T_PERSIMQ_Ingest;
+
+struct persimq_merge_source;
+
+// Streaming merge of several queue files (see PERSIMQ_merge_*()). The files are opened read-only
+// and walked with cursors, the messages are returned in the order of a little endian unsigned key
+// field of the payloads (a timestamp or a sequence number) using a loser tree.
+typedef struct {
+	unsigned count;
+	size_t key_offset;                   // Offset of the key field in the payloads
+	size_t key_size;                     // Key field size (1-8 bytes), 0 - no key, take the messages in turn
+	struct persimq_merge_source* sources;
+	unsigned* tree;                      // tree[0] is the current source, the rest keep the losers
+	bool started;
+	bool error;
+	uint64_t total_bytes;                // Queue bytes of all the source queues
+	uint64_t total_messages;
+} T_PERSIMQ_Merge;
+
+#define PERSIMQ_MAX_READERS (16) // Maximum amount of concurrent readers of a queue
+
+// Concurrent in-process reader of a queue (see PERSIMQ_reader_*()). Readers walk the messages
+// from their own threads without any locks while the owner thread keeps pushing and popping.
+typedef struct {
+	T_PERSIMQ* mq;
+	int slot;                  // Reader slot of the queue
+	T_PERSIMQ_Cursor cursor;
+	uint64_t skipped;          // Times the reader fell behind the consumer and had to skip messages
+} T_PERSIMQ_Reader;
+
+// Real-time producer ring (see PERSIMQ_rt_*()). A wait-free single producer/single consumer
+// ring in locked memory: the producer only copies the messages, an I/O thread pushes them to the queue.
+typedef struct {
+	T_PERSIMQ* mq;
+	uint8_t* buffer;
+	uint64_t size;                                  // Ring size in bytes (power of two)
+	bool locked;                                    // The ring is locked in RAM
+	uint64_t head __attribute__((aligned(64)));     // Written by the producer only
+	uint64_t overflows;                             // Messages refused because the ring was full
+	uint64_t tail __attribute__((aligned(64)));     // Written by the I/O thread only
+} T_PERSIMQ_RtRing;
+
 // Opens a queue file and initializes a T_PERSIMQ struct.
 bool   PERSIMQ_open(T_PERSIMQ* mq, char* mqfile_path, off_t mqfile_size);
 
+// Opens a queue file using the provided options (options->file_size must be set).
+bool   PERSIMQ_open_with_options(T_PERSIMQ* mq, char* mqfile_path, const T_PERSIMQ_Options* options);
+
+// Fills the options struct with the default values.
+void   PERSIMQ_options_init(T_PERSIMQ_Options* options);
+
+// Loads options from a text file. Only the options present in the file are changed.
+// Lines have "key = value" format, everything after '#' is a comment.
+bool   PERSIMQ_options_load(T_PERSIMQ_Options* options, char* options_path);
+
+// Saves all the options to a text file (an optional comment is put at the top of the file).
+bool   PERSIMQ_options_save(const T_PERSIMQ_Options* options, char* options_path, const char* comment);
+
+// Opens a queue file for reading only. The file is not locked and nothing is ever
+// written to it so it is safe to watch a queue which is in use by another process.
+// The queue state is the one which has been last stored by PERSIMQ_sync() of the owner.
+bool   PERSIMQ_open_readonly(T_PERSIMQ* mq, char* mqfile_path);
+
+// Reloads the queue state of a read-only queue from the file header.
+bool   PERSIMQ_refresh(T_PERSIMQ* mq);
+
 // Checks if the queue is open.
 bool   PERSIMQ_is_open(T_PERSIMQ* mq);
 
@@ -63,6 +316,32 @@ bool   PERSIMQ_sync(T_PERSIMQ* mq);
 // Adds a message to the queue.
 bool   PERSIMQ_push(T_PERSIMQ* mq, void* message, size_t message_size);
 
+// Adds a message made of several parts (gathered from "part_count" buffers) to the queue.
+bool   PERSIMQ_pushv(T_PERSIMQ* mq, const struct iovec* parts, int part_count);
+
+// Adds a message to the queue. The key of the message is stored to "key" for PERSIMQ_cancel().
+// Keys of the consumed messages stay invalid after the file space has been reused.
+bool   PERSIMQ_push_keyed(T_PERSIMQ* mq, void* message, size_t message_size, off_t* key);
+
+// Cancels a pending message (see the "cancel_slots" option). The record stays in the file and is
+// skipped by the consumer: PERSIMQ_get(), PERSIMQ_get_all() and PERSIMQ_pop() never see it.
+// It is still counted by PERSIMQ_messages_available() until the consumer gets to it, cursors and
+// readers walk it as usual. Do not cancel messages while a transaction is using the queue.
+bool   PERSIMQ_cancel(T_PERSIMQ* mq, off_t key);
+
+// Prepares a bulk ingest of a length prefixed message stream. The buffer is at least big enough
+// for the longest message. Set the max_messages/max_bytes fields to limit every call.
+bool   PERSIMQ_ingest_init(T_PERSIMQ_Ingest* ingest, T_PERSIMQ_Framing framing, uint32_t max_message_size,
+    size_t buffer_size);
+
+// Reads messages from "in_fd" and adds them to the queue until the end of the stream, a limit, a full
+// queue or (for non-blocking descriptors) until there is no more data. The stream is read in big chunks
+// and the messages are written in batches of a single system call each. Returns "false" on errors.
+bool   PERSIMQ_ingest_from_fd(T_PERSIMQ* mq, int in_fd, T_PERSIMQ_Ingest* ingest);
+
+// Releases the ingest buffer (a partially received message is dropped).
+void   PERSIMQ_ingest_free(T_PERSIMQ_Ingest* ingest);
+
 // Removes the first message from a queue (if available).
 bool   PERSIMQ_pop(T_PERSIMQ* mq);
 
@@ -73,22 +352,204 @@ bool   PERSIMQ_pop_n(T_PERSIMQ* mq, uint64_t pop_count);
 // Reads the first message from a queue (if available).
 bool   PERSIMQ_get(T_PERSIMQ* mq, void* buffer, size_t buffer_size, size_t* message_size);
 
+// Writes the payload of the first message of a queue to "out_fd" (a file, a pipe or a socket).
+// Payloads in the blob file are moved by the kernel with sendfile() and their CRC is not checked.
+bool   PERSIMQ_get_to_fd(T_PERSIMQ* mq, int out_fd, size_t* message_size);
+
+// Reads the "index"-th newest message of a queue (0 - the last pushed one) without walking the queue
+// (see the "tail_index" option). The first call after opening the queue builds the index.
+bool   PERSIMQ_get_newest(T_PERSIMQ* mq, uint64_t index, void* buffer, size_t buffer_size, size_t* message_size);
+
+// Ruturns the amount of the newest messages which can be read with PERSIMQ_get_newest().
+off_t  PERSIMQ_newest_available(T_PERSIMQ* mq);
+
 // Reads all the messages from a queue (up to the "messages_limit" and up to the buffer size).
 bool   PERSIMQ_get_all(T_PERSIMQ* mq, void* buffer, size_t buffer_size, uint64_t max_messages,
 					  size_t* total_size, uint64_t* messages_read);
 
+// Prepares a cursor for walking "length" queue bytes starting from the record at "offset".
+// Pass mq->extract_ptr and mq->count_bytes to walk all the messages in the queue.
+// The staged burst (see the "burst_size" option) of a queue open for writing is written first.
+bool   PERSIMQ_cursor_init(T_PERSIMQ_Cursor* cursor, T_PERSIMQ* mq, size_t chunk_size,
+						   off_t offset, off_t length);
+
+// Returns the next message of a cursor. The message pointer stays valid until the next call.
+// "false" is returned at the end of the range or on errors (cursor->error is set in this case).
+// The message pointer has the same alignment (up to PERSIMQ_MAX_PAYLOAD_ALIGNMENT) as the message
+// in the file so the payloads of a queue with "payload_alignment" set can be accessed in place
+// (except for the messages split around the end of the file).
+bool   PERSIMQ_cursor_next(T_PERSIMQ_Cursor* cursor, const void** message, size_t* message_size);
+
+// Releases the cursor buffer.
+void   PERSIMQ_cursor_free(T_PERSIMQ_Cursor* cursor);
+
+// Ruturns the distance in queue bytes from "from_offset" to "to_offset" going forward.
+off_t  PERSIMQ_distance(T_PERSIMQ* mq, off_t from_offset, off_t to_offset);
+
 // Checks if there are any messages left in the queue.
 bool   PERSIMQ_is_empty(T_PERSIMQ* mq);
 
 // Ruturns the amount of messages left in the queue.
 off_t  PERSIMQ_messages_available(T_PERSIMQ* mq);
 
-// Ruturns the amount of data bytes stored in all messages left in the queue.
+// Ruturns the amount of data bytes stored in all messages left in the queue
+// (the payload alignment padding is counted too).
 size_t PERSIMQ_bytes_available(T_PERSIMQ* mq);
 
-// Ruturns the amount of free bytes in the queue.
+// Ruturns the amount of free bytes in the queue (the space held by concurrent readers is not free).
 size_t PERSIMQ_bytes_free(T_PERSIMQ* mq);
 
+// Burst mode hint: writes the messages kept in RAM now (for example when the radio is about
+// to transmit anyway). Does not sync, use PERSIMQ_sync() for that.
+bool   PERSIMQ_flush(T_PERSIMQ* mq);
+
+// Returns the burst mode statistics of a queue.
+bool   PERSIMQ_burst_stats(T_PERSIMQ* mq, T_PERSIMQ_BurstStats* stats);
+
+// Returns the root of the block hash tree of a queue (see the "hash_block_size" option).
+// Queues with equal roots have equal data sections.
+bool   PERSIMQ_hash_root(T_PERSIMQ* mq, uint64_t* root);
+
+// Finds the data blocks which differ between two queues with the same file size and
+// "hash_block_size". Up to "max_blocks" block offsets are stored to "offsets" (may be NULL).
+// Returns the amount of divergent blocks (-1 on errors). One of the queues may be opened by
+// PERSIMQ_open_readonly(): its tree is then kept in memory, the files are not written.
+int64_t PERSIMQ_hash_diff(T_PERSIMQ* a, T_PERSIMQ* b, off_t* offsets, uint64_t max_blocks);
+
+// Copies only the divergent data blocks and the queue state from "source" to "target"
+// and syncs the target. The source may be read-only (see PERSIMQ_hash_diff()).
+bool   PERSIMQ_hash_repair(T_PERSIMQ* target, T_PERSIMQ* source, uint64_t* copied_blocks);
+
+// Makes a consistent copy of a live queue file at "backup_path" (call it from the thread which
+// owns the queue). The file is cloned where the filesystem supports it (btrfs, XFS), elsewhere
+// only the header and the live messages are copied (the whole file if it has a block hash tree).
+// The side files (".blobs", ".state", ".hashes", ".cancel") are copied next to the backup the same
+// way. The backup is synced before returning. Fails while the queue is part of an open transaction.
+bool   PERSIMQ_backup(T_PERSIMQ* mq, const char* backup_path);
+
+// Compresses the older part of the backlog (the newest quarter stays raw) into LZ frames and
+// frees the saved space. Done at syncs by the "compress_watermark" option, may be called directly.
+// Nothing is done while readers are open.
+bool   PERSIMQ_compress_backlog(T_PERSIMQ* mq);
+
+// Opens (creates) a transaction log. The same log path must be set as the "tx_log_path" option
+// of all the queues used in the transactions so that they could be recovered when opened.
+bool   PERSIMQ_tx_open(T_PERSIMQ_Transaction* tx, char* log_path);
+
+// Stages a message push within a transaction.
+bool   PERSIMQ_tx_push(T_PERSIMQ_Transaction* tx, T_PERSIMQ* mq, void* message, size_t message_size);
+
+// Stages removal of the first message of a queue within a transaction (use PERSIMQ_get() to read it).
+bool   PERSIMQ_tx_pop(T_PERSIMQ_Transaction* tx, T_PERSIMQ* mq);
+
+// Makes all the staged operations durable at once. Do not call PERSIMQ_sync() on the queues
+// involved while a transaction is in progress.
+bool   PERSIMQ_tx_commit(T_PERSIMQ_Transaction* tx);
+
+// Rolls back all the staged operations.
+void   PERSIMQ_tx_abort(T_PERSIMQ_Transaction* tx);
+
+// Closes a transaction log (a transaction in progress is rolled back).
+bool   PERSIMQ_tx_close(T_PERSIMQ_Transaction* tx);
+
+// Opens a striped queue made of "count" queue files named "file_name" in the given directories.
+// Every stripe file gets the provided options. The same directories must be given in the same
+// order every time the striped queue is opened.
+bool   PERSIMQ_stripe_open(T_PERSIMQ_Stripe* smq, char** directories, unsigned count,
+						   char* file_name, const T_PERSIMQ_Options* options);
+
+// Writes all the changes and closes all the stripe files.
+bool   PERSIMQ_stripe_close(T_PERSIMQ_Stripe* smq);
+
+// Writes and syncs the changes of all the stripes in parallel.
+bool   PERSIMQ_stripe_sync(T_PERSIMQ_Stripe* smq);
+
+// Adds a message to the striped queue.
+bool   PERSIMQ_stripe_push(T_PERSIMQ_Stripe* smq, void* message, size_t message_size);
+
+// Reads the first message of the striped queue (if available).
+bool   PERSIMQ_stripe_get(T_PERSIMQ_Stripe* smq, void* buffer, size_t buffer_size, size_t* message_size);
+
+// Removes the first message of the striped queue (if available).
+bool   PERSIMQ_stripe_pop(T_PERSIMQ_Stripe* smq);
+
+// Checks if there are any messages left in the striped queue.
+bool   PERSIMQ_stripe_is_empty(T_PERSIMQ_Stripe* smq);
+
+// Ruturns the amount of messages left in the striped queue.
+off_t  PERSIMQ_stripe_messages_available(T_PERSIMQ_Stripe* smq);
+
+// Opens "count" queue files read-only for a merge. Every source is read in sequential chunks of
+// "chunk_size" bytes so the memory use does not depend on the queue sizes. Messages shorter than
+// the key field get the key 0. Equal keys are taken in the order of the sources.
+bool   PERSIMQ_merge_open(T_PERSIMQ_Merge* merge, char** paths, unsigned count, size_t chunk_size,
+    size_t key_offset, size_t key_size);
+
+// Returns the next message of the merged stream ("false" at the end or on errors, see merge->error).
+// The message pointer stays valid until the next call. "source" (may be NULL) gets the source index.
+bool   PERSIMQ_merge_next(T_PERSIMQ_Merge* merge, const void** message, size_t* message_size, unsigned* source);
+
+// Closes all the source queue files of a merge.
+void   PERSIMQ_merge_close(T_PERSIMQ_Merge* merge);
+
+// Attaches a concurrent reader to a queue, the reader starts at the first message of the queue.
+// The space of the messages a reader may still be looking at is not reused by the producer
+// (see PERSIMQ_bytes_free()). Readers must be closed before the queue is closed.
+bool   PERSIMQ_reader_open(T_PERSIMQ_Reader* reader, T_PERSIMQ* mq, size_t chunk_size);
+
+// Returns the next message for a reader ("false" if there are no new messages or on errors).
+// The message pointer stays valid until the next call. A reader which falls behind the consumer
+// continues from the first message of the queue.
+bool   PERSIMQ_reader_next(T_PERSIMQ_Reader* reader, const void** message, size_t* message_size);
+
+// Detaches a reader from the queue and releases its buffer.
+void   PERSIMQ_reader_close(T_PERSIMQ_Reader* reader);
+
+// Prepares a real-time producer ring of at least "ring_size" bytes for a queue. The ring memory is
+// allocated, touched and locked in RAM here so that the producer never faults or allocates.
+bool   PERSIMQ_rt_init(T_PERSIMQ_RtRing* ring, T_PERSIMQ* mq, size_t ring_size);
+
+// Real-time safe push: copies the message to the ring and returns in bounded time without any
+// syscalls or locks. "false" is returned at once if the ring is full (ring->overflows is counted).
+// Only one thread may push to a ring.
+bool   PERSIMQ_rt_push(T_PERSIMQ_RtRing* ring, const void* message, size_t message_size);
+
+// Moves up to "max_messages" messages (0 - all) from the ring to the queue. To be called by a
+// single non real-time I/O thread. The amount of moved messages is stored to "drained".
+bool   PERSIMQ_rt_drain(T_PERSIMQ_RtRing* ring, uint64_t max_messages, uint64_t* drained);
+
+// Releases the ring memory (drain the ring first to keep its messages).
+void   PERSIMQ_rt_free(T_PERSIMQ_RtRing* ring);
+
+// Sets the process-wide stall handler (NULL - the stalls are only printed as warnings).
+void   PERSIMQ_set_stall_handler(T_PERSIMQ_StallHandler handler, void* user_data);
+
+// Returns the stall detector statistics of a queue.
+bool   PERSIMQ_stall_stats(T_PERSIMQ* mq, T_PERSIMQ_StallStats* stats);
+
+// Sets the process-wide simulated storage device (NULL - none). Every queue file operation is
+// done as usual and then delayed by the modelled device cost, the stall detector sees the delays.
+// Must be set before the queues are opened.
+void   PERSIMQ_set_device_model(const T_PERSIMQ_DeviceModel* model);
+
+// Loads a device model from a text file of "field = value" lines (the T_PERSIMQ_DeviceModel
+// field names, missing fields are left unchanged).
+bool   PERSIMQ_device_model_load(T_PERSIMQ_DeviceModel* model, const char* model_path);
+
+// Sets the process-wide memory budget for the caches and buffers of all queues (0 - unlimited).
+// When the budget is reached the caches of the least recently used queues get released and
+// the queues which can not get memory work without caching. The tables the queue options need
+// (dedup, tail_index, cancel_slots, the hash tree bitmap, the decompressed frame) count against
+// the budget but are never refused. Not counted: the cursor, reader and ingest buffers (owned by
+// the caller) and the mapped "<queue file>.hashes" files (page cache).
+void   PERSIMQ_set_memory_budget(size_t budget_bytes);
+
+// Returns the library memory usage statistics.
+void   PERSIMQ_memory_stats(T_PERSIMQ_MemoryStats* stats);
+
+// Ruturns the amount of memory used by a queue (see PERSIMQ_set_memory_budget()).
+size_t PERSIMQ_memory_used(T_PERSIMQ* mq);
+
 // Changes the amount of debug messages to be put out by the library (PERSIMQ_ERRORS_ONLY is the default).
 void   PERSIMQ_set_debug_verbosity(T_PERSIMQ_DebugVerbosityLevel verbosity);
 
@@ -0,0 +1,851 @@
+// ---------------------------------------------------------------------------
+// persimq_bench - concurrency scalability benchmark for PERSIMQ queues.
+// Sweeps the amount of threads for every concurrency mode and message size,
+// pins the threads to cores and collects hardware performance counters
+// (when available) to show where the cycles go per delivered message.
+// The soak mode runs long fill/drain cycles and tracks the trends instead.
+// ---------------------------------------------------------------------------
+#define _GNU_SOURCE   // pthread_setaffinity_np()
+#include <stdint.h>
+#include <inttypes.h> // printf() definitions for stdint
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "persimq.h"
+
+const char APP_VERSION[] = "1.0";
+
+#define BENCH_FILE_PREFIX  ".persimq_bench"
+#define BATCH_SIZE         (64)          // Messages pushed before they are consumed
+#define MAX_THREADS        (64)
+#define MAX_SIZES          (16)
+#define MAX_MESSAGE_SIZE   (1024*1024)
+
+// Concurrency modes
+typedef enum {
+    MODE_QUEUES = 0,  // Every thread works with a queue of its own
+    MODE_SHARED,      // Producer threads and a consumer thread share a single mutex guarded queue
+    MODE_STRIPE,      // Single producer/consumer, threads are the stripes synced in parallel
+    MODE_COUNT
+} T_Mode;
+
+static const char* mode_names[MODE_COUNT] = { "queues", "shared", "stripe" };
+
+// Performance counters collected for every thread
+typedef enum {
+    COUNTER_CYCLES = 0,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CACHE_MISSES,
+    COUNTER_CONTEXT_SWITCHES,
+    COUNTER_COUNT
+} T_Counter;
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} counter_events[COUNTER_COUNT] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES }
+};
+
+typedef struct {
+    int fd[COUNTER_COUNT];
+    bool ok[COUNTER_COUNT];
+    uint64_t value[COUNTER_COUNT];
+} T_Counters;
+
+typedef struct {
+    int index;
+    T_Mode mode;
+    int threads;
+    size_t message_size;
+    uint64_t messages;        // Messages to deliver
+    bool ok;
+    T_Counters counters;
+} T_Worker;
+
+static char directory[255] = ".";
+static char options_path[255] = "";
+static char csv_path[255] = "";
+static char device_path[255] = "";
+static int max_threads = 0;
+static uint64_t messages_per_thread = 100000;
+static size_t sizes[MAX_SIZES] = { 16, 256, 4096 };
+static int size_count = 3;
+static int selected_mode = -1;  // All the modes
+static bool pin_threads = true;
+static int cpu_count = 1;
+static T_PERSIMQ_Options options;
+
+// Shared mode state
+static T_PERSIMQ shared_mq;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t start_barrier;
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// --- Performance counters ---
+// Counters are opened for the calling thread (and the threads it creates later). A counter
+// which can not be opened (no PMU, perf_event_paranoid, containers) is just reported as n/a.
+
+static void counters_open(T_Counters* counters)
+{
+    for (int idx = 0; idx < COUNTER_COUNT; idx++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counter_events[idx].type;
+        attr.config = counter_events[idx].config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_hv = 1;
+        counters->fd[idx] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters->fd[idx] < 0) { // Retry for the user space only
+            attr.exclude_kernel = 1;
+            counters->fd[idx] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+        counters->ok[idx] = false;
+        counters->value[idx] = 0;
+    }
+}
+
+static void counters_start(T_Counters* counters)
+{
+    for (int idx = 0; idx < COUNTER_COUNT; idx++) {
+        if (counters->fd[idx] < 0) continue;
+        ioctl(counters->fd[idx], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->fd[idx], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static void counters_stop(T_Counters* counters)
+{
+    for (int idx = 0; idx < COUNTER_COUNT; idx++) {
+        if (counters->fd[idx] < 0) continue;
+        ioctl(counters->fd[idx], PERF_EVENT_IOC_DISABLE, 0);
+        counters->ok[idx] = (read(counters->fd[idx], &counters->value[idx], sizeof(uint64_t)) == sizeof(uint64_t));
+    }
+}
+
+static void counters_close(T_Counters* counters)
+{
+    for (int idx = 0; idx < COUNTER_COUNT; idx++) {
+        if (counters->fd[idx] >= 0) close(counters->fd[idx]);
+        counters->fd[idx] = -1;
+    }
+}
+
+// --- Workers ---
+
+static void pin_thread(int index)
+{
+    if (!pin_threads) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % cpu_count, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void queue_path(char* path, size_t path_size, T_Mode mode, int index)
+{
+    snprintf(path, path_size, "%s/%s.%s.%d", directory, BENCH_FILE_PREFIX, mode_names[mode], index);
+}
+
+// Pushes a batch, then reads and removes it. Returns false on errors.
+static bool run_batches(T_PERSIMQ* mq, uint8_t* message, uint8_t* buffer, size_t message_size, uint64_t messages)
+{
+    size_t read_size;
+    while (messages) {
+        uint64_t batch = (messages < BATCH_SIZE) ? messages : BATCH_SIZE;
+        for (uint64_t i = 0; i < batch; i++) {
+            if (!PERSIMQ_push(mq, message, message_size)) return false;
+        }
+        for (uint64_t i = 0; i < batch; i++) {
+            if (!PERSIMQ_get(mq, buffer, message_size, &read_size) || !PERSIMQ_pop(mq)) return false;
+        }
+        messages -= batch;
+    }
+    return true;
+}
+
+static void worker_queue(T_Worker* worker, uint8_t* message, uint8_t* buffer)
+{
+    char path[512];
+    T_PERSIMQ mq;
+    queue_path(path, sizeof(path), MODE_QUEUES, worker->index);
+    bool opened = PERSIMQ_open_with_options(&mq, path, &options) && PERSIMQ_clear(&mq);
+    pthread_barrier_wait(&start_barrier);
+    if (!opened) return;
+    counters_start(&worker->counters);
+    worker->ok = run_batches(&mq, message, buffer, worker->message_size, worker->messages);
+    counters_stop(&worker->counters);
+    PERSIMQ_close(&mq);
+    unlink(path);
+}
+
+// Shared mode: the last worker is the consumer, all the others are producers.
+static void worker_shared(T_Worker* worker, uint8_t* message, uint8_t* buffer)
+{
+    bool consumer = (worker->index == worker->threads);
+    uint64_t done = 0;
+    size_t read_size;
+    pthread_barrier_wait(&start_barrier);
+    counters_start(&worker->counters);
+    worker->ok = true;
+    while (worker->ok && (done < worker->messages)) {
+        bool idle = false;
+        pthread_mutex_lock(&shared_lock);
+        if (consumer) {
+            for (int i = 0; (i < BATCH_SIZE) && (done < worker->messages); i++) {
+                if (PERSIMQ_is_empty(&shared_mq)) {
+                    idle = true;
+                    break;
+                }
+                worker->ok = PERSIMQ_get(&shared_mq, buffer, worker->message_size, &read_size) &&
+                    PERSIMQ_pop(&shared_mq);
+                if (!worker->ok) break;
+                done++;
+            }
+        } else if (PERSIMQ_bytes_free(&shared_mq) >= (worker->message_size + 64)) {
+            worker->ok = PERSIMQ_push(&shared_mq, message, worker->message_size);
+            done++;
+        } else {
+            idle = true;
+        }
+        pthread_mutex_unlock(&shared_lock);
+        if (idle) sched_yield();
+    }
+    counters_stop(&worker->counters);
+}
+
+// Stripe mode: a single thread works with a queue striped over "threads" files
+// which are synced in parallel every options.sync_interval messages.
+static void worker_stripe(T_Worker* worker, uint8_t* message, uint8_t* buffer)
+{
+    char* directories[PERSIMQ_STRIPE_MAX_QUEUES];
+    char paths[PERSIMQ_STRIPE_MAX_QUEUES][512];
+    char file_name[64];
+    T_PERSIMQ_Stripe smq;
+    T_PERSIMQ_Options stripe_options = options;
+    stripe_options.sync_interval = 0; // Synced for all the stripes at once
+    for (int idx = 0; idx < worker->threads; idx++) {
+        queue_path(paths[idx], sizeof(paths[idx]), MODE_STRIPE, idx);
+        mkdir(paths[idx], S_IRWXU);
+        directories[idx] = paths[idx];
+    }
+    snprintf(file_name, sizeof(file_name), "%s.queue", BENCH_FILE_PREFIX);
+    bool opened = PERSIMQ_stripe_open(&smq, directories, worker->threads, file_name, &stripe_options);
+    pthread_barrier_wait(&start_barrier);
+    if (!opened) return;
+    counters_start(&worker->counters);
+    uint64_t left = worker->messages;
+    uint64_t since_sync = 0;
+    size_t read_size;
+    worker->ok = true;
+    while (worker->ok && left) {
+        uint64_t batch = (left < BATCH_SIZE) ? left : BATCH_SIZE;
+        for (uint64_t i = 0; worker->ok && (i < batch); i++) {
+            worker->ok = PERSIMQ_stripe_push(&smq, message, worker->message_size);
+            if (options.sync_interval && (++since_sync >= options.sync_interval)) {
+                worker->ok &= PERSIMQ_stripe_sync(&smq);
+                since_sync = 0;
+            }
+        }
+        for (uint64_t i = 0; worker->ok && (i < batch); i++) {
+            worker->ok = PERSIMQ_stripe_get(&smq, buffer, worker->message_size, &read_size) &&
+                PERSIMQ_stripe_pop(&smq);
+        }
+        left -= batch;
+    }
+    counters_stop(&worker->counters);
+    PERSIMQ_stripe_close(&smq);
+    for (int idx = 0; idx < worker->threads; idx++) {
+        char path[600];
+        snprintf(path, sizeof(path), "%s/%s", paths[idx], file_name);
+        unlink(path);
+        rmdir(paths[idx]);
+    }
+}
+
+static void* worker_main(void* arg)
+{
+    T_Worker* worker = arg;
+    uint8_t* message = malloc(worker->message_size);
+    uint8_t* buffer = malloc(worker->message_size);
+    worker->ok = false;
+    pin_thread(worker->index);
+    counters_open(&worker->counters);
+    if (!message || !buffer) {
+        pthread_barrier_wait(&start_barrier);
+    } else {
+        memset(message, 0x5A, worker->message_size);
+        switch (worker->mode) {
+            case MODE_QUEUES: worker_queue(worker, message, buffer); break;
+            case MODE_SHARED: worker_shared(worker, message, buffer); break;
+            default:          worker_stripe(worker, message, buffer); break;
+        }
+    }
+    counters_close(&worker->counters);
+    free(message);
+    free(buffer);
+    return NULL;
+}
+
+// --- Reports ---
+
+typedef struct {
+    T_Mode mode;
+    size_t message_size;
+    int threads;
+    double seconds;
+    uint64_t messages;
+    double rate;             // Delivered messages per second
+    double scaling;          // Rate relative to a single thread
+    bool counter_ok[COUNTER_COUNT];
+    double per_message[COUNTER_COUNT];
+} T_Result;
+
+static void print_header(void)
+{
+    printf("%-7s %7s %7s %12s %9s %7s %10s %10s %6s %10s %10s\n",
+        "mode", "size", "threads", "msg/s", "MB/s", "scale",
+        "cycles/m", "instr/m", "IPC", "misses/m", "ctxsw/m");
+}
+
+static void print_counter(bool ok, double value, const char* format)
+{
+    if (ok) printf(format, value);
+    else printf(" %10s", "n/a");
+}
+
+static void print_result(T_Result* result)
+{
+    printf("%-7s %7zu %7d %12.0f %9.1f %7.2f", mode_names[result->mode], result->message_size,
+        result->threads, result->rate, result->rate * result->message_size / 1e6, result->scaling);
+    print_counter(result->counter_ok[COUNTER_CYCLES], result->per_message[COUNTER_CYCLES], " %10.0f");
+    print_counter(result->counter_ok[COUNTER_INSTRUCTIONS], result->per_message[COUNTER_INSTRUCTIONS], " %10.0f");
+    bool ipc_ok = result->counter_ok[COUNTER_CYCLES] && result->counter_ok[COUNTER_INSTRUCTIONS] &&
+        (result->per_message[COUNTER_CYCLES] > 0);
+    if (ipc_ok) printf(" %6.2f", result->per_message[COUNTER_INSTRUCTIONS] / result->per_message[COUNTER_CYCLES]);
+    else printf(" %6s", "n/a");
+    print_counter(result->counter_ok[COUNTER_CACHE_MISSES], result->per_message[COUNTER_CACHE_MISSES], " %10.2f");
+    print_counter(result->counter_ok[COUNTER_CONTEXT_SWITCHES], result->per_message[COUNTER_CONTEXT_SWITCHES], " %10.4f");
+    printf("\n");
+    fflush(stdout);
+}
+
+static void write_csv(FILE* csv, T_Result* result)
+{
+    fprintf(csv, "%s,%zu,%d,%" PRIu64 ",%.6f,%.1f,%.3f", mode_names[result->mode], result->message_size,
+        result->threads, result->messages, result->seconds, result->rate, result->scaling);
+    for (int idx = 0; idx < COUNTER_COUNT; idx++) {
+        if (result->counter_ok[idx]) fprintf(csv, ",%.4f", result->per_message[idx]);
+        else fprintf(csv, ",");
+    }
+    fprintf(csv, "\n");
+}
+
+// Runs a single benchmark point.
+static bool run_point(T_Mode mode, size_t message_size, int threads, T_Result* result)
+{
+    T_Worker workers[MAX_THREADS + 1];
+    pthread_t handles[MAX_THREADS + 1];
+    int worker_count = (mode == MODE_QUEUES) ? threads : ((mode == MODE_SHARED) ? (threads + 1) : 1);
+    char path[512];
+    if (mode == MODE_SHARED) {
+        queue_path(path, sizeof(path), mode, 0);
+        if (!PERSIMQ_open_with_options(&shared_mq, path, &options)) return false;
+        PERSIMQ_clear(&shared_mq);
+    }
+    pthread_barrier_init(&start_barrier, NULL, worker_count + 1);
+    int started = 0;
+    for (int idx = 0; idx < worker_count; idx++) {
+        workers[idx].index = idx;
+        workers[idx].mode = mode;
+        workers[idx].threads = threads;
+        workers[idx].message_size = message_size;
+        // Every producer delivers its share, the shared mode consumer takes all of them
+        workers[idx].messages = ((mode == MODE_SHARED) && (idx == threads)) ?
+            messages_per_thread * threads : messages_per_thread;
+        if (pthread_create(&handles[idx], NULL, worker_main, &workers[idx])) break;
+        started++;
+    }
+    if (started < worker_count) {
+        fprintf(stderr, "Unable to start %d threads!\n", worker_count);
+        exit(EXIT_FAILURE);
+    }
+    pthread_barrier_wait(&start_barrier);
+    double start = now_s();
+    for (int idx = 0; idx < worker_count; idx++) pthread_join(handles[idx], NULL);
+    double seconds = now_s() - start;
+    pthread_barrier_destroy(&start_barrier);
+    if (mode == MODE_SHARED) {
+        PERSIMQ_close(&shared_mq);
+        unlink(path);
+    }
+
+    memset(result, 0, sizeof(*result));
+    result->mode = mode;
+    result->message_size = message_size;
+    result->threads = threads;
+    result->seconds = seconds;
+    result->messages = messages_per_thread * ((mode == MODE_STRIPE) ? 1 : threads);
+    result->rate = result->messages / seconds;
+    bool ok = true;
+    for (int idx = 0; idx < COUNTER_COUNT; idx++) result->counter_ok[idx] = true;
+    for (int idx = 0; idx < worker_count; idx++) {
+        ok &= workers[idx].ok;
+        for (int counter = 0; counter < COUNTER_COUNT; counter++) {
+            result->counter_ok[counter] &= workers[idx].counters.ok[counter];
+            result->per_message[counter] += workers[idx].counters.value[counter];
+        }
+    }
+    for (int counter = 0; counter < COUNTER_COUNT; counter++) result->per_message[counter] /= result->messages;
+    return ok;
+}
+
+// Parses a comma separated list of message sizes.
+static bool parse_sizes(const char* text)
+{
+    size_count = 0;
+    while (*text) {
+        char* end;
+        unsigned long size = strtoul(text, &end, 10);
+        if ((end == text) || (size < 1) || (size > MAX_MESSAGE_SIZE) || (size_count >= MAX_SIZES)) return false;
+        sizes[size_count++] = size;
+        text = end;
+        if (*text == ',') text++;
+        else if (*text) return false;
+    }
+    return size_count > 0;
+}
+
+// --- Soak ---
+// A single queue goes through cycles of an outage (the producer fills the queue while the
+// consumer is stopped) and a recovery (the consumer drains the backlog while the producer keeps
+// going). The queue is closed and opened again at every phase change. Every interval prints the
+// throughput, the latency percentiles and the drift of the queue counters from the amount of
+// messages the benchmark has pushed and popped, so slow degradation shows up as a trend.
+
+#define LATENCY_SUB_BUCKETS (8)   // Per power of two
+#define LATENCY_BUCKETS     (64 * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t max_ns;
+    uint64_t buckets[LATENCY_BUCKETS];
+} T_Latency;
+
+typedef enum {
+    PHASE_FILL = 0,
+    PHASE_DRAIN
+} T_Phase;
+
+static const char* phase_names[] = { "fill", "drain" };
+
+typedef struct {
+    T_PERSIMQ mq;
+    char path[512];
+    size_t message_size;
+    uint8_t* message;
+    uint8_t* buffer;
+    T_Phase phase;
+    uint64_t cycle;
+    uint64_t pushed;          // Totals since the start
+    uint64_t popped;
+    uint64_t errors;          // Failed operations and wrong messages
+    uint64_t full;            // Pushes refused because the queue was full
+    // Current interval
+    uint64_t interval_pushed;
+    uint64_t interval_popped;
+    double reopen_max_ms;
+    T_Latency push_latency;
+    T_Latency pop_latency;
+} T_Soak;
+
+static double soak_seconds = 0;   // 0 - run the concurrency sweep
+static double soak_rate = 0;      // Producer messages per second (0 - unlimited)
+static double soak_interval = 10;
+static int soak_fill = 90;        // Fill level (percent of the file) ending an outage
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Log-linear buckets: 8 per power of two, so the percentiles are within 12.5%.
+static void latency_add(T_Latency* latency, uint64_t ns)
+{
+    int bucket = ns;
+    if (ns >= LATENCY_SUB_BUCKETS) {
+        int log = 63 - __builtin_clzll(ns);
+        bucket = (log - 2) * LATENCY_SUB_BUCKETS + ((ns >> (log - 3)) & (LATENCY_SUB_BUCKETS - 1));
+    }
+    latency->buckets[bucket]++;
+    latency->count++;
+    if (ns > latency->max_ns) latency->max_ns = ns;
+}
+
+// Returns the upper bound of the bucket holding the given fraction of the samples (in microseconds).
+static double latency_percentile(const T_Latency* latency, double fraction)
+{
+    if (!latency->count) return 0;
+    uint64_t target = latency->count * fraction;
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += latency->buckets[bucket];
+        if (seen > target) {
+            if (bucket < LATENCY_SUB_BUCKETS) return (bucket + 1) / 1e3;
+            int log = bucket / LATENCY_SUB_BUCKETS + 2;
+            uint64_t upper = (1ull << log) + ((uint64_t)(bucket % LATENCY_SUB_BUCKETS + 1) << (log - 3));
+            return ((upper < latency->max_ns) ? upper : latency->max_ns) / 1e3;
+        }
+    }
+    return latency->max_ns / 1e3;
+}
+
+static bool soak_open(T_Soak* soak)
+{
+    uint64_t start = now_ns();
+    bool ok = PERSIMQ_open_with_options(&soak->mq, soak->path, &options);
+    double ms = (now_ns() - start) / 1e6;
+    if (ms > soak->reopen_max_ms) soak->reopen_max_ms = ms;
+    return ok;
+}
+
+// Returns the queue fill level in percent.
+static int soak_fill_level(T_Soak* soak)
+{
+    return 100 - (int)(PERSIMQ_bytes_free(&soak->mq) * 100 / soak->mq.file_size);
+}
+
+// Pushes the next message. The payload starts with the message sequence number.
+static bool soak_push(T_Soak* soak)
+{
+    memcpy(soak->message, &soak->pushed, sizeof(soak->pushed));
+    uint64_t start = now_ns();
+    bool ok = PERSIMQ_push(&soak->mq, soak->message, soak->message_size);
+    latency_add(&soak->push_latency, now_ns() - start);
+    if (ok) {
+        soak->pushed++;
+        soak->interval_pushed++;
+    }
+    return ok;
+}
+
+// Reads and removes the next message and checks its sequence number.
+static bool soak_pop(T_Soak* soak)
+{
+    size_t read_size;
+    uint64_t sequence;
+    uint64_t start = now_ns();
+    bool ok = PERSIMQ_get(&soak->mq, soak->buffer, soak->message_size, &read_size) && PERSIMQ_pop(&soak->mq);
+    latency_add(&soak->pop_latency, now_ns() - start);
+    if (!ok) {
+        soak->errors++;
+        return false;
+    }
+    memcpy(&sequence, soak->buffer, sizeof(sequence));
+    if ((read_size != soak->message_size) || (sequence != soak->popped)) soak->errors++;
+    soak->popped++;
+    soak->interval_popped++;
+    return true;
+}
+
+static void soak_print_header(void)
+{
+    printf("%8s %6s %5s %4s %10s %10s %9s %9s %9s %9s %9s %9s %8s %6s %8s %6s\n",
+        "time_s", "cycle", "phase", "fill", "push/s", "pop/s", "push_p50", "push_p99", "push_max",
+        "pop_p50", "pop_p99", "pop_max", "reopen", "drift", "bytes", "errors");
+}
+
+// Prints (and writes to the CSV file) the statistics of an interval and starts a new one.
+static void soak_report(T_Soak* soak, double elapsed, double seconds, FILE* csv)
+{
+    // The queue counters must match what has been pushed and popped
+    int64_t drift = (int64_t)PERSIMQ_messages_available(&soak->mq) - (int64_t)(soak->pushed - soak->popped);
+    int64_t bytes_drift = (int64_t)PERSIMQ_bytes_available(&soak->mq) -
+        (int64_t)((soak->pushed - soak->popped) * soak->message_size);
+    double values[] = {
+        soak->interval_pushed / seconds, soak->interval_popped / seconds,
+        latency_percentile(&soak->push_latency, 0.5), latency_percentile(&soak->push_latency, 0.99),
+        soak->push_latency.max_ns / 1e3,
+        latency_percentile(&soak->pop_latency, 0.5), latency_percentile(&soak->pop_latency, 0.99),
+        soak->pop_latency.max_ns / 1e3
+    };
+    printf("%8.0f %6" PRIu64 " %5s %3d%% %10.0f %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %8.2f %6" PRId64
+        " %8" PRId64 " %6" PRIu64 "\n", elapsed, soak->cycle, phase_names[soak->phase], soak_fill_level(soak),
+        values[0], values[1], values[2], values[3], values[4], values[5], values[6], values[7],
+        soak->reopen_max_ms, drift, bytes_drift, soak->errors);
+    fflush(stdout);
+    if (csv) {
+        fprintf(csv, "%.3f,%" PRIu64 ",%s,%d", elapsed, soak->cycle, phase_names[soak->phase], soak_fill_level(soak));
+        for (size_t idx = 0; idx < sizeof(values) / sizeof(values[0]); idx++) fprintf(csv, ",%.3f", values[idx]);
+        fprintf(csv, ",%.3f,%" PRId64 ",%" PRId64 ",%" PRIu64 ",%" PRIu64 "\n", soak->reopen_max_ms, drift,
+            bytes_drift, soak->errors, soak->full);
+    }
+    soak->interval_pushed = soak->interval_popped = 0;
+    soak->reopen_max_ms = 0;
+    memset(&soak->push_latency, 0, sizeof(soak->push_latency));
+    memset(&soak->pop_latency, 0, sizeof(soak->pop_latency));
+}
+
+// Runs the soak benchmark.
+static bool run_soak(FILE* csv)
+{
+    T_Soak soak;
+    memset(&soak, 0, sizeof(soak));
+    snprintf(soak.path, sizeof(soak.path), "%s/%s.soak", directory, BENCH_FILE_PREFIX);
+    soak.message_size = (sizes[0] < sizeof(uint64_t)) ? sizeof(uint64_t) : sizes[0];
+    soak.message = malloc(soak.message_size);
+    soak.buffer = malloc(soak.message_size);
+    if (!soak.message || !soak.buffer || !soak_open(&soak) || !PERSIMQ_clear(&soak.mq)) {
+        fprintf(stderr, "Can not open the soak queue file!\n");
+        free(soak.message);
+        free(soak.buffer);
+        return false;
+    }
+    memset(soak.message, 0x5A, soak.message_size);
+    char rate[32] = "unlimited";
+    if (soak_rate) snprintf(rate, sizeof(rate), "%.0f msg/s", soak_rate);
+    printf("--- Soak \"%s\": %.0f s, %zu byte messages, producer %s, outage until %d%% full ---\n",
+        soak.path, soak_seconds, soak.message_size, rate, soak_fill);
+    printf("Latencies in us, reopen in ms, drift - queue counters minus the benchmark counters\n");
+    printf("(compressed backlogs, see \"compress_watermark\", make the byte count lower).\n");
+    soak_print_header();
+    if (csv) {
+        fprintf(csv, "time,cycle,phase,fill,push_rate,pop_rate,push_p50,push_p99,push_max,pop_p50,pop_p99,pop_max,"
+            "reopen_ms,drift,bytes_drift,errors,full\n");
+    }
+
+    uint64_t start = now_ns();
+    uint64_t interval_start = start;
+    uint64_t produced_base = 0;  // Producer schedule: messages due since "schedule_start"
+    uint64_t schedule_start = start;
+    bool ok = true;
+    while (ok) {
+        uint64_t now = now_ns();
+        if ((now - interval_start) >= soak_interval * 1e9) {
+            soak_report(&soak, (now - start) / 1e9, (now - interval_start) / 1e9, csv);
+            interval_start = now;
+            if ((now - start) >= soak_seconds * 1e9) break;
+        }
+        bool push_due = !soak_rate || ((soak.pushed - produced_base) < ((now - schedule_start) / 1e9 * soak_rate));
+        bool phase_done = false;
+        if (push_due && !soak_push(&soak)) {
+            soak.full++;
+            phase_done = (soak.phase == PHASE_FILL);
+        }
+        if (soak.phase == PHASE_FILL) {
+            phase_done |= (soak_fill_level(&soak) >= soak_fill);
+            if (!push_due && !phase_done) {
+                struct timespec pause = { 0, 100000 };
+                nanosleep(&pause, NULL);
+            }
+        } else { // The consumer catches up at twice the producer rate
+            for (int idx = 0; ok && (idx < 2) && !PERSIMQ_is_empty(&soak.mq); idx++) ok = soak_pop(&soak);
+            phase_done = PERSIMQ_is_empty(&soak.mq);
+        }
+        if (ok && phase_done) { // Restart at every phase change
+            ok = PERSIMQ_close(&soak.mq) && soak_open(&soak);
+            if (soak.phase == PHASE_DRAIN) soak.cycle++;
+            soak.phase = (soak.phase == PHASE_FILL) ? PHASE_DRAIN : PHASE_FILL;
+        }
+        if (!ok) {
+            now = now_ns();
+            soak_report(&soak, (now - start) / 1e9, (now - interval_start) / 1e9, csv);
+        }
+        // The schedule is kept from drifting by long stalls (a stalled producer does not catch up)
+        if (soak_rate && ((soak.pushed - produced_base) + soak_rate < ((now - schedule_start) / 1e9 * soak_rate))) {
+            produced_base = soak.pushed;
+            schedule_start = now;
+        }
+    }
+    printf("--- %" PRIu64 " cycles, %" PRIu64 " messages pushed, %" PRIu64 " popped, %" PRIu64
+        " errors, %" PRIu64 " pushes refused ---\n", soak.cycle, soak.pushed, soak.popped, soak.errors, soak.full);
+    PERSIMQ_close(&soak.mq);
+    unlink(soak.path);
+    free(soak.message);
+    free(soak.buffer);
+    return ok && !soak.errors;
+}
+
+int main(int argc, char *argv[])
+{
+    // - Check for parameters -
+    while (--argc > 0) {
+        if (!strcmp(argv[argc], "-v") || !strcmp(argv[argc], "-V")) {
+            printf("libpersimq concurrency benchmark.\n");
+            printf("Version: %s\n", APP_VERSION);
+            return EXIT_SUCCESS;
+        } else if (!strcmp(argv[argc], "-h") || !strcmp(argv[argc], "-H") || !strcmp(argv[argc], "-?")) {
+            printf("persimq bench %s - concurrency scalability benchmark for libpersimq queues.\n", APP_VERSION);
+            printf("Sweeps the thread count (1, 2, 4... up to the limit) for every mode and message size.\n");
+            printf("Modes: queues - a queue per thread, shared - producer threads and a consumer sharing\n");
+            printf("       a mutex guarded queue, stripe - a striped queue with a stripe per thread.\n");
+            printf("Available options:\n");
+            printf("-d<dir>     : directory for the queue files (default: current directory)\n");
+            printf("-f<file>    : queue options file (see persimq_probe)\n");
+            printf("-m<mode>    : run a single mode only (queues, shared or stripe)\n");
+            printf("-t<count>   : maximum amount of threads (default: amount of CPUs)\n");
+            printf("-s<sizes>   : comma separated message sizes (default: 16,256,4096)\n");
+            printf("-n<count>   : messages per thread (default: 100000)\n");
+            printf("-c<file>    : also write the results to a CSV file\n");
+            printf("-D<file>    : simulate a slow storage device described by a device model file\n");
+            printf("              (T_PERSIMQ_DeviceModel fields as \"field = value\" lines)\n");
+            printf("-u          : do not pin the threads to CPUs\n");
+            printf("-S<seconds> : run the soak benchmark instead: cycles of filling the queue (consumer stopped)\n");
+            printf("              and draining it (producer running) with the first message size\n");
+            printf("-r<rate>    : soak producer rate in messages per second (default: unlimited)\n");
+            printf("-i<seconds> : soak report interval (default: 10)\n");
+            printf("-F<percent> : soak fill level ending the filling (default: 90)\n");
+            printf("-h or -H or -?   : show this text\n");
+            return EXIT_SUCCESS;
+        } else if (!strcmp(argv[argc], "-u")) {
+            pin_threads = false;
+        } else if (!strncmp(argv[argc], "-m", 2)) {
+            for (int mode = 0; mode < MODE_COUNT; mode++) {
+                if (!strcmp(&argv[argc][2], mode_names[mode])) selected_mode = mode;
+            }
+            if (selected_mode < 0) {
+                fprintf(stderr, "Incorrect -m parameter!\n");
+                return EXIT_FAILURE;
+            }
+        } else if (!strncmp(argv[argc], "-t", 2)) {
+            if ((sscanf(&argv[argc][2], "%d", &max_threads) != 1) || (max_threads < 1) || (max_threads > MAX_THREADS)) {
+                fprintf(stderr, "Incorrect -t parameter!\n");
+                return EXIT_FAILURE;
+            }
+        } else if (!strncmp(argv[argc], "-n", 2)) {
+            if ((sscanf(&argv[argc][2], "%" SCNu64, &messages_per_thread) != 1) || (messages_per_thread < 1)) {
+                fprintf(stderr, "Incorrect -n parameter!\n");
+                return EXIT_FAILURE;
+            }
+        } else if (!strncmp(argv[argc], "-S", 2) || !strncmp(argv[argc], "-r", 2) || !strncmp(argv[argc], "-i", 2)) {
+            double* target = (argv[argc][1] == 'S') ? &soak_seconds : ((argv[argc][1] == 'r') ? &soak_rate : &soak_interval);
+            if ((sscanf(&argv[argc][2], "%lf", target) != 1) || (*target < 0) || ((argv[argc][1] != 'r') && !*target)) {
+                fprintf(stderr, "Incorrect %.2s parameter!\n", argv[argc]);
+                return EXIT_FAILURE;
+            }
+        } else if (!strncmp(argv[argc], "-F", 2)) {
+            if ((sscanf(&argv[argc][2], "%d", &soak_fill) != 1) || (soak_fill < 1) || (soak_fill > 100)) {
+                fprintf(stderr, "Incorrect -F parameter!\n");
+                return EXIT_FAILURE;
+            }
+        } else if (!strncmp(argv[argc], "-s", 2)) {
+            if (!parse_sizes(&argv[argc][2])) {
+                fprintf(stderr, "Incorrect -s parameter!\n");
+                return EXIT_FAILURE;
+            }
+        } else if (!strncmp(argv[argc], "-d", 2) || !strncmp(argv[argc], "-f", 2) || !strncmp(argv[argc], "-c", 2) ||
+                !strncmp(argv[argc], "-D", 2)) {
+            char* target = (argv[argc][1] == 'd') ? directory : ((argv[argc][1] == 'f') ? options_path :
+                ((argv[argc][1] == 'c') ? csv_path : device_path));
+            size_t input_len = strlen(&argv[argc][2]);
+            if ((input_len < 1) || (input_len > 254)) {
+                fprintf(stderr, "Incorrect %.2s parameter length!\n", argv[argc]);
+                return EXIT_FAILURE;
+            }
+            strcpy(target, &argv[argc][2]);
+        } else {
+            fprintf(stderr, "Unknown option \"%s\"!\n", argv[argc]);
+            fflush(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_count < 1) cpu_count = 1;
+    if (!max_threads) max_threads = (cpu_count > MAX_THREADS) ? MAX_THREADS : cpu_count;
+    PERSIMQ_options_init(&options);
+    options.file_size = 16*1024*1024;
+    if (options_path[0] && !PERSIMQ_options_load(&options, options_path)) {
+        perror("Options file read error");
+        return EXIT_FAILURE;
+    }
+    if (device_path[0]) {
+        T_PERSIMQ_DeviceModel model;
+        memset(&model, 0, sizeof(model));
+        if (!PERSIMQ_device_model_load(&model, device_path)) {
+            perror("Device model file read error");
+            return EXIT_FAILURE;
+        }
+        PERSIMQ_set_device_model(&model);
+    }
+    size_t max_size = 0;
+    for (int idx = 0; idx < size_count; idx++) if (sizes[idx] > max_size) max_size = sizes[idx];
+    if (options.file_size < (off_t)(max_size + 64) * BATCH_SIZE * 2) {
+        fprintf(stderr, "Queue file size is too small for the message size!\n");
+        return EXIT_FAILURE;
+    }
+    FILE* csv = NULL;
+    if (csv_path[0]) {
+        csv = fopen(csv_path, "w");
+        if (!csv) {
+            perror("CSV file open error");
+            return EXIT_FAILURE;
+        }
+    }
+    if (soak_seconds) {
+        bool ok = run_soak(csv);
+        if (csv) fclose(csv);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (csv) {
+        fprintf(csv, "mode,size,threads,messages,seconds,rate,scaling,cycles,instructions,cache_misses,context_switches\n");
+    }
+
+    printf("--- Benchmarking \"%s\": %d CPUs, up to %d threads, %" PRIu64 " messages per thread%s ---\n",
+        directory, cpu_count, max_threads, messages_per_thread, pin_threads ? ", pinned" : "");
+    printf("Counters are per delivered message (push + get + pop), n/a - not available.\n");
+    print_header();
+    bool ok = true;
+    for (int mode = 0; ok && (mode < MODE_COUNT); mode++) {
+        if ((selected_mode >= 0) && (mode != selected_mode)) continue;
+        int mode_max = max_threads;
+        if ((mode == MODE_STRIPE) && (mode_max > PERSIMQ_STRIPE_MAX_QUEUES)) mode_max = PERSIMQ_STRIPE_MAX_QUEUES;
+        for (int size_idx = 0; ok && (size_idx < size_count); size_idx++) {
+            double base_rate = 0;
+            for (int threads = 1; ok; threads *= 2) {
+                if (threads > mode_max) {
+                    if ((threads / 2) == mode_max) break;
+                    threads = mode_max; // Always finish with the limit
+                }
+                T_Result result;
+                ok = run_point(mode, sizes[size_idx], threads, &result);
+                if (!ok) {
+                    fprintf(stderr, "Benchmark failed: mode %s, size %zu, %d threads!\n",
+                        mode_names[mode], sizes[size_idx], threads);
+                    break;
+                }
+                if (threads == 1) base_rate = result.rate;
+                result.scaling = (base_rate > 0) ? (result.rate / base_rate) : 0;
+                print_result(&result);
+                if (csv) write_csv(csv, &result);
+            }
+        }
+    }
+    if (csv) fclose(csv);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
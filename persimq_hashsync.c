@@ -0,0 +1,135 @@
+// ---------------------------------------------------------------------------
+// persimq_hashsync - compares two replicas of a PERSIMQ queue file and
+// optionally makes the target equal to the source. Only the blocks with
+// different hashes in the block hash trees of the files are reported and
+// copied, so the work depends on the divergence, not on the file size.
+// ---------------------------------------------------------------------------
+#include <stdint.h>
+#include <inttypes.h> // printf() definitions for stdint
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include "persimq.h"
+
+const char APP_VERSION[] = "1.0";
+
+#define DEFAULT_BLOCK_SIZE (64*1024)
+#define MAX_LISTED_BLOCKS  (1024)
+
+static char source_path[255] = "";
+static char target_path[255] = "";
+static uint32_t block_size = DEFAULT_BLOCK_SIZE;
+static bool repair = false;
+static bool debug_output = false;
+
+int main(int argc, char *argv[])
+{
+    // - Check for parameters -
+    int paths = 0;
+    for (int arg = 1; arg < argc; arg++) {
+        if (!strcmp(argv[arg], "-v") || !strcmp(argv[arg], "-V")) {
+            printf("libpersimq replica compare/repair utility.\n");
+            printf("Version: %s\n", APP_VERSION);
+            return EXIT_SUCCESS;
+        } else if (!strcmp(argv[arg], "-h") || !strcmp(argv[arg], "-H") || !strcmp(argv[arg], "-?")) {
+            printf("persimq_hashsync %s - compares (and repairs) replicas of a libpersimq queue file.\n", APP_VERSION);
+            printf("Usage: persimq_hashsync [options] <source queue file> <target queue file>\n");
+            printf("The queues must not be open by other processes. The block hash trees are kept in\n");
+            printf("\"<queue file>.hashes\" files and rebuilt when missing or outdated. The target is only\n");
+            printf("written with -r, the files must have the same size.\n");
+            printf("Available options:\n");
+            printf("-b<bytes>        : hash block size, a power of two (default: %u)\n", DEFAULT_BLOCK_SIZE);
+            printf("-r               : copy the divergent blocks and the queue state to the target\n");
+            printf("-d               : show debug messages\n");
+            printf("-h or -H or -?   : show this text\n");
+            return EXIT_SUCCESS;
+        } else if (!strcmp(argv[arg], "-r")) {
+            repair = true;
+        } else if (!strcmp(argv[arg], "-d")) {
+            debug_output = true;
+        } else if (!strncmp(argv[arg], "-b", 2)) {
+            if ((sscanf(&argv[arg][2], "%" SCNu32, &block_size) != 1) || (block_size < 64) ||
+                    (block_size & (block_size - 1))) {
+                fprintf(stderr, "Incorrect -b parameter!\n");
+                return EXIT_FAILURE;
+            }
+        } else if ((argv[arg][0] != '-') && (paths < 2)) {
+            char* target = paths++ ? target_path : source_path;
+            if (strlen(argv[arg]) > 254) {
+                fprintf(stderr, "File name is too long!\n");
+                return EXIT_FAILURE;
+            }
+            strcpy(target, argv[arg]);
+        } else {
+            fprintf(stderr, "Unknown option \"%s\"!\n", argv[arg]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (paths < 2) {
+        fprintf(stderr, "Source and target queue files must be provided! See -h for more info.\n");
+        return EXIT_FAILURE;
+    }
+    struct stat st;
+    if (stat(source_path, &st)) {
+        perror("Source file access error");
+        return EXIT_FAILURE;
+    }
+    // Opening with another file size would reset the queue, only a missing target is created (-r)
+    struct stat target_st;
+    if (stat(target_path, &target_st)) {
+        if (!repair) {
+            perror("Target file access error");
+            return EXIT_FAILURE;
+        }
+    } else if (target_st.st_size != st.st_size) {
+        fprintf(stderr, "The source and target queue files differ in size (%" PRId64 " and %" PRId64 " bytes)!\n",
+            (int64_t)st.st_size, (int64_t)target_st.st_size);
+        return EXIT_FAILURE;
+    }
+    PERSIMQ_set_debug_verbosity(debug_output ? PERSIMQ_VERBOSITY_INFO : PERSIMQ_VERBOSITY_ERRORS_ONLY);
+
+    T_PERSIMQ_Options options;
+    PERSIMQ_options_init(&options);
+    options.file_size = st.st_size;
+    options.hash_block_size = block_size;
+    T_PERSIMQ source, target;
+    if (!PERSIMQ_open_with_options(&source, source_path, &options)) {
+        fprintf(stderr, "Can not open the source queue file!\n");
+        return EXIT_FAILURE;
+    }
+    // The target is only written with -r (its tree is kept in memory otherwise)
+    if (!(repair ? PERSIMQ_open_with_options(&target, target_path, &options) :
+            PERSIMQ_open_readonly(&target, target_path))) {
+        fprintf(stderr, "Can not open the target queue file!\n");
+        PERSIMQ_close(&source);
+        return EXIT_FAILURE;
+    }
+    static off_t offsets[MAX_LISTED_BLOCKS];
+    int64_t divergent = PERSIMQ_hash_diff(&source, &target, offsets, MAX_LISTED_BLOCKS);
+    bool ok = (divergent >= 0);
+    for (int64_t idx = 0; idx < divergent; idx++) {
+        if (idx == MAX_LISTED_BLOCKS) {
+            printf("... (%" PRId64 " more)\n", divergent - MAX_LISTED_BLOCKS);
+            break;
+        }
+        off_t end = offsets[idx] + block_size;
+        printf("0x%" PRIX64 "-0x%" PRIX64 "\n", (uint64_t)offsets[idx], (uint64_t)((end < st.st_size) ? end : st.st_size));
+    }
+    bool state_differs = (source.append_ptr != target.append_ptr) || (source.extract_ptr != target.extract_ptr) ||
+        (source.count_messages != target.count_messages);
+    if (ok) {
+        printf("--- %" PRId64 " blocks differ%s. ---\n", divergent, state_differs ? ", queue state differs" : "");
+    }
+    if (ok && repair && (divergent || state_differs)) {
+        uint64_t copied = 0;
+        ok = PERSIMQ_hash_repair(&target, &source, &copied);
+        printf(ok ? "--- %" PRIu64 " blocks copied, the target is in sync. ---\n" : "--- Repair failed! ---\n", copied);
+    }
+    ok &= PERSIMQ_close(&target);
+    ok &= PERSIMQ_close(&source);
+    fflush(stdout);
+    return ok ? (repair || (!divergent && !state_differs) ? EXIT_SUCCESS : 2) : EXIT_FAILURE;
+}
@@ -0,0 +1,153 @@
+// ---------------------------------------------------------------------------
+// persimq_merge - merges several PERSIMQ queue files into one ordered stream.
+// The source files are read in large sequential chunks and merged by a key
+// field of the payloads (a timestamp or a sequence number). The result goes
+// to a new queue file or to the standard output as length prefixed records.
+// ---------------------------------------------------------------------------
+#include <stdint.h>
+#include <inttypes.h> // printf() definitions for stdint
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "persimq.h"
+
+const char APP_VERSION[] = "1.0";
+
+#define MAX_FILES          (1024)
+#define READ_CHUNK_SIZE    (1024*1024)    // Sequential read size of every source
+#define WRITE_BURST_SIZE   (4*1024*1024)  // Output queue writes are batched up to this size
+#define OUTPUT_BUFFER_SIZE (1024*1024)
+
+static char* files[MAX_FILES];
+static unsigned file_count = 0;
+static char output_path[255] = "";
+static off_t output_size = 0;             // 0 - fit all the source messages
+static size_t key_offset = 0;
+static size_t key_size = 0;
+static bool debug_output = false;
+
+// Writes a record to the standard output: 32-bit little endian payload size and the payload.
+static bool write_record(const void* message, size_t message_size)
+{
+    uint8_t size[4] = {
+        message_size & 0xFF, (message_size >> 8) & 0xFF, (message_size >> 16) & 0xFF, (message_size >> 24) & 0xFF
+    };
+    return (fwrite(size, 1, sizeof(size), stdout) == sizeof(size)) &&
+        (fwrite(message, 1, message_size, stdout) == message_size);
+}
+
+int main(int argc, char *argv[])
+{
+    // - Check for parameters -
+    while (--argc > 0) {
+        if (!strcmp(argv[argc], "-v") || !strcmp(argv[argc], "-V")) {
+            printf("libpersimq queue merger.\n");
+            printf("Version: %s\n", APP_VERSION);
+            return EXIT_SUCCESS;
+        } else if (!strcmp(argv[argc], "-h") || !strcmp(argv[argc], "-H") || !strcmp(argv[argc], "-?")) {
+            printf("persimq_merge %s - merges libpersimq queue files into one ordered stream.\n", APP_VERSION);
+            printf("Usage: persimq_merge [options] <queue file>...\n");
+            printf("Available options:\n");
+            printf("-k<off>:<size>   : merge key - unsigned little endian payload field at <off> of <size>\n");
+            printf("                   (1-8) bytes, for example a timestamp. The sources must be ordered by\n");
+            printf("                   the key. Without a key the messages are taken from the files in turn.\n");
+            printf("-o<file>         : write the result to a new queue file (default: the standard output,\n");
+            printf("                   every record is a 32-bit little endian size followed by the payload)\n");
+            printf("-s<bytes>        : output queue file size (default: fits all the source messages)\n");
+            printf("-d               : show debug messages\n");
+            printf("-h or -H or -?   : show this text\n");
+            return EXIT_SUCCESS;
+        } else if (!strcmp(argv[argc], "-d")) {
+            debug_output = true;
+        } else if (!strncmp(argv[argc], "-k", 2)) {
+            if ((sscanf(&argv[argc][2], "%zu:%zu", &key_offset, &key_size) != 2) || (key_size < 1) || (key_size > 8)) {
+                fprintf(stderr, "Incorrect -k parameter!\n");
+                return EXIT_FAILURE;
+            }
+        } else if (!strncmp(argv[argc], "-s", 2)) {
+            int64_t size;
+            if ((sscanf(&argv[argc][2], "%" SCNd64, &size) != 1) || (size < 1)) {
+                fprintf(stderr, "Incorrect -s parameter!\n");
+                return EXIT_FAILURE;
+            }
+            output_size = size;
+        } else if (!strncmp(argv[argc], "-o", 2)) {
+            size_t input_len = strlen(&argv[argc][2]);
+            if ((input_len < 1) || (input_len > (sizeof(output_path)-1))) {
+                fprintf(stderr, "Incorrect -o parameter length!\n");
+                return EXIT_FAILURE;
+            }
+            strcpy(output_path, &argv[argc][2]);
+        } else if (argv[argc][0] == '-') {
+            fprintf(stderr, "Unknown option \"%s\"!\n", argv[argc]);
+            return EXIT_FAILURE;
+        } else {
+            if (file_count >= MAX_FILES) {
+                fprintf(stderr, "Too many queue files!\n");
+                return EXIT_FAILURE;
+            }
+            files[file_count++] = argv[argc];
+        }
+    }
+    if (!file_count) {
+        fprintf(stderr, "Queue files must be provided! See -h for more info.\n");
+        return EXIT_FAILURE;
+    }
+    // The arguments were parsed backwards, restore the order of the files
+    for (unsigned i = 0; i < (file_count / 2); i++) {
+        char* path = files[i];
+        files[i] = files[file_count - 1 - i];
+        files[file_count - 1 - i] = path;
+    }
+    PERSIMQ_set_debug_verbosity(debug_output ? PERSIMQ_VERBOSITY_INFO : PERSIMQ_VERBOSITY_ERRORS_ONLY);
+
+    T_PERSIMQ_Merge merge;
+    if (!PERSIMQ_merge_open(&merge, files, file_count, READ_CHUNK_SIZE, key_offset, key_size)) {
+        fprintf(stderr, "Can not open the source queue files!\n");
+        return EXIT_FAILURE;
+    }
+    T_PERSIMQ output;
+    bool to_queue = (output_path[0] != 0);
+    if (to_queue) {
+        T_PERSIMQ_Options options;
+        PERSIMQ_options_init(&options);
+        // The message headers are the same so the source queue bytes plus some slack are enough
+        options.file_size = output_size ? output_size : (off_t)(merge.total_bytes + merge.total_bytes / 64 + 65536);
+        options.sync_interval = 0;
+        options.burst_size = WRITE_BURST_SIZE;
+        if (!PERSIMQ_open_with_options(&output, output_path, &options)) {
+            fprintf(stderr, "Can not open the output queue file!\n");
+            PERSIMQ_merge_close(&merge);
+            return EXIT_FAILURE;
+        }
+    } else {
+        setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    }
+
+    const void* message;
+    size_t message_size;
+    uint64_t merged = 0;
+    bool ok = true;
+    while (ok && PERSIMQ_merge_next(&merge, &message, &message_size, NULL)) {
+        ok = to_queue ? PERSIMQ_push(&output, (void*)message, message_size) : write_record(message, message_size);
+        if (ok) merged++;
+    }
+    if (merge.error) {
+        fprintf(stderr, "Source queue read error!\n");
+        ok = false;
+    } else if (!ok) {
+        fprintf(stderr, to_queue ? "Output queue is full!\n" : "Output write error!\n");
+    }
+    PERSIMQ_merge_close(&merge);
+    if (to_queue) {
+        ok &= PERSIMQ_close(&output);
+    } else {
+        ok &= !fflush(stdout);
+    }
+    fprintf(stderr, "--- %" PRIu64 " of %" PRIu64 " messages merged from %u files. ---\n",
+        merged, merge.total_messages, file_count);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
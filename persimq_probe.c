@@ -0,0 +1,301 @@
+// ---------------------------------------------------------------------------
+// persimq_probe - storage device characterization for PERSIMQ queues.
+// Runs a short series of I/O tests in the target directory and recommends
+// the queue options for the device. The options are saved to a file which
+// can be loaded with PERSIMQ_options_load().
+// ---------------------------------------------------------------------------
+#define _GNU_SOURCE   // O_DIRECT and fallocate()
+#include <stdint.h>
+#include <inttypes.h> // printf() definitions for stdint
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <linux/falloc.h>
+#include "persimq.h"
+
+const char APP_VERSION[] = "1.0";
+
+#define PROBE_FILE_NAME    ".persimq_probe.tmp"
+#define SMALL_WRITE_SIZE   (64)          // Typical small message with its header
+#define PAGE_SIZE_GUESS    (4096)
+#define BANDWIDTH_CHUNK    (1024*1024)
+#define SYNC_OVERHEAD_RATIO (10)         // Auto-sync cost should not exceed 1/10 of the push cost
+#define MAX_SYNC_INTERVAL  (4096)
+#define MAX_FILE_SIZE      (256LL*1024*1024)
+
+static char directory[255] = ".";
+static char options_path[255] = "persimq.conf";
+static char queue_path[255] = "";
+static int iterations = 32;
+static int bandwidth_mb = 32;
+static char probe_path[512];
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Latency distribution summary
+typedef struct {
+    double p50, p90, p99, max, avg;
+} T_Latency;
+
+static T_Latency summarize(double* samples, int count)
+{
+    T_Latency result = { 0 };
+    if (count < 1) return result;
+    qsort(samples, count, sizeof(double), compare_doubles);
+    for (int i = 0; i < count; i++) result.avg += samples[i];
+    result.avg /= count;
+    result.p50 = samples[count / 2];
+    result.p90 = samples[(count * 9) / 10];
+    result.p99 = samples[(count * 99) / 100];
+    result.max = samples[count - 1];
+    return result;
+}
+
+static void print_latency(const char* name, T_Latency* lat)
+{
+    printf("  %-28s avg %9.1f us, p50 %9.1f us, p90 %9.1f us, p99 %9.1f us, max %9.1f us\n",
+        name, lat->avg, lat->p50, lat->p90, lat->p99, lat->max);
+}
+
+// Small write followed by a sync call, the way PERSIMQ_sync() uses the file.
+static bool measure_sync(int fd, bool data_only, T_Latency* result)
+{
+    double* samples = calloc(iterations, sizeof(double));
+    if (!samples) return false;
+    uint8_t data[SMALL_WRITE_SIZE];
+    memset(data, 0x5A, sizeof(data));
+    bool ok = true;
+    for (int i = 0; ok && (i < iterations); i++) {
+        ok = (pwrite(fd, data, sizeof(data), i * sizeof(data)) == sizeof(data));
+        double start = now_us();
+        ok = ok && ((data_only ? fdatasync(fd) : fsync(fd)) >= 0);
+        samples[i] = now_us() - start;
+    }
+    if (ok) *result = summarize(samples, iterations);
+    free(samples);
+    return ok;
+}
+
+// Durable write cost of page aligned vs. unaligned small writes.
+static bool measure_small_writes(int fd, bool aligned, bool synced, T_Latency* result)
+{
+    double* samples = calloc(iterations, sizeof(double));
+    if (!samples) return false;
+    uint8_t data[PAGE_SIZE_GUESS];
+    memset(data, 0xA5, sizeof(data));
+    size_t length = aligned ? PAGE_SIZE_GUESS : SMALL_WRITE_SIZE;
+    bool ok = true;
+    for (int i = 0; ok && (i < iterations); i++) {
+        // Unaligned writes straddle a page boundary just like the ring records do
+        off_t offset = aligned ? (off_t)i * PAGE_SIZE_GUESS : (off_t)(i + 1) * PAGE_SIZE_GUESS - SMALL_WRITE_SIZE / 2;
+        double start = now_us();
+        ok = (pwrite(fd, data, length, offset) == length);
+        ok = ok && (!synced || (fdatasync(fd) >= 0));
+        samples[i] = now_us() - start;
+    }
+    if (ok) *result = summarize(samples, iterations);
+    free(samples);
+    return ok;
+}
+
+// Sequential write and (cold cache) read bandwidth in MB/s.
+static bool measure_bandwidth(int fd, double* write_mbs, double* read_mbs)
+{
+    uint8_t* chunk = malloc(BANDWIDTH_CHUNK);
+    if (!chunk) return false;
+    memset(chunk, 0x3C, BANDWIDTH_CHUNK);
+    bool result = true;
+    double start = now_us();
+    for (int i = 0; result && (i < bandwidth_mb); i++) {
+        result &= (pwrite(fd, chunk, BANDWIDTH_CHUNK, (off_t)i * BANDWIDTH_CHUNK) == BANDWIDTH_CHUNK);
+    }
+    result &= (fdatasync(fd) >= 0);
+    *write_mbs = bandwidth_mb / ((now_us() - start) / 1e6);
+    // Drop the cached pages so that the device gets actually read
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    start = now_us();
+    for (int i = 0; result && (i < bandwidth_mb); i++) {
+        result &= (pread(fd, chunk, BANDWIDTH_CHUNK, (off_t)i * BANDWIDTH_CHUNK) == BANDWIDTH_CHUNK);
+    }
+    *read_mbs = bandwidth_mb / ((now_us() - start) / 1e6);
+    free(chunk);
+    return result;
+}
+
+static bool check_direct_io(void)
+{
+    int fd = open(probe_path, O_RDWR | O_DIRECT);
+    if (fd < 0) return false;
+    void* buffer;
+    bool result = !posix_memalign(&buffer, PAGE_SIZE_GUESS, PAGE_SIZE_GUESS);
+    if (result) {
+        memset(buffer, 0, PAGE_SIZE_GUESS);
+        result = (pwrite(fd, buffer, PAGE_SIZE_GUESS, 0) == PAGE_SIZE_GUESS);
+        free(buffer);
+    }
+    close(fd);
+    return result;
+}
+
+static bool check_hole_punch(int fd)
+{
+    return !fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, PAGE_SIZE_GUESS);
+}
+
+int main(int argc, char *argv[])
+{
+    // - Check for parameters -
+    while (--argc > 0) {
+        if (!strcmp(argv[argc], "-v") || !strcmp(argv[argc], "-V")) {
+            printf("libpersimq storage probe.\n");
+            printf("Version: %s\n", APP_VERSION);
+            return EXIT_SUCCESS;
+        } else if (!strcmp(argv[argc], "-h") || !strcmp(argv[argc], "-H") || !strcmp(argv[argc], "-?")) {
+            printf("persimq probe %s - storage device characterization for libpersimq queues.\n", APP_VERSION);
+            printf("Measures the target directory storage and recommends the queue options.\n");
+            printf("Available options:\n");
+            printf("-d<dir>   : directory to test (default: current directory)\n");
+            printf("-o<file>  : options file to write (default: persimq.conf)\n");
+            printf("-q<file>  : existing queue file the options are for (its size is kept)\n");
+            printf("-n<count> : amount of iterations for the latency tests (default: 32)\n");
+            printf("-b<MB>    : amount of data for the bandwidth test (default: 32)\n");
+            printf("-h or -H or -?   : show this text\n");
+            return EXIT_SUCCESS;
+        } else if (!strncmp(argv[argc], "-n", 2)) {
+            if ((sscanf(&argv[argc][2], "%d", &iterations) != 1) || (iterations < 1)) {
+                fprintf(stderr, "Incorrect -n parameter!\n");
+                return EXIT_FAILURE;
+            }
+        } else if (!strncmp(argv[argc], "-b", 2)) {
+            if ((sscanf(&argv[argc][2], "%d", &bandwidth_mb) != 1) || (bandwidth_mb < 1)) {
+                fprintf(stderr, "Incorrect -b parameter!\n");
+                return EXIT_FAILURE;
+            }
+        } else if (!strncmp(argv[argc], "-d", 2) || !strncmp(argv[argc], "-o", 2) || !strncmp(argv[argc], "-q", 2)) {
+            char* target = (argv[argc][1] == 'd') ? directory : (argv[argc][1] == 'o') ? options_path : queue_path;
+            size_t input_len = strlen(&argv[argc][2]);
+            if ((input_len < 1) || (input_len > 254)) {
+                fprintf(stderr, "Incorrect %.2s parameter length!\n", argv[argc]);
+                return EXIT_FAILURE;
+            }
+            strcpy(target, &argv[argc][2]);
+        } else {
+            fprintf(stderr, "Unknown option \"%s\"!\n", argv[argc]);
+            fflush(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    snprintf(probe_path, sizeof(probe_path), "%s/%s", directory, PROBE_FILE_NAME);
+    int fd = open(probe_path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        perror("Probe file open error");
+        return EXIT_FAILURE;
+    }
+    if (ftruncate(fd, (off_t)bandwidth_mb * BANDWIDTH_CHUNK)) {
+        perror("Probe file size error");
+        close(fd); unlink(probe_path);
+        return EXIT_FAILURE;
+    }
+
+    printf("--- Probing \"%s\" ---\n", directory);
+    fflush(stdout);
+    T_Latency fsync_lat, fdatasync_lat, aligned_lat, unaligned_lat, buffered_lat;
+    double write_mbs = 0, read_mbs = 0;
+    bool ok = true;
+    ok = ok && measure_sync(fd, false, &fsync_lat);
+    ok = ok && measure_sync(fd, true, &fdatasync_lat);
+    ok = ok && measure_small_writes(fd, true, true, &aligned_lat);
+    ok = ok && measure_small_writes(fd, false, true, &unaligned_lat);
+    ok = ok && measure_small_writes(fd, false, false, &buffered_lat);
+    ok = ok && measure_bandwidth(fd, &write_mbs, &read_mbs);
+    bool direct_io = ok && check_direct_io();
+    bool hole_punch = ok && check_hole_punch(fd);
+    close(fd);
+    unlink(probe_path);
+    if (!ok) {
+        perror("Probe I/O error");
+        return EXIT_FAILURE;
+    }
+
+    printf("Sync latency:\n");
+    print_latency("fsync", &fsync_lat);
+    print_latency("fdatasync", &fdatasync_lat);
+    printf("Small write cost:\n");
+    print_latency("aligned page + fdatasync", &aligned_lat);
+    print_latency("unaligned record + fdatasync", &unaligned_lat);
+    print_latency("unaligned record, buffered", &buffered_lat);
+    printf("Sequential bandwidth: write %.1f MB/s, read %.1f MB/s\n", write_mbs, read_mbs);
+    printf("O_DIRECT support: %s\n", direct_io ? "yes" : "no");
+    printf("Hole punch support: %s\n", hole_punch ? "yes" : "no");
+
+    // - Recommendations -
+    T_PERSIMQ_Options options;
+    PERSIMQ_options_init(&options);
+    // The queue file size never changes once opened so fdatasync() is enough
+    options.sync_data_only = (fdatasync_lat.p50 <= fsync_lat.p50);
+    // Batch enough push/pop calls per sync to keep the sync overhead low
+    double sync_cost = options.sync_data_only ? fdatasync_lat.p50 : fsync_lat.p50;
+    double push_cost = (buffered_lat.p50 > 0.1) ? buffered_lat.p50 : 0.1;
+    uint64_t interval = (uint64_t)(sync_cost / (push_cost * SYNC_OVERHEAD_RATIO)) + 1;
+    options.sync_interval = (interval > MAX_SYNC_INTERVAL) ? MAX_SYNC_INTERVAL : interval;
+    // Leave most of the free space to the rest of the system
+    struct statvfs vfs;
+    off_t file_size = 16*1024*1024;
+    if (!statvfs(directory, &vfs)) {
+        file_size = ((off_t)vfs.f_bavail * vfs.f_frsize) / 4;
+        if (file_size > MAX_FILE_SIZE) file_size = MAX_FILE_SIZE;
+        file_size &= ~((off_t)PAGE_SIZE_GUESS - 1);
+    }
+    // PERSIMQ_open() resets a queue whose file has a different size, an existing queue keeps its size
+    struct stat queue_st;
+    bool existing = queue_path[0] && !stat(queue_path, &queue_st);
+    if (existing) file_size = queue_st.st_size;
+    options.file_size = file_size;
+
+    printf("--- Recommendations ---\n");
+    printf("  engine:         fd (buffered I/O%s)\n", direct_io ? ", O_DIRECT is available" : "");
+    printf("  alignment:      %s\n", (unaligned_lat.p50 > aligned_lat.p50 * 1.5) ?
+        "unaligned writes are expensive, prefer page sized batches" : "no benefit from aligned writes");
+    printf("  sync policy:    %s every %" PRIu32 " push/pop calls\n",
+        options.sync_data_only ? "fdatasync" : "fsync", options.sync_interval);
+    printf("  file size:      %" PRIu64 " bytes%s\n", (uint64_t)options.file_size,
+        existing ? " (the size of the existing queue)" : "");
+    if (!existing) {
+        printf("WARNING: the file size is only meant for new queues, an existing queue file of a different\n"
+            "size is reset (all its messages are lost) when opened. Use -q<file> to keep its size.\n");
+    }
+
+    char comment[512];
+    snprintf(comment, sizeof(comment),
+        "Generated by persimq_probe %s for \"%s\".\n"
+        "fdatasync p50 %.1f us, p99 %.1f us; write %.1f MB/s, read %.1f MB/s.%s",
+        APP_VERSION, directory, fdatasync_lat.p50, fdatasync_lat.p99, write_mbs, read_mbs, existing ? "" :
+        "\nfile_size is for new queues only: an existing queue of a different size is reset when opened.");
+    if (!PERSIMQ_options_save(&options, options_path, comment)) {
+        perror("Options file write error");
+        return EXIT_FAILURE;
+    }
+    printf("--- Options saved to \"%s\". ---\n", options_path);
+    fflush(stdout);
+    return EXIT_SUCCESS;
+}
@@ -6,12 +6,14 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
-/*#include <fcntl.h>
 #include <unistd.h>
+#include <poll.h>
+/*#include <fcntl.h>
 #include <termios.h>
 #include <errno.h>
 */
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include "persimq.h"
 
 const char APP_VERSION[] = "1.0";
@@ -24,6 +26,110 @@ static int debug_output = PRINT_DEBUG_OFF;
 static int print_max = 10;
 static char filename[255] = "";
 static bool queue_clear = false;
+static bool queue_follow = false;
+
+#define FOLLOW_POLL_MS    (1000)      // Queue header re-check period when no file events arrive
+#define READ_CHUNK_SIZE   (64*1024)   // Batched read size
+#define OUTPUT_BUFFER_SIZE (64*1024)
+
+static void print_message(int message_number, const uint8_t* message, size_t mes_size)
+{
+    printf("Message %d: [ ", message_number);
+    for (size_t i = 0; i < mes_size; i++) {
+        printf("0x%02" PRIX8, message[i]);
+        if (i < (mes_size-1)) printf(", ");
+    }
+    printf(" ]\n");
+}
+
+// Prints up to "print_max" messages without locking or changing the queue.
+static int print_snapshot(void)
+{
+    T_PERSIMQ mq;
+    if (!PERSIMQ_open_readonly(&mq, filename)) {
+        perror("PERSIMQ_open_readonly error"); return EXIT_FAILURE;
+    }
+    T_PERSIMQ_Cursor cursor;
+    if (!PERSIMQ_cursor_init(&cursor, &mq, READ_CHUNK_SIZE, mq.extract_ptr, mq.count_bytes)) {
+        perror("PERSIMQ_cursor_init error"); return EXIT_FAILURE;
+    }
+    int message_counter = 0;
+    const void* message;
+    size_t mes_size = 0;
+    while ((message_counter < print_max) && PERSIMQ_cursor_next(&cursor, &message, &mes_size)) {
+        print_message(++message_counter, message, mes_size);
+    }
+    bool failed = cursor.error;
+    PERSIMQ_cursor_free(&cursor);
+    PERSIMQ_drop(&mq);
+    if (failed) {
+        fprintf(stderr, "Queue read error!\n"); return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Streams the messages as they get committed to the queue file by the owner process.
+// The queue is opened read-only so the owner's lock and pointers are never touched.
+static int follow_queue(void)
+{
+    T_PERSIMQ mq;
+    if (!PERSIMQ_open_readonly(&mq, filename)) {
+        perror("PERSIMQ_open_readonly error"); return EXIT_FAILURE;
+    }
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    // The header gets rewritten on each sync so file modification events are a good wake-up source.
+    // Plain polling is used as a fallback (and to catch the events lost between the checks).
+    int inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if ((inotify_fd >= 0) && (inotify_add_watch(inotify_fd, filename, IN_MODIFY | IN_CLOSE_WRITE) < 0)) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    if ((inotify_fd < 0) && debug_output) {
+        printf("inotify is not available, polling the queue file...\n");
+    }
+    printf("--- Following the queue, press Ctrl+C to stop. ---\n");
+    fflush(stdout);
+
+    off_t cursor_ptr = mq.append_ptr;
+    int message_counter = 0;
+    while (true) {
+        if (inotify_fd >= 0) {
+            struct pollfd pfd = { inotify_fd, POLLIN, 0 };
+            if (poll(&pfd, 1, FOLLOW_POLL_MS) > 0) {
+                uint8_t events[4096];
+                while (read(inotify_fd, events, sizeof(events)) > 0); // Drain the event queue
+            }
+        } else {
+            usleep(FOLLOW_POLL_MS * 1000);
+        }
+        if (!PERSIMQ_refresh(&mq) || (cursor_ptr == mq.append_ptr)) continue;
+
+        off_t consumed = PERSIMQ_distance(&mq, mq.extract_ptr, cursor_ptr);
+        if (consumed > mq.count_bytes) { // Our position has already been consumed and reused
+            printf("--- Messages skipped, continuing from the queue head. ---\n");
+            cursor_ptr = mq.extract_ptr;
+            consumed = 0;
+        }
+        T_PERSIMQ_Cursor cursor;
+        if (!PERSIMQ_cursor_init(&cursor, &mq, READ_CHUNK_SIZE, cursor_ptr, mq.count_bytes - consumed)) {
+            perror("PERSIMQ_cursor_init error"); return EXIT_FAILURE;
+        }
+        const void* message;
+        size_t mes_size = 0;
+        while (PERSIMQ_cursor_next(&cursor, &message, &mes_size)) {
+            print_message(++message_counter, message, mes_size);
+        }
+        if (cursor.error) { // Most likely the data got overwritten while we were reading it
+            printf("--- Queue read error, continuing from the queue tail. ---\n");
+            cursor_ptr = mq.append_ptr;
+        } else {
+            cursor_ptr = cursor.offset;
+        }
+        PERSIMQ_cursor_free(&cursor);
+        fflush(stdout);
+    }
+    return EXIT_SUCCESS;
+}
 
 int main(int argc, char *argv[])
 {
@@ -41,6 +147,7 @@ int main(int argc, char *argv[])
             printf("-f or -F : select queue storage file (mandatory)\n");
             printf("-n or -N : the maximum amout of messages to print out (default: 10)\n");
             printf("-e or -E : extract all messages from the queue\n");
+            printf("-t or -T : follow mode - print the messages as they are committed to the queue\n");
             printf("-d       : show debug messages\n");
             printf("-D       : show verbose debug messages (-d is ignored when -D is set)\n");
             printf("-h or -H or -?   : show this text\n");
@@ -51,6 +158,8 @@ int main(int argc, char *argv[])
             debug_output = PRINT_DEBUG_VERBOSE;
         } else if (!strcmp(argv[argc], "-e") || !strcmp(argv[argc], "-E")) {
             queue_clear = true;
+        } else if (!strcmp(argv[argc], "-t") || !strcmp(argv[argc], "-T")) {
+            queue_follow = true;
         } else if (!strncmp(argv[argc], "-n", 2) || !strncmp(argv[argc], "-N", 2)) {
             if (sscanf(&argv[argc][2], "%d", &print_max) != 1) {
                 fprintf(stderr, "Incorrect -n parameter format!\n");
@@ -98,6 +207,13 @@ int main(int argc, char *argv[])
     PERSIMQ_set_debug_verbosity((debug_output > PRINT_DEBUG_ON) ? PERSIMQ_VERBOSITY_DEBUG :
                                 debug_output ? PERSIMQ_VERBOSITY_INFO:
                                 PERSIMQ_VERBOSITY_ERRORS_ONLY);
+    if (queue_follow) return follow_queue();
+    if (!queue_clear) {
+        int result = print_snapshot();
+        printf("--- Processing complete! ---\n");
+        fflush(stdout);
+        return result;
+    }
     T_PERSIMQ mq;
 
     if (!PERSIMQ_open(&mq, filename, st.st_size)) {
@@ -110,12 +226,7 @@ int main(int argc, char *argv[])
         if (!PERSIMQ_get(&mq, buf, sizeof(buf), &mes_size)) {
             perror("PERSIMQ_get error"); exit(EXIT_FAILURE);
         }
-        printf("Message %d: [ ", ++message_counter);
-        for (size_t i = 0; i < mes_size; i++) {
-            printf("0x%02" PRIX8, buf[i]);
-            if (i < (mes_size-1)) printf(", ");
-        }
-        printf(" ]\n");
+        print_message(++message_counter, buf, mes_size);
         if (!PERSIMQ_pop(&mq)) {
             perror("PERSIMQ_pop error"); exit(EXIT_FAILURE);
         }
@@ -131,14 +242,8 @@ int main(int argc, char *argv[])
     printf("+++ PERSIMQ_get_all() got %" PRIu64 " messages, %" PRIu64 " bytes total.\n", read_count, (uint64_t)total_size);
     */
 
-    if (queue_clear) {
-        if (!PERSIMQ_close(&mq)) {
-            perror("PERSIMQ_close error"); exit(EXIT_FAILURE);
-        }
-    } else {
-        if (!PERSIMQ_drop(&mq)) {
-            perror("PERSIMQ_drop error"); exit(EXIT_FAILURE);
-        }
+    if (!PERSIMQ_close(&mq)) {
+        perror("PERSIMQ_close error"); exit(EXIT_FAILURE);
     }
 
     printf("--- Processing complete! ---\n");
@@ -0,0 +1,339 @@
+// ---------------------------------------------------------------------------
+// persimq_scan - parallel offline search over PERSIMQ queue files.
+// Walks the messages of every queue file given with large sequential reads
+// and prints the ones matching all the predicates (byte pattern, field value
+// comparisons, size range). The files are scanned by a pool of threads.
+// ---------------------------------------------------------------------------
+#define _GNU_SOURCE   // memmem()
+#include <stdint.h>
+#include <inttypes.h> // printf() definitions for stdint
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "persimq.h"
+
+const char APP_VERSION[] = "1.0";
+
+#define MAX_FILES          (256)
+#define MAX_PATTERNS       (8)
+#define MAX_PATTERN_SIZE   (256)
+#define MAX_COMPARES       (8)
+#define MAX_THREADS        (64)
+#define READ_CHUNK_SIZE    (4*1024*1024)  // Sequential read size of a worker
+#define OUTPUT_BUFFER_SIZE (64*1024)
+
+// Field comparison operators
+typedef enum {
+    OP_EQ = 0,
+    OP_NE,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_COUNT
+} T_Operator;
+
+static const char* operator_names[OP_COUNT] = { "==", "!=", "<", "<=", ">", ">=" };
+
+// Byte pattern to be found anywhere in the payload
+typedef struct {
+    uint8_t data[MAX_PATTERN_SIZE];
+    size_t size;
+} T_Pattern;
+
+// Comparison of an unsigned little endian payload field
+typedef struct {
+    size_t offset;
+    size_t size;    // 1, 2, 4 or 8 bytes
+    T_Operator op;
+    uint64_t value;
+} T_Compare;
+
+static char* files[MAX_FILES];
+static int file_count = 0;
+static T_Pattern patterns[MAX_PATTERNS];
+static int pattern_count = 0;
+static T_Compare compares[MAX_COMPARES];
+static int compare_count = 0;
+static size_t min_size = 0;
+static size_t max_size = SIZE_MAX;
+static uint64_t max_matches = UINT64_MAX;  // Per file
+static bool dump_payload = false;
+static int thread_count = 0;
+
+static int next_file = 0;                  // Next file to be taken by a worker
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t matches;
+    int failed_files;
+} T_Totals;
+
+static T_Totals totals;
+
+// Checks a message against all the predicates.
+static bool message_matches(const uint8_t* message, size_t message_size)
+{
+    if ((message_size < min_size) || (message_size > max_size)) return false;
+    for (int i = 0; i < compare_count; i++) {
+        const T_Compare* compare = &compares[i];
+        if ((compare->offset + compare->size) > message_size) return false;
+        uint64_t value = 0;
+        for (size_t byte = 0; byte < compare->size; byte++) {
+            value |= (uint64_t)message[compare->offset + byte] << (byte * 8);
+        }
+        bool result;
+        switch (compare->op) {
+            case OP_EQ: result = (value == compare->value); break;
+            case OP_NE: result = (value != compare->value); break;
+            case OP_LT: result = (value < compare->value); break;
+            case OP_LE: result = (value <= compare->value); break;
+            case OP_GT: result = (value > compare->value); break;
+            default:    result = (value >= compare->value); break;
+        }
+        if (!result) return false;
+    }
+    for (int i = 0; i < pattern_count; i++) {
+        // glibc memmem() is vectorized, the payloads are searched in place in the read buffer
+        if (!memmem(message, message_size, patterns[i].data, patterns[i].size)) return false;
+    }
+    return true;
+}
+
+// Appends a match to the output buffer of a worker.
+static void print_match(FILE* output, const char* path, uint64_t sequence, off_t offset,
+    const uint8_t* message, size_t message_size)
+{
+    if (offset) {
+        fprintf(output, "%s:%" PRIu64 ":0x%" PRIX64 ":%" PRIu64, path, sequence, (uint64_t)offset, (uint64_t)message_size);
+    } else { // The message is inside a compressed frame and has no record of its own
+        fprintf(output, "%s:%" PRIu64 ":frame:%" PRIu64, path, sequence, (uint64_t)message_size);
+    }
+    if (dump_payload) {
+        fputc(':', output);
+        for (size_t i = 0; i < message_size; i++) fprintf(output, "%02" PRIX8, message[i]);
+    }
+    fputc('\n', output);
+}
+
+// Scans a single queue file. The matches are kept in "output" until the file is done
+// so that the lines of different files never get mixed.
+static bool scan_file(const char* path, FILE* output, T_Totals* file_totals)
+{
+    T_PERSIMQ mq;
+    if (!PERSIMQ_open_readonly(&mq, (char*)path)) {
+        fprintf(stderr, "%s: can not open the queue file!\n", path);
+        return false;
+    }
+    T_PERSIMQ_Cursor cursor;
+    if (!PERSIMQ_cursor_init(&cursor, &mq, READ_CHUNK_SIZE, mq.extract_ptr, mq.count_bytes)) {
+        fprintf(stderr, "%s: out of memory!\n", path);
+        PERSIMQ_drop(&mq);
+        return false;
+    }
+    uint64_t sequence = 0;
+    const void* message;
+    size_t message_size;
+    while ((file_totals->matches < max_matches) && PERSIMQ_cursor_next(&cursor, &message, &message_size)) {
+        if (message_matches(message, message_size)) {
+            print_match(output, path, sequence, cursor.record_offset, message, message_size);
+            file_totals->matches++;
+        }
+        file_totals->messages++;
+        file_totals->bytes += message_size;
+        sequence++;
+    }
+    bool result = !cursor.error;
+    if (!result) fprintf(stderr, "%s: damaged record at offset 0x%" PRIX64 "!\n", path, (uint64_t)cursor.offset);
+    PERSIMQ_cursor_free(&cursor);
+    PERSIMQ_drop(&mq);
+    return result;
+}
+
+static void* worker_main(void* arg)
+{
+    (void)arg;
+    char* output_data = NULL;
+    size_t output_size = 0;
+    while (true) {
+        int index = __atomic_fetch_add(&next_file, 1, __ATOMIC_RELAXED);
+        if (index >= file_count) break;
+        FILE* output = open_memstream(&output_data, &output_size);
+        if (!output) {
+            fprintf(stderr, "Out of memory!\n");
+            break;
+        }
+        T_Totals file_totals = { 0 };
+        bool ok = scan_file(files[index], output, &file_totals);
+        fclose(output);
+        pthread_mutex_lock(&output_lock);
+        fwrite(output_data, 1, output_size, stdout);
+        totals.messages += file_totals.messages;
+        totals.bytes += file_totals.bytes;
+        totals.matches += file_totals.matches;
+        if (!ok) totals.failed_files++;
+        pthread_mutex_unlock(&output_lock);
+        free(output_data);
+        output_data = NULL;
+    }
+    return NULL;
+}
+
+// Parses "<hex bytes>" into a pattern.
+static bool parse_hex_pattern(const char* text, T_Pattern* pattern)
+{
+    pattern->size = 0;
+    while (*text) {
+        unsigned int byte;
+        if (!isxdigit((unsigned char)text[0]) || !isxdigit((unsigned char)text[1]) ||
+                (sscanf(text, "%2x", &byte) != 1) || (pattern->size >= MAX_PATTERN_SIZE)) {
+            return false;
+        }
+        pattern->data[pattern->size++] = byte;
+        text += 2;
+    }
+    return (pattern->size > 0);
+}
+
+// Parses "<offset>:<size><operator><value>", for example "8:4>=1700000000".
+static bool parse_compare(const char* text, T_Compare* compare)
+{
+    int length = 0;
+    if ((sscanf(text, "%zu:%zu%n", &compare->offset, &compare->size, &length) != 2) ||
+            ((compare->size != 1) && (compare->size != 2) && (compare->size != 4) && (compare->size != 8))) {
+        return false;
+    }
+    text += length;
+    // Two character operators go first so that "<=" is not taken for "<"
+    static const T_Operator order[OP_COUNT] = { OP_EQ, OP_NE, OP_LE, OP_GE, OP_LT, OP_GT };
+    for (int i = 0; i < OP_COUNT; i++) {
+        size_t op_length = strlen(operator_names[order[i]]);
+        if (!strncmp(text, operator_names[order[i]], op_length)) {
+            compare->op = order[i];
+            char* end;
+            compare->value = strtoull(text + op_length, &end, 0);
+            return (end != (text + op_length)) && !*end;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    // - Check for parameters -
+    while (--argc > 0) {
+        if (!strcmp(argv[argc], "-v") || !strcmp(argv[argc], "-V")) {
+            printf("libpersimq queue scanner.\n");
+            printf("Version: %s\n", APP_VERSION);
+            return EXIT_SUCCESS;
+        } else if (!strcmp(argv[argc], "-h") || !strcmp(argv[argc], "-H") || !strcmp(argv[argc], "-?")) {
+            printf("persimq_scan %s - parallel search over libpersimq queue files.\n", APP_VERSION);
+            printf("Usage: persimq_scan [options] <queue file>...\n");
+            printf("Prints \"file:sequence:offset:size\" for every message matching all the predicates\n");
+            printf("(the sequence is the position of the message from the queue head, the offset is the\n");
+            printf("record offset in the file or \"frame\" for the messages of compressed frames).\n");
+            printf("Available options:\n");
+            printf("-s<text>         : payload contains the text\n");
+            printf("-x<hex>          : payload contains the bytes, for example -xDEADBEEF\n");
+            printf("-c<off>:<size><op><value> : unsigned little endian field at <off> of <size> (1, 2, 4, 8)\n");
+            printf("                   bytes compared with <op> (==, !=, <, <=, >, >=) to the value.\n");
+            printf("                   Use two comparisons of the timestamp field for a time range.\n");
+            printf("-z<min>:<max>    : payload size range in bytes\n");
+            printf("-m<count>        : stop after <count> matches in each file\n");
+            printf("-t<count>        : amount of threads (default: amount of CPUs)\n");
+            printf("-p               : also print the payloads in hex\n");
+            printf("-h or -H or -?   : show this text\n");
+            return EXIT_SUCCESS;
+        } else if (!strcmp(argv[argc], "-p")) {
+            dump_payload = true;
+        } else if (!strncmp(argv[argc], "-s", 2) || !strncmp(argv[argc], "-x", 2)) {
+            T_Pattern* pattern = &patterns[pattern_count];
+            bool ok = (pattern_count < MAX_PATTERNS);
+            if (ok && (argv[argc][1] == 's')) {
+                pattern->size = strlen(&argv[argc][2]);
+                ok = (pattern->size > 0) && (pattern->size <= MAX_PATTERN_SIZE);
+                if (ok) memcpy(pattern->data, &argv[argc][2], pattern->size);
+            } else if (ok) {
+                ok = parse_hex_pattern(&argv[argc][2], pattern);
+            }
+            if (!ok) {
+                fprintf(stderr, "Incorrect %.2s parameter!\n", argv[argc]);
+                return EXIT_FAILURE;
+            }
+            pattern_count++;
+        } else if (!strncmp(argv[argc], "-c", 2)) {
+            if ((compare_count >= MAX_COMPARES) || !parse_compare(&argv[argc][2], &compares[compare_count])) {
+                fprintf(stderr, "Incorrect -c parameter!\n");
+                return EXIT_FAILURE;
+            }
+            compare_count++;
+        } else if (!strncmp(argv[argc], "-z", 2)) {
+            if ((sscanf(&argv[argc][2], "%zu:%zu", &min_size, &max_size) != 2) || (min_size > max_size)) {
+                fprintf(stderr, "Incorrect -z parameter!\n");
+                return EXIT_FAILURE;
+            }
+        } else if (!strncmp(argv[argc], "-m", 2)) {
+            if ((sscanf(&argv[argc][2], "%" SCNu64, &max_matches) != 1) || (max_matches < 1)) {
+                fprintf(stderr, "Incorrect -m parameter!\n");
+                return EXIT_FAILURE;
+            }
+        } else if (!strncmp(argv[argc], "-t", 2)) {
+            if ((sscanf(&argv[argc][2], "%d", &thread_count) != 1) || (thread_count < 1) || (thread_count > MAX_THREADS)) {
+                fprintf(stderr, "Incorrect -t parameter!\n");
+                return EXIT_FAILURE;
+            }
+        } else if (argv[argc][0] == '-') {
+            fprintf(stderr, "Unknown option \"%s\"!\n", argv[argc]);
+            return EXIT_FAILURE;
+        } else {
+            if (file_count >= MAX_FILES) {
+                fprintf(stderr, "Too many queue files!\n");
+                return EXIT_FAILURE;
+            }
+            files[file_count++] = argv[argc];
+        }
+    }
+    if (!file_count) {
+        fprintf(stderr, "Queue files must be provided! See -h for more info.\n");
+        return EXIT_FAILURE;
+    }
+    // The arguments were parsed backwards, restore the order of the files
+    for (int i = 0; i < (file_count / 2); i++) {
+        char* path = files[i];
+        files[i] = files[file_count - 1 - i];
+        files[file_count - 1 - i] = path;
+    }
+    if (!thread_count) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = (cpus < 1) ? 1 : ((cpus > MAX_THREADS) ? MAX_THREADS : cpus);
+    }
+    if (thread_count > file_count) thread_count = file_count;
+
+    PERSIMQ_set_debug_verbosity(PERSIMQ_VERBOSITY_SILENT);
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t threads[MAX_THREADS];
+    int started = 0;
+    for (; started < thread_count; started++) {
+        if (pthread_create(&threads[started], NULL, worker_main, NULL)) break;
+    }
+    if (!started) worker_main(NULL);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fflush(stdout);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "--- %" PRIu64 " matches in %" PRIu64 " messages (%.1f MB) of %d files, %.3f s, %.1f MB/s ---\n",
+        totals.matches, totals.messages, totals.bytes / 1e6, file_count, seconds,
+        (seconds > 0) ? (totals.bytes / 1e6 / seconds) : 0.0);
+    return totals.failed_files ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,93 @@
+// ---------------------------------------------------------------------------
+// tx_replay - regression test for the transaction log recovery.
+// A commit must be replayed when its queue header did not make it to the disk,
+// but never again once the queue has moved on (even back to the same state).
+// ---------------------------------------------------------------------------
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "persimq.h"
+
+#define QUEUE_SIZE (64*1024)
+
+static char directory[] = "/tmp/persimq_test_XXXXXX";
+static char queue_path[256];
+static char log_path[256];
+static int failures = 0;
+
+static void check(bool condition, const char* what)
+{
+    printf("%s: %s\n", condition ? "ok  " : "FAIL", what);
+    if (!condition) failures++;
+}
+
+static bool open_queue(T_PERSIMQ* mq)
+{
+    T_PERSIMQ_Options options;
+    PERSIMQ_options_init(&options);
+    options.file_size = QUEUE_SIZE;
+    strcpy(options.tx_log_path, log_path);
+    return PERSIMQ_open_with_options(mq, queue_path, &options);
+}
+
+// Pushes three messages in a transaction, consumes them and clears the queue: the queue is back
+// in the state the commit started from.
+static void test_clear_then_reopen(void)
+{
+    T_PERSIMQ mq;
+    T_PERSIMQ_Transaction tx;
+    check(open_queue(&mq) && PERSIMQ_tx_open(&tx, log_path), "open");
+    for (int idx = 0; idx < 3; idx++) PERSIMQ_tx_push(&tx, &mq, "abc", 3);
+    check(PERSIMQ_tx_commit(&tx), "commit");
+    while (PERSIMQ_messages_available(&mq)) PERSIMQ_pop(&mq);
+    check(PERSIMQ_clear(&mq), "clear");
+    PERSIMQ_close(&mq);
+    check(open_queue(&mq) && !PERSIMQ_messages_available(&mq), "clear then reopen (transaction open)");
+    PERSIMQ_close(&mq);
+    PERSIMQ_tx_close(&tx);
+    check(open_queue(&mq) && !PERSIMQ_messages_available(&mq), "clear then reopen (transaction closed)");
+    PERSIMQ_close(&mq);
+}
+
+// Loses the header written by a commit: the commit is replayed once, a later clear sticks.
+static void test_lost_header(void)
+{
+    T_PERSIMQ mq;
+    T_PERSIMQ_Transaction tx;
+    check(open_queue(&mq) && PERSIMQ_tx_open(&tx, log_path), "open");
+    uint8_t old_header[64];
+    PERSIMQ_tx_push(&tx, &mq, "one", 3);
+    check(pread(mq.fd, old_header, sizeof(old_header), 0) == sizeof(old_header), "header read");
+    check(PERSIMQ_tx_commit(&tx), "commit");
+    check(pwrite(mq.fd, old_header, sizeof(old_header), 0) == sizeof(old_header), "header write");
+    PERSIMQ_drop(&mq);
+    check(open_queue(&mq) && (PERSIMQ_messages_available(&mq) == 1), "lost header replayed");
+    check(PERSIMQ_clear(&mq), "clear");
+    PERSIMQ_close(&mq);
+    check(open_queue(&mq) && !PERSIMQ_messages_available(&mq), "replayed commit not replayed again");
+    PERSIMQ_close(&mq);
+    PERSIMQ_tx_close(&tx);
+}
+
+int main(void)
+{
+    if (!mkdtemp(directory)) {
+        perror("Test directory");
+        return EXIT_FAILURE;
+    }
+    PERSIMQ_set_debug_verbosity(PERSIMQ_VERBOSITY_ERRORS_ONLY);
+    snprintf(queue_path, sizeof(queue_path), "%s/queue.dat", directory);
+    snprintf(log_path, sizeof(log_path), "%s/tx.log", directory);
+    test_clear_then_reopen();
+    char command[512];
+    snprintf(command, sizeof(command), "rm -f %s/*", directory);
+    if (system(command)) failures++;
+    test_lost_header();
+    snprintf(command, sizeof(command), "rm -rf %s", directory);
+    if (system(command)) failures++;
+    printf("%s\n", failures ? "--- tx_replay FAILED ---" : "--- tx_replay passed ---");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}